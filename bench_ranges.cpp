@@ -0,0 +1,301 @@
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <sstream>
+#include <chrono>
+#include <cstdlib>
+
+#include "templateio.hpp"
+#include "parser_combinators.hpp"
+#include "profile.hpp"
+#include "stream_iterator.hpp"
+#include "memory_range.hpp"
+#include "rope_range.hpp"
+#include "compressed_range.hpp"
+#include "readahead_range.hpp"
+#include "mmap_range.hpp"
+
+using namespace std;
+
+//----------------------------------------------------------------------------
+// The CSV parser from "test_combinators.cpp", over each of the ranges: a
+// stream_range, records in memory, a rope of fragments, compressed input,
+// input read ahead, and mmap'd input.
+
+struct parse_int {
+    parse_int() {}
+    void operator() (vector<int> *ts, string const& num) const {
+        ts->push_back(stoi(num));
+    }
+} const parse_int;
+
+struct parse_line {
+    parse_line() {}
+    void operator() (vector<vector<int>> *ts, vector<int> &line) const {
+        ts->push_back(move(line)); // move modifies 'line' so don't make it const
+    }
+} const parse_line;
+
+auto const number_tok = tokenise(some(accept(is_digit)));
+auto const separator_tok = tokenise(accept(is_char(',')));
+
+auto const csv_line = all(parse_line, sep_by(all(parse_int, number_tok), separator_tok));
+
+// lines are independent, so after the first they are parsed in parallel
+// chunks split at newlines (when the input is mmap'd).
+auto const parse_csv = strict("error parsing csv",
+    first_token && csv_line && parallel_many(csv_line, is_eol)
+);
+
+struct csv_parser;
+
+template <typename Range>
+int parse(Range const &r) {
+    decltype(parse_csv)::result_type a; 
+    typename Range::iterator i = r.first;
+
+    profile<csv_parser> p;
+    if (parse_csv(i, r, &a)) {
+        cout << "OK\n";
+    } else {
+        cout << "FAIL\n";
+    }
+
+    int sum = 0;
+    for (int i = 0; i < a.size(); ++i) {
+        for (int j = 0; j < a[i].size(); j++) {
+           sum += a[i][j];
+        }
+    }
+    sum /= a.size();
+    cerr << sum << endl;
+    
+    return i - r.first;
+}
+
+//----------------------------------------------------------------------------
+// Each line again, as a separate record already in memory.
+
+struct record_parser;
+
+int parse_records(string const& text) {
+    vector<vector<int>> a;
+    int records = 0;
+    int sum = 0;
+
+    profile<record_parser> p;
+    for (size_t at = 0; at < text.size();) {
+        size_t const end = min(text.find('\n', at), text.size());
+        memory_range const line(text.data() + at, end - at);
+        char const* i = line.first;
+        if (!csv_line(i, line, &a) || i != line.last) {
+            cout << "FAIL at record " << records << "\n";
+            return at;
+        }
+        for (int const x : a.back()) {
+            sum += x;
+        }
+        a.clear();
+        ++records;
+        at = end + 1;
+    }
+    cerr << (records > 0 ? sum / records : 0) << endl;
+    return text.size();
+}
+
+//----------------------------------------------------------------------------
+// The whole file again, as a rope of the small buffers it might arrive in.
+
+int parse_fragments(string const& text, size_t const fragment_size) {
+    vector<pair<char const*, size_t>> fragments;
+    for (size_t at = 0; at < text.size(); at += fragment_size) {
+        fragments.emplace_back(text.data() + at, min(fragment_size, text.size() - at));
+    }
+    rope_range const rope(fragments);
+    return parse(rope);
+}
+
+//----------------------------------------------------------------------------
+// Compressed input, parsed as it is decompressed, against decompressing to a
+// file and then parsing that (mmap'd with USE_MMAP). These are timed on the
+// wall clock, as the decompression may be on another thread.
+
+bool is_compressed(string const& name) {
+    for (string const suffix : {".gz", ".zst"}) {
+        if (name.size() > suffix.size()
+            && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename F>
+void report_wall(char const* what, F const& f) {
+    auto const start = chrono::steady_clock::now();
+    int const chars = f();
+    auto const us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    cout << what << ": " << static_cast<double>(chars) / static_cast<double>(us.count() + 1) << "MB/s\n";
+}
+
+void parse_compressed(char const* name) {
+    for (bool const threaded : {true, false}) {
+        size_t retained = 0;
+        report_wall(threaded ? "streamed" : "streamed, one thread", [name, threaded, &retained] {
+            compressed_range const in(name, threaded);
+            int const chars = parse(in);
+            retained = in.retained();
+            return chars;
+        });
+        cout << "retained: " << retained << " bytes\n";
+    }
+    report_wall("decompressed first", [name] {
+        char tmp[] = "/tmp/test_combinators.XXXXXX";
+        int const fd = mkstemp(tmp);
+        if (fd < 0) {
+            throw runtime_error("unable to make a temporary file");
+        }
+        {
+            compressed_file z(name, false);
+            char buffer[1 << 16];
+            for (size_t n; (n = z.read(buffer, sizeof buffer)) > 0;) {
+                if (write(fd, buffer, n) != static_cast<ssize_t>(n)) {
+                    throw runtime_error("unable to write a temporary file");
+                }
+            }
+        }
+        close(fd);
+        int chars;
+        {
+            stream_range const in(tmp);
+            chars = parse(in);
+        }
+        unlink(tmp);
+        return chars;
+    });
+}
+
+//----------------------------------------------------------------------------
+// The file read ahead of the parser, against the stream_range (mmap'd with
+// USE_MMAP). With "-cold" the file is dropped from the page cache first, so
+// the reads go to the disk.
+
+bool cold = false;
+
+void drop_cached(char const* name) {
+    if (cold) {
+        int const fd = open(name, O_RDONLY);
+        if (fd >= 0) {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+void parse_readahead(char const* name) {
+    report_wall("stream range", [name] {
+        drop_cached(name);
+        stream_range const in(name);
+        return parse(in);
+    });
+    for (bool const use_uring : {true, false}) {
+        stall_stats stalls;
+        char const* engine = nullptr;
+        size_t retained = 0;
+        report_wall(use_uring ? "read ahead" : "read ahead, thread",
+            [name, use_uring, &stalls, &engine, &retained] {
+            drop_cached(name);
+            readahead_range const in(name, size_t(1) << 16, 4, use_uring);
+            int const chars = parse(in);
+            stalls = in.stalls();
+            engine = in.engine();
+            retained = in.retained();
+            return chars;
+        });
+        cout << engine << ": " << stalls.reads << " reads, " << stalls.stalls << " stalls, "
+            << static_cast<double>(stalls.stalled) / 1000.0 << "ms stalled, "
+            << retained << " bytes retained\n";
+    }
+}
+
+//----------------------------------------------------------------------------
+// The file mapped with each of the mmap_options, and through a sliding
+// window, with the page faults each takes.
+
+template <typename F>
+void report_faults(char const* what, F const& f) {
+    fault_counts const before = fault_counts::now();
+    report_wall(what, f);
+    fault_counts const faults = fault_counts::now() - before;
+    cout << "faults: " << faults.minor << " minor, " << faults.major << " major\n";
+}
+
+void parse_mmap(char const* name) {
+    mmap_options plain;
+    plain.sequential = false;
+    mmap_options sequential;
+    sequential.willneed = true;
+    mmap_options populate;
+    populate.populate = true;
+    mmap_options hugepages;
+    hugepages.hugepages = true;
+    for (auto const& o : {make_pair("mmap", plain), make_pair("mmap, sequential", sequential),
+        make_pair("mmap, populate", populate), make_pair("mmap, hugepages", hugepages)}) {
+        report_faults(o.first, [name, &o] {
+            drop_cached(name);
+            mmap_range const in(name, o.second);
+            return parse(in);
+        });
+    }
+    size_t mapped = 0;
+    report_faults("mmap, window", [name, &sequential, &mapped] {
+        drop_cached(name);
+        mmap_window_range const in(name, size_t(1) << 22, streamoff(1) << 23, sequential);
+        int const chars = parse(in);
+        mapped = in.high_water();
+        return chars;
+    });
+    cout << "window: " << mapped << " bytes mapped\n";
+}
+
+//----------------------------------------------------------------------------
+
+int main(int const argc, char const *argv[]) {
+    if (argc < 1) {
+        cerr << "no input files\n";
+    } else {
+        for (int i = 1; i < argc; ++i) {
+            if (string(argv[i]) == "-cold") {
+                cold = true;
+                continue;
+            }
+            if (is_compressed(argv[i])) {
+                cout << argv[i] << "\n";
+                parse_compressed(argv[i]);
+                continue;
+            }
+            profile<csv_parser>::reset();
+            stream_range in(argv[i]);
+            cout << argv[i] << "\n";
+            int const chars_read = parse(in);
+            double const mb_per_s = static_cast<double>(chars_read) / static_cast<double>(profile<csv_parser>::report());
+            cout << "parsed: " << mb_per_s << "MB/s\n";
+
+            profile<record_parser>::reset();
+            stringstream text;
+            text << ifstream(argv[i]).rdbuf();
+            int const record_chars = parse_records(text.str());
+            cout << "records: " << static_cast<double>(record_chars)
+                / static_cast<double>(profile<record_parser>::report()) << "MB/s\n";
+
+            profile<csv_parser>::reset();
+            int const fragment_chars = parse_fragments(text.str(), 4096);
+            cout << "fragments: " << static_cast<double>(fragment_chars)
+                / static_cast<double>(profile<csv_parser>::report()) << "MB/s\n";
+
+            parse_readahead(argv[i]);
+            parse_mmap(argv[i]);
+        }
+    }
+}
@@ -0,0 +1,544 @@
+//----------------------------------------------------------------------------
+// copyright 2014 Keean Schupke
+// compile with -std=c++11
+// block_range.hpp
+
+#ifndef BLOCK_RANGE_HPP
+#define BLOCK_RANGE_HPP
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include "parser_combinators.hpp"
+#include "parser_deep.hpp"
+
+using namespace std;
+
+//============================================================================
+// Block Buffered Range
+//
+// Reads its input from a source function, in fixed size blocks. Iterators are
+// pointers into a block, and only go back to the range at the end of a block.
+// When a new block is read, the blocks before the oldest mark (see Marks in
+// "parser_combinators.hpp") are freed, or before the block being read when
+// there are no marks, keeping one block before that so short lookahead and
+// errors still see it. The parsers that go back (attempt) mark where they
+// start, so backtracking never reads the input again, and memory is bounded
+// by the longest marked span, not the input size. Going back before a freed
+// position throws. The end of the input need not be known in advance, so
+// 'last' is a sentinel that compares equal to any iterator at the end.
+
+class block_range {
+public:
+    // reads at most 'n' characters to 'd', returns 0 at the end of input.
+    using source_type = function<size_t(char* d, size_t n)>;
+
+private:
+    struct block {
+        unique_ptr<char[]> data;
+        size_t lines;           // newlines before the block
+        streamoff line_start;   // offset of the line the block starts in
+    };
+
+    static constexpr streamoff npos = numeric_limits<streamoff>::max();
+
+    source_type const source;
+    size_t const block_size;
+    deque<block> blocks;
+    unique_ptr<char[]> spare;
+    size_t base;                // index of the first block kept
+    streamoff size;             // characters read so far
+    bool eof;
+    size_t lines;
+    streamoff line_start;
+    input_marks marks;
+
+    // free the blocks before the one before 'floor'.
+    void drop(streamoff const floor) {
+        for (size_t const b = static_cast<size_t>(floor) / block_size;
+            base + 1 < b && blocks.size() > 1; ++base) {
+            spare = move(blocks.front().data);
+            blocks.pop_front();
+        }
+    }
+
+    // read more input, into a new block if the last is full, as the reader
+    // wants the position 'reader'.
+    bool fill(streamoff const reader) {
+        if (eof) {
+            return false;
+        }
+        streamoff const end = static_cast<streamoff>((base + blocks.size()) * block_size);
+        if (blocks.empty() || size == end) {
+            drop(marks.oldest(reader));
+            blocks.push_back(block {spare ? move(spare) : unique_ptr<char[]>(new char[block_size]),
+                lines, line_start});
+        }
+        size_t const at = static_cast<size_t>(size % block_size);
+        char* const d = blocks.back().data.get();
+        size_t const n = source(d + at, block_size - at);
+        if (n == 0) {
+            eof = true;
+            return false;
+        }
+        for (char const* i = d + at; (i = static_cast<char const*>(memchr(i, '\n', d + at + n - i))) != nullptr;) {
+            ++lines;
+            line_start = size + (++i - (d + at));
+        }
+        size += n;
+        return true;
+    }
+
+public:
+    class iterator {
+        friend class block_range;
+
+        block_range* r;
+        streamoff pos;
+        char const* p;
+        char const* end;
+        int sym;
+
+        iterator(block_range* r, streamoff const pos) : r(r), pos(pos), p(nullptr), end(nullptr),
+            sym(EOF) {}
+
+    public:
+        int operator* () const {
+            return sym;
+        }
+
+        // only iterators at the end (like 'last') are EOF, and all are equal.
+        bool operator== (iterator const& i) const {
+            return (sym == i.sym) && (pos == i.pos || sym == EOF);
+        }
+
+        bool operator!= (iterator const& i) const {
+            return (sym != i.sym) || (pos != i.pos && sym != EOF);
+        }
+
+        streamoff operator- (iterator const& i) const {
+            return pos - i.pos;
+        }
+
+        iterator& operator++ () {
+            ++pos;
+            if (++p < end) {
+                sym = char_traits<char>::to_int_type(*p);
+            } else {
+                r->load(*this);
+            }
+            return *this;
+        }
+
+        iterator& operator-- () {
+            --pos;
+            r->load(*this);
+            return *this;
+        }
+    };
+private:
+    iterator start() {
+        iterator i(this, 0);
+        load(i);
+        return i;
+    }
+
+public:
+    iterator const last;
+    iterator const first;
+
+    explicit block_range(source_type s, size_t const block_size = size_t(1) << 16)
+        : source(move(s)), block_size(block_size), base(0), size(0), eof(false), lines(0),
+        line_start(0), last(this, npos), first(start()) {}
+
+    block_range(block_range const&) = delete;
+    block_range& operator= (block_range const&) = delete;
+
+    // point an iterator at its position, reading as far as it if needed.
+    void load(iterator& i) {
+        while (i.pos >= size) {
+            if (!fill(i.pos)) {
+                i.end = i.p = nullptr;
+                i.sym = EOF;
+                return;
+            }
+        }
+        size_t const b = static_cast<size_t>(i.pos) / block_size;
+        if (b < base) {
+            throw runtime_error("input before the oldest mark has been freed");
+        }
+        char const* const d = blocks[b - base].data.get();
+        i.p = d + (static_cast<size_t>(i.pos) - b * block_size);
+        i.end = d + min(block_size, static_cast<size_t>(size) - b * block_size);
+        i.sym = char_traits<char>::to_int_type(*i.p);
+    }
+
+    // the range can go back as far as the iterator until the mark is released.
+    size_t mark(iterator const& i) const {
+        return marks.mark(i.pos);
+    }
+
+    void release(size_t const m) const {
+        marks.release(m);
+    }
+
+    bool holds(ptrdiff_t const offset) const {
+        return offset >= 0 && offset < size && static_cast<size_t>(offset) / block_size >= base;
+    }
+
+    // the memory held for input.
+    size_t retained() const {
+        return blocks.size() * block_size;
+    }
+
+    // line and column (from 1) of an offset that has not been released.
+    pair<size_t, size_t> locate(ptrdiff_t const offset) const {
+        size_t const b = static_cast<size_t>(offset) / block_size;
+        if (b < base || b >= base + blocks.size()) {
+            return make_pair(size_t(0), size_t(0));
+        }
+        block const& k = blocks[b - base];
+        size_t row = k.lines + 1;
+        streamoff start = k.line_start;
+        streamoff const at = static_cast<streamoff>(b * block_size);
+        for (streamoff j = at; j < offset; ++j) {
+            if (k.data[j - at] == '\n') {
+                ++row;
+                start = j + 1;
+            }
+        }
+        return make_pair(row, static_cast<size_t>(offset - start + 1));
+    }
+};
+
+//----------------------------------------------------------------------------
+// Input stalls: how often, and for how long (in microseconds), a reader
+// waited for input that had been asked for but had not yet arrived.
+
+struct stall_stats {
+    size_t reads;
+    size_t stalls;
+    uint64_t stalled;
+
+    stall_stats() : reads(0), stalls(0), stalled(0) {}
+
+    template <typename Wait>
+    void time(Wait const& wait) {
+        auto const start = chrono::steady_clock::now();
+        wait();
+        ++stalls;
+        stalled += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    }
+};
+
+//----------------------------------------------------------------------------
+// Runs a source on a helper thread, which fills up to 'depth' buffers ahead
+// of the reader, so producing the input (reading or decompressing it)
+// overlaps parsing it. An exception from the source is thrown to the reader
+// when it reaches the point of the failure.
+
+class async_source {
+    struct buffer {
+        unique_ptr<char[]> data;
+        size_t size;
+        size_t at;
+        bool ready;
+    };
+
+    block_range::source_type const source;
+    size_t const buffer_size;
+    vector<buffer> buffers;
+    size_t current;
+    bool stop;
+    exception_ptr error;
+    stall_stats waits;
+    mutex lock;
+    condition_variable changed;
+    thread helper;
+
+    static vector<buffer> make_buffers(size_t const buffer_size, size_t const depth) {
+        vector<buffer> bs;
+        for (size_t i = 0; i < max(depth, size_t(2)); ++i) {
+            bs.push_back(buffer {unique_ptr<char[]>(new char[buffer_size]), 0, 0, false});
+        }
+        return bs;
+    }
+
+    void run() {
+        for (size_t b = 0;; b = (b + 1) % buffers.size()) {
+            buffer& f = buffers[b];
+            {
+                unique_lock<mutex> l(lock);
+                changed.wait(l, [this, &f] {return stop || !f.ready;});
+                if (stop) {
+                    return;
+                }
+            }
+            size_t n = 0;
+            exception_ptr e;
+            try {
+                for (size_t m; n < buffer_size && (m = source(f.data.get() + n, buffer_size - n)) > 0;) {
+                    n += m;
+                }
+            } catch (...) {
+                e = current_exception();
+                n = 0;
+            }
+            {
+                lock_guard<mutex> l(lock);
+                f.size = n;
+                f.at = 0;
+                f.ready = true;
+                error = e;
+            }
+            changed.notify_all();
+            if (n == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    explicit async_source(block_range::source_type s, size_t const buffer_size = size_t(1) << 16,
+        size_t const depth = 2) : source(move(s)), buffer_size(buffer_size),
+        buffers(make_buffers(buffer_size, depth)), current(0), stop(false),
+        helper(&async_source::run, this) {}
+
+    ~async_source() {
+        {
+            lock_guard<mutex> l(lock);
+            stop = true;
+        }
+        changed.notify_all();
+        helper.join();
+    }
+
+    async_source(async_source const&) = delete;
+    async_source& operator= (async_source const&) = delete;
+
+    size_t operator() (char* const d, size_t const n) {
+        buffer& f = buffers[current];
+        {
+            unique_lock<mutex> l(lock);
+            if (!f.ready) {
+                waits.time([this, &l, &f] {
+                    changed.wait(l, [&f] {return f.ready;});
+                });
+            }
+            if (f.size == 0) {
+                if (error) {
+                    rethrow_exception(error);
+                }
+                return 0;
+            }
+        }
+        ++waits.reads;
+        size_t const m = min(n, f.size - f.at);
+        memcpy(d, f.data.get() + f.at, m);
+        f.at += m;
+        if (f.at == f.size) {
+            {
+                lock_guard<mutex> l(lock);
+                f.ready = false;
+            }
+            changed.notify_all();
+            current = (current + 1) % buffers.size();
+        }
+        return m;
+    }
+
+    stall_stats const& stalls() const {
+        return waits;
+    }
+};
+
+//============================================================================
+// Push Parsing
+//
+// For input that arrives in pieces, a push parser parses a sequence of
+// records as the caller feeds it buffers, and passes each record's result to
+// a function as soon as it is complete. The parser runs in its own context,
+// on a block_range whose source suspends it when the buffers fed so far are
+// used up, so parsers need not be written to resume. Each record is marked
+// while it is parsed, so at most the longest record (and a block either side)
+// is held, and an error shows the record it is in. Input that is not a record
+// is an error, thrown from feed() or close(), after which the parser is
+// finished.
+
+// the function passed each result, without an argument for a recogniser.
+template <typename Result> struct push_emit {
+    using type = function<void(Result&)>;
+};
+
+template <> struct push_emit<void> {
+    using type = function<void()>;
+};
+
+template <typename Parser, typename Inherit = default_inherited>
+class push_parser {
+    using result_type = typename Parser::result_type;
+
+public:
+    using emit_type = typename push_emit<result_type>::type;
+
+private:
+    // thrown in the parser's context to unwind it when abandoned.
+    struct abandoned {};
+
+    Parser const p;
+    emit_type const emit;
+    Inherit* const st;
+    context_stack const stack;
+    ucontext_t caller;
+    ucontext_t callee;
+    recursion_depth* depth;
+    char const* data;
+    size_t size;
+    bool started;
+    bool closed;
+    bool finished;
+    bool abandon;
+    size_t held;
+    exception_ptr error;
+
+    static void entry(unsigned const hi, unsigned const lo) {
+        push_parser& q = *reinterpret_cast<push_parser*>((static_cast<uintptr_t>(hi) << 16 << 16) | lo);
+        try {
+            q.run();
+        } catch (abandoned const&) {
+        } catch (...) {
+            q.error = current_exception();
+        }
+        q.finished = true;
+        swapcontext(&q.callee, &q.caller);
+    }
+
+    // runs until the parser is waiting for input or finished.
+    void resume() {
+        recursion_depth*& d = recursion_depth::current();
+        recursion_depth* const outer = d;
+        d = depth;
+        started = true;
+        swapcontext(&caller, &callee);
+        depth = d;
+        d = outer;
+    }
+
+    size_t read(char* const d, size_t const n) {
+        while (size == 0 && !closed) {
+            swapcontext(&callee, &caller);
+            if (abandon) {
+                throw abandoned();
+            }
+        }
+        size_t const m = min(n, size);
+        memcpy(d, data, m);
+        data += m;
+        size -= m;
+        return m;
+    }
+
+    bool record(block_range::iterator& i, block_range const& r, true_type /*void*/) {
+        if (!p(i, r, nullptr, st)) {
+            return false;
+        }
+        emit();
+        return true;
+    }
+
+    bool record(block_range::iterator& i, block_range const& r, false_type /*void*/) {
+        result_type x {};
+        if (!p(i, r, &x, st)) {
+            return false;
+        }
+        emit(x);
+        return true;
+    }
+
+    void run() {
+        block_range r([this](char* d, size_t n) {
+            return read(d, n);
+        });
+        block_range::iterator i = r.first;
+        while (i != r.last) {
+            block_range::iterator const first = i;
+            auto const m = r.mark(i);
+            if (!record(i, r, is_void<result_type>())) {
+                raise_error((i == first) ? "unexpected character"
+                    : "failed many-parser consumed input", p, first, i, r);
+            }
+            held = max(held, r.retained());
+            r.release(m);
+        }
+    }
+
+    void check() const {
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
+public:
+    explicit push_parser(Parser const& q, emit_type f, Inherit* st = nullptr,
+        size_t const stack_size = size_t(1) << 26) : p(q), emit(move(f)), st(st),
+        stack(stack_size), depth(nullptr), data(nullptr), size(0), started(false),
+        closed(false), finished(false), abandon(false), held(0) {
+        uintptr_t const a = reinterpret_cast<uintptr_t>(this);
+        getcontext(&callee);
+        callee.uc_stack.ss_sp = stack.data();
+        callee.uc_stack.ss_size = stack.size();
+        callee.uc_link = nullptr;
+        makecontext(&callee, reinterpret_cast<void (*)()>(entry), 2,
+            static_cast<unsigned>(a >> 16 >> 16), static_cast<unsigned>(a));
+    }
+
+    ~push_parser() {
+        if (started && !finished) {
+            abandon = true;
+            resume();
+        }
+    }
+
+    push_parser(push_parser const&) = delete;
+    push_parser& operator= (push_parser const&) = delete;
+
+    // parse as far as the buffer allows, which may be reused on return.
+    void feed(char const* const d, size_t const n) {
+        data = d;
+        size = n;
+        if (!finished && n > 0) {
+            resume();
+        }
+        size = 0;
+        check();
+    }
+
+    // the end of the input, parse what is left.
+    void close() {
+        closed = true;
+        if (!finished) {
+            resume();
+        }
+        check();
+    }
+
+    bool done() const {
+        return finished;
+    }
+
+    // the most memory held for input at once.
+    size_t high_water() const {
+        return held;
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return p.ebnf(defs);
+    }
+};
+
+#endif // BLOCK_RANGE_HPP
@@ -0,0 +1,240 @@
+//----------------------------------------------------------------------------
+// copyright 2014 Keean Schupke
+// compile with -std=c++11, link with -lz (and -lzstd with USE_ZSTD)
+// compressed_range.hpp
+
+#ifndef COMPRESSED_RANGE_HPP
+#define COMPRESSED_RANGE_HPP
+
+#include <memory>
+#include <exception>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#include "block_range.hpp"
+
+using namespace std;
+
+//============================================================================
+// Decompressing Sources
+//
+// Sources for a block_range that decompress a file descriptor as it is read,
+// so compressed input is parsed without first being written out. Each reads
+// the compressed input in pieces of 'in_size', and returns 0 only at the end
+// of the input; input that is corrupt, or ends inside a compressed stream,
+// throws.
+
+// gzip or zlib, including concatenated gzip members (as 'cat a.gz b.gz').
+class inflate_source {
+    int const fd;
+    size_t const in_size;
+    unique_ptr<Bytef[]> in;
+    z_stream z;
+    bool input_end;
+    bool stream_end;
+
+public:
+    explicit inflate_source(int const fd, size_t const in_size = size_t(1) << 16)
+        : fd(fd), in_size(in_size), in(new Bytef[in_size]), z(), input_end(false),
+        stream_end(false) {
+        // 15 bits of window, +32 to detect gzip or zlib from the header.
+        if (inflateInit2(&z, 15 + 32) != Z_OK) {
+            throw runtime_error("unable to start inflating");
+        }
+    }
+
+    ~inflate_source() {
+        inflateEnd(&z);
+    }
+
+    inflate_source(inflate_source const&) = delete;
+    inflate_source& operator= (inflate_source const&) = delete;
+
+    size_t operator() (char* const d, size_t const n) {
+        z.next_out = reinterpret_cast<Bytef*>(d);
+        z.avail_out = static_cast<uInt>(n);
+        while (z.avail_out > 0) {
+            if (z.avail_in == 0 && !input_end) {
+                ssize_t const m = ::read(fd, in.get(), in_size);
+                if (m < 0) {
+                    throw system_error(errno, system_category(), "unable to read compressed input");
+                }
+                input_end = (m == 0);
+                z.next_in = in.get();
+                z.avail_in = static_cast<uInt>(m);
+            }
+            if (z.avail_in == 0 && input_end) {
+                if (!stream_end) {
+                    throw runtime_error("compressed input is truncated");
+                }
+                break;
+            }
+            if (stream_end) {
+                // another member follows.
+                inflateReset(&z);
+                stream_end = false;
+            }
+            int const rc = inflate(&z, Z_NO_FLUSH);
+            if (rc == Z_STREAM_END) {
+                stream_end = true;
+            } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+                throw runtime_error("compressed input is corrupt");
+            }
+        }
+        return n - z.avail_out;
+    }
+};
+
+#ifdef USE_ZSTD
+
+// zstd, including concatenated frames.
+class zstd_source {
+    int const fd;
+    size_t const in_size;
+    unique_ptr<char[]> in;
+    ZSTD_DStream* const z;
+    ZSTD_inBuffer input;
+    bool input_end;
+    bool frame_end;
+
+public:
+    explicit zstd_source(int const fd, size_t const in_size = ZSTD_DStreamInSize())
+        : fd(fd), in_size(in_size), in(new char[in_size]), z(ZSTD_createDStream()),
+        input {in.get(), 0, 0}, input_end(false), frame_end(true) {
+        if (z == nullptr || ZSTD_isError(ZSTD_initDStream(z))) {
+            ZSTD_freeDStream(z);
+            throw runtime_error("unable to start zstd decompression");
+        }
+    }
+
+    ~zstd_source() {
+        ZSTD_freeDStream(z);
+    }
+
+    zstd_source(zstd_source const&) = delete;
+    zstd_source& operator= (zstd_source const&) = delete;
+
+    size_t operator() (char* const d, size_t const n) {
+        ZSTD_outBuffer output {d, n, 0};
+        while (output.pos < output.size) {
+            if (input.pos == input.size && !input_end) {
+                ssize_t const m = ::read(fd, in.get(), in_size);
+                if (m < 0) {
+                    throw system_error(errno, system_category(), "unable to read compressed input");
+                }
+                input_end = (m == 0);
+                input.size = static_cast<size_t>(m);
+                input.pos = 0;
+            }
+            if (input.pos == input.size && input_end) {
+                if (!frame_end) {
+                    throw runtime_error("compressed input is truncated");
+                }
+                break;
+            }
+            size_t const rc = ZSTD_decompressStream(z, &output, &input);
+            if (ZSTD_isError(rc)) {
+                throw runtime_error("compressed input is corrupt");
+            }
+            frame_end = (rc == 0);
+        }
+        return output.pos;
+    }
+};
+
+#endif // USE_ZSTD
+
+//============================================================================
+// Compressed Range
+//
+// A range over a compressed file, decompressed into blocks as it is parsed,
+// see "block_range.hpp". The format (gzip, zlib, or zstd with USE_ZSTD) is
+// found from the file's header. It has the same iterators as the stream_range
+// (without USE_MMAP), and frees the blocks behind the parser in the same way,
+// so memory is bounded by the longest span parsed under an attempt, however
+// large the decompressed input. With 'threaded' the decompression runs ahead
+// on a helper thread (an async_source, see "block_range.hpp").
+
+struct compressed_file {
+    int const fd;
+    block_range::source_type decoder;
+    unique_ptr<async_source> async;
+
+    explicit compressed_file(char const* name, bool const threaded = true)
+        : fd(::open(name, O_RDONLY)) {
+        if (fd < 0) {
+            throw runtime_error("unable to open file");
+        }
+        try {
+            unsigned char magic[4] = {0, 0, 0, 0};
+            ssize_t const m = ::pread(fd, magic, sizeof magic, 0);
+            if (m >= 2 && ((magic[0] == 0x1f && magic[1] == 0x8b)
+                || ((magic[0] & 0x0f) == 8 && ((magic[0] << 8) | magic[1]) % 31 == 0))) {
+                shared_ptr<inflate_source> const s = make_shared<inflate_source>(fd);
+                decoder = [s](char* d, size_t n) {return (*s)(d, n);};
+            } else if (m == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f
+                && magic[3] == 0xfd) {
+#ifdef USE_ZSTD
+                shared_ptr<zstd_source> const s = make_shared<zstd_source>(fd);
+                decoder = [s](char* d, size_t n) {return (*s)(d, n);};
+#else
+                throw runtime_error("zstd input needs USE_ZSTD");
+#endif
+            } else {
+                throw runtime_error("not a gzip, zlib or zstd file");
+            }
+            if (threaded) {
+                async.reset(new async_source(decoder));
+            }
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+    }
+
+    // the helper is stopped before the decoder and file go.
+    ~compressed_file() {
+        async.reset();
+        decoder = nullptr;
+        ::close(fd);
+    }
+
+    compressed_file(compressed_file const&) = delete;
+    compressed_file& operator= (compressed_file const&) = delete;
+
+    // decompressed input, 0 at the end.
+    size_t read(char* const d, size_t const n) {
+        return async ? (*async)(d, n) : decoder(d, n);
+    }
+};
+
+class compressed_range : private compressed_file, public block_range {
+public:
+    compressed_range(compressed_range const&) = delete;
+
+    explicit compressed_range(char const* name, bool const threaded = true)
+        : compressed_file(name, threaded), block_range([this](char* d, size_t n) {
+            return read(d, n);
+        }) {}
+
+    explicit compressed_range(string const& name, bool const threaded = true)
+        : compressed_range(name.c_str(), threaded) {}
+};
+
+#ifdef USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using pcompressed_handle = parser_inline_handle<compressed_range::iterator, compressed_range, Synthesize, Inherit>;
+
+#else // USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using pcompressed_handle = parser_handle<compressed_range::iterator, compressed_range, Synthesize, Inherit>;
+
+#endif // USE_INLINE_HANDLE
+
+#endif // COMPRESSED_RANGE_HPP
@@ -5,6 +5,7 @@
 
 #include "templateio.hpp"
 #include "parser_combinators.hpp"
+#include "parser_deep.hpp"
 #include "profile.hpp"
 #include "stream_iterator.hpp"
 
@@ -13,71 +14,82 @@ using namespace std;
 //----------------------------------------------------------------------------
 // Example Expression Evaluating File Parser.
 
-struct return_int {
-    return_int() {}
-    void operator() (int *res, string &num) const {
-        *res = stoi(num);
-    }
-} const return_int;
-
 struct return_add {
     return_add() {}
-    void operator() (int *res, int left, string&, int right) const {
+    void operator() (int *res, int left, char_span const&, int right) const {
         *res = left + right;
     }
 } const return_add;
 
 struct return_sub {
     return_sub() {}
-    void operator() (int *res, int left, string&, int right) const {
+    void operator() (int *res, int left, char_span const&, int right) const {
         *res = left - right;
     }
 } const return_sub;
 
 struct return_mul {
     return_mul() {}
-    void operator() (int *res, int left, string&, int right) const {
+    void operator() (int *res, int left, char_span const&, int right) const {
         *res = left * right;
     }
 } const return_mul;
 
 struct return_div {
     return_div() {}
-    void operator() (int *res, int left, string&, int right) const {
+    void operator() (int *res, int left, char_span const&, int right) const {
         *res = left / right;
     }
 } const return_div;
 
-auto const number_tok = tokenise(some(accept(is_digit)));
+auto const number_tok = tokenise(accept_int<unsigned>());
 auto const start_tok = tokenise(accept(is_char('(')));
 auto const end_tok = tokenise(accept(is_char(')')));
-auto const add_tok = tokenise(accept(is_char('+')));
-auto const sub_tok = tokenise(accept(is_char('-')));
-auto const mul_tok = tokenise(accept(is_char('*')));
-auto const div_tok = tokenise(accept(is_char('/')));
 
-using expression_handle = pstream_handle<int>;
+// the operators are passed to the functors as spans of the input, which are
+// not copied when the input is contiguous (mmap'd).
+auto const add_tok = tokenise(as_span(accept(is_char('+'))));
+auto const sub_tok = tokenise(as_span(accept(is_char('-'))));
+auto const mul_tok = tokenise(as_span(accept(is_char('*'))));
+auto const div_tok = tokenise(as_span(accept(is_char('/'))));
+
+struct return_int {
+    return_int() {}
+    void operator() (int *res, unsigned n) const {
+        *res = static_cast<int>(n);
+    }
+} const return_int;
 
 auto const number = define("number", all(return_int, number_tok));
 
-expression_handle const additive_expr(expression_handle e) {
-    return define("additive", log("+", attempt(all(return_add, e, add_tok, e)))
-        || log("-", all(return_sub, e, sub_tok, e)));
-}
+// The grammar is recursive: sub-expressions refer to the expression rule by
+// its tag, and rule_definition below supplies the definition, so the whole
+// grammar is static. The additive and multiplicative alternatives both start
+// by parsing a sub-expression, memoizing it means each one is only parsed
+// once.
+struct expression_rule {};
+auto const expr = rule<expression_rule, int>("expr");
 
-expression_handle const multiplicative_expr(expression_handle e) {
-    return define("multiplicative", log("*", attempt(all(return_mul, e, mul_tok, e)))
-        || log("/", all(return_div, e, div_tok, e)));
-}
+memo_stats expression_stats;
+auto const sub_expression = memo(expr, &expression_stats);
+
+auto const additive_expr = define("additive",
+    log("+", attempt(all(return_add, sub_expression, add_tok, sub_expression)))
+    || log("-", all(return_sub, sub_expression, sub_tok, sub_expression)));
 
-expression_handle recursive_expression(expression_handle expr) {
-    return attempt(number) || discard(start_tok) && (
-            attempt(additive_expr(expr)) || multiplicative_expr(expr))
-            && discard(end_tok);
+auto const multiplicative_expr = define("multiplicative",
+    log("*", attempt(all(return_mul, sub_expression, mul_tok, sub_expression)))
+    || log("/", all(return_div, sub_expression, div_tok, sub_expression)));
+
+auto const expression = attempt(number) || discard(start_tok) && (
+    attempt(additive_expr) || multiplicative_expr) && discard(end_tok);
+
+decltype(expression) const& rule_definition(expression_rule) {
+    return expression;
 }
 
-auto const expression = fix("expr", recursive_expression);
-auto const parser = first_token && strict("invalid expression", expression);
+// deeply nested expressions are parsed on a stack of their own.
+auto const parser = deep(first_token && strict("invalid expression", expr));
 
 struct expression_parser;
 
@@ -86,14 +98,20 @@ int parse(Range const &r) {
     decltype(parser)::result_type a {}; 
     typename Range::iterator i = r.first;
 
-    profile<expression_parser> p;
-    if (parser(i, r, &a)) {
-        cout << "OK\n";
-    } else {
-        cout << "FAIL\n";
+    {
+        // the memo tables are kept for this parse, and the counts added after.
+        memo_context memos;
+        profile<expression_parser> p;
+        if (parser(i, r, &a)) {
+            cout << "OK\n";
+        } else {
+            cout << "FAIL\n";
+        }
     }
 
     cout << a << "\n";
+    cout << "memo hits: " << expression_stats.hits << " misses: " << expression_stats.misses
+        << " evictions: " << expression_stats.evictions << "\n";
     
     return i - r.first;
 }
@@ -0,0 +1,93 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+
+#include "templateio.hpp"
+#include "parser_combinators.hpp"
+#include "profile.hpp"
+#include "memory_range.hpp"
+
+using namespace std;
+
+//----------------------------------------------------------------------------
+// Example Hex Token Parser: the same grammar as written, and after optimise(),
+// over the same input. The digit alternatives become one class scanned in a
+// single loop, the "0x" prefix one literal, and some() a single loop.
+
+struct return_hex {
+    return_hex() {}
+    void operator() (unsigned *res, string &digits) const {
+        *res = static_cast<unsigned>(strtoul(digits.c_str(), nullptr, 16));
+    }
+} const return_hex;
+
+struct push_hex {
+    push_hex() {}
+    void operator() (vector<unsigned> *res, unsigned x) const {
+        res->push_back(x);
+    }
+} const push_hex;
+
+auto const hex_digit = accept(is_digit)
+    || accept(is_char('a')) || accept(is_char('b')) || accept(is_char('c'))
+    || accept(is_char('d')) || accept(is_char('e')) || accept(is_char('f'))
+    || accept(is_char('A')) || accept(is_char('B')) || accept(is_char('C'))
+    || accept(is_char('D')) || accept(is_char('E')) || accept(is_char('F'));
+
+auto const hex_tok = tokenise(all(return_hex,
+    discard(accept(is_char('0')) && accept(is_char('x'))) && some(hex_digit)));
+
+auto const hex_file = first_token && many(all(push_hex, hex_tok));
+
+auto const optimised_hex_file = optimise(hex_file);
+
+// hex tokens of up to eight digits, in mixed case.
+string make_hex(size_t const n) {
+    static char const digits[] = "0123456789abcdefABCDEF";
+    string s;
+    for (size_t j = 0; j < n; ++j) {
+        s += "0x";
+        for (int k = rand() % 8; k >= 0; --k) {
+            s += digits[rand() % (sizeof digits - 1)];
+        }
+        s += (j % 16 == 15) ? '\n' : ' ';
+    }
+    return s;
+}
+
+template <typename Parser> struct hex_parser;
+
+template <typename Parser>
+void parse(char const* what, Parser const& parser, string const& text) {
+    memory_range const r(text);
+    vector<unsigned> a;
+    char const* i = r.first;
+
+    profile<hex_parser<Parser>>::reset();
+    {
+        profile<hex_parser<Parser>> p;
+        if (parser(i, r, &a) && i == r.last) {
+            cout << what << ": OK\n";
+        } else {
+            cout << what << ": FAIL\n";
+        }
+    }
+
+    unsigned sum = 0;
+    for (unsigned const x : a) {
+        sum += x;
+    }
+    cout << a.size() << " tokens, sum " << sum << "\n";
+    cout << "parsed: " << static_cast<double>(i - r.first)
+        / static_cast<double>(profile<hex_parser<Parser>>::report()) << "MB/s\n";
+}
+
+//----------------------------------------------------------------------------
+
+int main(int const argc, char const *argv[]) {
+    size_t const n = (argc > 1) ? static_cast<size_t>(atol(argv[1])) : 1000000;
+    string const text = make_hex(n);
+    parse("as written", hex_file, text);
+    parse("optimised", optimised_hex_file, text);
+}
@@ -0,0 +1,154 @@
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <sstream>
+
+#include "templateio.hpp"
+#include "parser_combinators.hpp"
+#include "profile.hpp"
+#include "stream_iterator.hpp"
+
+using namespace std;
+
+//----------------------------------------------------------------------------
+// Example Operator Precedence Expression Parser: evaluates expressions like
+// "1 + 2 * -3 - 4" or "1 + 2 <= 3" without needing parentheses or
+// backtracking.
+
+struct return_add {
+    return_add() {}
+    void operator() (int *res, int left, string&, int right) const {
+        *res = left + right;
+    }
+} const return_add;
+
+struct return_sub {
+    return_sub() {}
+    void operator() (int *res, int left, string&, int right) const {
+        *res = left - right;
+    }
+} const return_sub;
+
+struct return_mul {
+    return_mul() {}
+    void operator() (int *res, int left, string&, int right) const {
+        *res = left * right;
+    }
+} const return_mul;
+
+struct return_div {
+    return_div() {}
+    void operator() (int *res, int left, string&, int right) const {
+        if (right == 0) {
+            throw runtime_error("division by zero");
+        }
+        *res = left / right;
+    }
+} const return_div;
+
+struct return_neg {
+    return_neg() {}
+    void operator() (int *res, string&, int right) const {
+        *res = -right;
+    }
+} const return_neg;
+
+// the comparisons are one token, the longest of the literals that matches,
+// so "<=" is not read as "<" followed by "=". The result is the index of the
+// literal matched.
+enum class comparison {equal, not_equal, less, less_equal, greater, greater_equal};
+
+struct return_compare {
+    return_compare() {}
+    void operator() (int *res, int left, int op, int right) const {
+        switch (static_cast<comparison>(op)) {
+        case comparison::equal: *res = left == right; break;
+        case comparison::not_equal: *res = left != right; break;
+        case comparison::less: *res = left < right; break;
+        case comparison::less_equal: *res = left <= right; break;
+        case comparison::greater: *res = left > right; break;
+        case comparison::greater_equal: *res = left >= right; break;
+        }
+    }
+} const return_compare;
+
+auto const number_tok = tokenise(accept_int<unsigned>());
+auto const start_tok = tokenise(accept(is_char('(')));
+auto const end_tok = tokenise(accept(is_char(')')));
+auto const add_tok = tokenise(accept(is_char('+')));
+auto const sub_tok = tokenise(accept(is_char('-')));
+auto const mul_tok = tokenise(accept(is_char('*')));
+auto const div_tok = tokenise(accept(is_char('/')));
+auto const compare_tok = tokenise(accept_any_str({"==", "!=", "<", "<=", ">", ">="}));
+
+using expression_handle = pstream_handle<int>;
+
+struct return_int {
+    return_int() {}
+    void operator() (int *res, unsigned n) const {
+        *res = static_cast<int>(n);
+    }
+} const return_int;
+
+auto const number = define("number", all(return_int, number_tok));
+
+expression_handle recursive_expression(expression_handle expr) {
+    return operators(number || discard(start_tok) && expr && discard(end_tok),
+        infix_left(5, compare_tok, return_compare),
+        infix_left(10, add_tok, return_add),
+        infix_left(10, sub_tok, return_sub),
+        infix_left(20, mul_tok, return_mul),
+        infix_left(20, div_tok, return_div),
+        prefix(30, sub_tok, return_neg));
+}
+
+auto const expression = fix("expr", recursive_expression);
+auto const parser = first_token && strict("invalid expression", expression);
+
+struct expression_parser;
+
+template <typename Range>
+int parse(Range const &r) {
+    decltype(parser)::result_type a {}; 
+    typename Range::iterator i = r.first;
+
+    // errors are recorded in the channel rather than thrown.
+    auto const channel = make_error_channel(r);
+    parse_status status;
+    {
+        profile<expression_parser> p;
+        status = channel.status(parser(i, channel, &a));
+    }
+    switch (status) {
+    case parse_status::ok:
+        cout << "OK\n";
+        break;
+    case parse_status::fail:
+        cout << "FAIL\n";
+        break;
+    case parse_status::error:
+        cout << "ERROR\n" << channel.to_error().what() << "\n";
+        break;
+    }
+
+    cout << a << "\n";
+    
+    return i - r.first;
+}
+
+//----------------------------------------------------------------------------
+
+int main(int const argc, char const *argv[]) {
+    if (argc < 1) {
+        cerr << "no input files\n";
+    } else {
+        for (int i = 1; i < argc; ++i) {
+            profile<expression_parser>::reset();
+            stream_range in(argv[i]);
+            cout << argv[i] << "\n";
+            int const chars_read = parse(in);
+            double const mb_per_s = static_cast<double>(chars_read) / static_cast<double>(profile<expression_parser>::report());
+            cout << "parsed: " << mb_per_s << "MB/s\n";
+        }
+    }
+}
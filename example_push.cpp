@@ -0,0 +1,72 @@
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "templateio.hpp"
+#include "parser_combinators.hpp"
+#include "block_range.hpp"
+#include "profile.hpp"
+
+using namespace std;
+
+//----------------------------------------------------------------------------
+// The CSV lines from "test_combinators.cpp", parsed as they arrive: the file
+// (or standard input, given "-") is read in small pieces that are pushed to
+// the parser, which hands back each line as soon as it is complete, holding
+// only a few blocks of the input at a time.
+
+struct parse_int {
+    parse_int() {}
+    void operator() (vector<int> *ts, int num) const {
+        ts->push_back(num);
+    }
+} const parse_int;
+
+auto const number_tok = tokenise(accept_int<int>());
+auto const separator_tok = tokenise(accept(is_char(',')));
+auto const csv_line = sep_by(all(parse_int, number_tok), separator_tok);
+
+struct push_csv;
+
+int main(int const argc, char const *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        int const fd = (string(argv[i]) == "-") ? 0 : open(argv[i], O_RDONLY);
+        if (fd < 0) {
+            cerr << "unable to open " << argv[i] << endl;
+            continue;
+        }
+
+        size_t lines = 0;
+        long sum = 0;
+        push_parser<decltype(csv_line)> csv(csv_line, [&lines, &sum](vector<int>& line) {
+            ++lines;
+            for (int const x : line) {
+                sum += x;
+            }
+        });
+
+        profile<push_csv>::reset();
+        char buffer[4096];
+        size_t chars_read = 0;
+        try {
+            profile<push_csv> p;
+            for (ssize_t n; (n = read(fd, buffer, sizeof buffer)) > 0;) {
+                chars_read += n;
+                csv.feed(buffer, n);
+            }
+            csv.close();
+            cout << argv[i] << "\nOK\n";
+        } catch (parse_error const& e) {
+            cout << argv[i] << "\n" << e.what();
+        }
+        if (fd != 0) {
+            close(fd);
+        }
+
+        cout << lines << " lines, " << (lines > 0 ? sum / static_cast<long>(lines) : 0)
+            << " average sum, " << csv.high_water() << " bytes held\n";
+        cout << "parsed: " << static_cast<double>(chars_read)
+            / static_cast<double>(profile<push_csv>::report()) << "MB/s\n";
+    }
+}
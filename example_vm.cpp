@@ -0,0 +1,125 @@
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <sstream>
+
+#include "templateio.hpp"
+#include "parser_combinators.hpp"
+#include "parser_vm.hpp"
+#include "profile.hpp"
+#include "stream_iterator.hpp"
+
+using namespace std;
+
+//----------------------------------------------------------------------------
+// The CSV parser from "test_combinators.cpp", loaded as text at run time and
+// run by the parsing machine, timed against the template grammar.
+
+string const csv_grammar = R"(
+    csv = strict("error parsing csv", {space}, {line}-);
+    line = token(integer), {token(','), token(integer)};
+)";
+
+struct parse_int {
+    parse_int() {}
+    void operator() (vector<int> *ts, int num) const {
+        ts->push_back(num);
+    }
+} const parse_int;
+
+struct parse_line {
+    parse_line() {}
+    void operator() (vector<vector<int>> *ts, vector<int> &line) const {
+        ts->push_back(move(line));
+    }
+} const parse_line;
+
+auto const number_tok = tokenise(accept_int<int>());
+auto const separator_tok = tokenise(accept(is_char(',')));
+
+auto const parse_csv = strict("error parsing csv",
+    first_token && some(all(parse_line, sep_by(all(parse_int, number_tok), separator_tok)))
+);
+
+struct template_csv;
+struct machine_csv;
+
+int average(vector<vector<int>> const& a) {
+    int sum = 0;
+    for (auto const& line : a) {
+        for (int const x : line) {
+            sum += x;
+        }
+    }
+    return a.empty() ? 0 : sum / static_cast<int>(a.size());
+}
+
+template <typename Range>
+int parse_template(Range const &r) {
+    decltype(parse_csv)::result_type a;
+    typename Range::iterator i = r.first;
+
+    profile<template_csv> p;
+    cout << (parse_csv(i, r, &a) ? "OK\n" : "FAIL\n");
+    cerr << average(a) << endl;
+    return i - r.first;
+}
+
+template <typename Range>
+int parse_machine(parser_vm& csv, Range const &r) {
+    vector<vector<int>> a;
+    vector<int> line;
+    // as accept_int<int> in the template grammar, overflow is a parse error.
+    csv.capture("integer", [&line](string const& s) {
+        errno = 0;
+        long const n = strtol(s.c_str(), nullptr, 10);
+        if (errno == ERANGE || n < numeric_limits<int>::min() || n > numeric_limits<int>::max()) {
+            throw runtime_error("integer overflow");
+        }
+        line.push_back(static_cast<int>(n));
+    });
+    csv.notify("line", [&a, &line]() {
+        a.push_back(move(line));
+        line.clear();
+    });
+    typename Range::iterator i = r.first;
+
+    profile<machine_csv> p;
+    cout << (csv(i, r) ? "OK\n" : "FAIL\n");
+    cerr << average(a) << endl;
+    return i - r.first;
+}
+
+//----------------------------------------------------------------------------
+
+int main(int const argc, char const *argv[]) {
+    parser_vm csv = load_grammar(csv_grammar);
+    unique_defs defs;
+    cout << csv.ebnf(&defs) << " (" << csv.size() << " instructions) where:\n";
+    for (auto const& d : defs) {
+        cout << "\t" << d.first << " = " << d.second << ";\n";
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        cout << argv[i] << "\n";
+        // both report bad input, an integer that overflows say, the same way.
+        try {
+            profile<template_csv>::reset();
+            stream_range in(argv[i]);
+            int const chars_read = parse_template(in);
+            cout << "template: " << static_cast<double>(chars_read)
+                / static_cast<double>(profile<template_csv>::report()) << "MB/s\n";
+        } catch (parse_error const& e) {
+            cout << "template: " << e.what();
+        }
+        try {
+            profile<machine_csv>::reset();
+            stream_range in(argv[i]);
+            int const chars_read = parse_machine(csv, in);
+            cout << "machine: " << static_cast<double>(chars_read)
+                / static_cast<double>(profile<machine_csv>::report()) << "MB/s\n";
+        } catch (parse_error const& e) {
+            cout << "machine: " << e.what();
+        }
+    }
+}
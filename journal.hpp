@@ -0,0 +1,413 @@
+//----------------------------------------------------------------------------
+// copyright 2014 Keean Schupke
+// compile with -std=c++11
+// journal.hpp
+
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <cstddef>
+#include <vector>
+#include <map>
+#include <set>
+
+using namespace std;
+
+//============================================================================
+// Journaled State
+//
+// Inherited attributes that opt into the checkpoint protocol (mark, rollback
+// and commit) can be backtracked by 'attempt' without being copied. A state
+// built from journaled containers derives from 'journal', which provides the
+// protocol. While a mark is outstanding each change to a container records
+// how to undo it, so rolling back costs O(changes) rather than O(state).
+// Outside of any mark nothing is recorded.
+
+class journal;
+
+//----------------------------------------------------------------------------
+// Base of the journaled containers: each keeps a stack of its own undo
+// records, and the journal keeps the order in which containers changed.
+
+class journaled {
+    friend class journal;
+
+    virtual void undo() = 0;
+    virtual void forget() = 0;
+
+protected:
+    journal* const j;
+
+    explicit journaled(journal& k) : j(&k) {}
+
+    journaled(journaled const&) = delete;
+    journaled& operator= (journaled const&) = delete;
+
+    bool recording() const;
+    void changed();
+
+public:
+    virtual ~journaled() {}
+};
+
+class journal {
+    friend class journaled;
+
+    vector<journaled*> log;
+    int depth;
+
+public:
+    using checkpoint = size_t;
+
+    journal() : depth(0) {}
+
+    journal(journal const&) = delete;
+    journal& operator= (journal const&) = delete;
+
+    checkpoint mark() {
+        ++depth;
+        return log.size();
+    }
+
+    // undo every change since the mark.
+    void rollback(checkpoint const m) {
+        while (log.size() > m) {
+            log.back()->undo();
+            log.pop_back();
+        }
+        --depth;
+    }
+
+    // keep the changes since the mark, once no mark is outstanding the undo
+    // records are dropped.
+    void commit(checkpoint const /*m*/) {
+        if (--depth == 0) {
+            for (journaled* c : log) {
+                c->forget();
+            }
+            log.clear();
+        }
+    }
+};
+
+inline bool journaled::recording() const {
+    return j->depth > 0;
+}
+
+inline void journaled::changed() {
+    j->log.push_back(this);
+}
+
+//----------------------------------------------------------------------------
+// Map: each record restores one key to its previous value, or removes it.
+
+template <typename K, typename V, typename C = less<K>>
+class journaled_map : public journaled {
+    using map_type = map<K, V, C>;
+
+    struct record {
+        bool had;
+        K key;
+        V value;
+    };
+
+    map_type m;
+    vector<record> undos;
+
+    void save(K const& k) {
+        if (recording()) {
+            auto const i = m.find(k);
+            if (i == m.end()) {
+                undos.push_back(record {false, k, V {}});
+            } else {
+                undos.push_back(record {true, k, i->second});
+            }
+            changed();
+        }
+    }
+
+    virtual void undo() override {
+        record& u = undos.back();
+        if (u.had) {
+            m[u.key] = move(u.value);
+        } else {
+            m.erase(u.key);
+        }
+        undos.pop_back();
+    }
+
+    virtual void forget() override {
+        undos.clear();
+    }
+
+public:
+    using const_iterator = typename map_type::const_iterator;
+
+    explicit journaled_map(journal& k) : journaled(k) {}
+
+    map_type const& get() const {
+        return m;
+    }
+
+    const_iterator begin() const {
+        return m.cbegin();
+    }
+
+    const_iterator end() const {
+        return m.cend();
+    }
+
+    const_iterator find(K const& k) const {
+        return m.find(k);
+    }
+
+    size_t size() const {
+        return m.size();
+    }
+
+    bool empty() const {
+        return m.empty();
+    }
+
+    pair<const_iterator, bool> insert(pair<K, V> const& x) {
+        auto const i = m.find(x.first);
+        if (i != m.end()) {
+            return make_pair(const_iterator(i), false);
+        }
+        save(x.first);
+        return m.insert(x);
+    }
+
+    void assign(K const& k, V const& v) {
+        save(k);
+        m[k] = v;
+    }
+
+    size_t erase(K const& k) {
+        if (m.find(k) == m.end()) {
+            return 0;
+        }
+        save(k);
+        return m.erase(k);
+    }
+
+    void clear() {
+        if (recording()) {
+            for (auto const& x : m) {
+                undos.push_back(record {true, x.first, x.second});
+                changed();
+            }
+        }
+        m.clear();
+    }
+};
+
+//----------------------------------------------------------------------------
+// Set: each record re-inserts or removes one key.
+
+template <typename K, typename C = less<K>>
+class journaled_set : public journaled {
+    using set_type = set<K, C>;
+
+    struct record {
+        bool had;
+        K key;
+    };
+
+    set_type s;
+    vector<record> undos;
+
+    void save(bool const had, K const& k) {
+        if (recording()) {
+            undos.push_back(record {had, k});
+            changed();
+        }
+    }
+
+    virtual void undo() override {
+        record& u = undos.back();
+        if (u.had) {
+            s.insert(move(u.key));
+        } else {
+            s.erase(u.key);
+        }
+        undos.pop_back();
+    }
+
+    virtual void forget() override {
+        undos.clear();
+    }
+
+public:
+    using const_iterator = typename set_type::const_iterator;
+
+    explicit journaled_set(journal& k) : journaled(k) {}
+
+    set_type const& get() const {
+        return s;
+    }
+
+    const_iterator begin() const {
+        return s.cbegin();
+    }
+
+    const_iterator end() const {
+        return s.cend();
+    }
+
+    const_iterator find(K const& k) const {
+        return s.find(k);
+    }
+
+    size_t count(K const& k) const {
+        return s.count(k);
+    }
+
+    size_t size() const {
+        return s.size();
+    }
+
+    bool empty() const {
+        return s.empty();
+    }
+
+    pair<const_iterator, bool> insert(K const& k) {
+        auto const r = s.insert(k);
+        if (r.second) {
+            save(false, k);
+        }
+        return r;
+    }
+
+    size_t erase(K const& k) {
+        size_t const n = s.erase(k);
+        if (n > 0) {
+            save(true, k);
+        }
+        return n;
+    }
+
+    void clear() {
+        if (recording()) {
+            for (auto const& k : s) {
+                save(true, k);
+            }
+        }
+        s.clear();
+    }
+
+    // replace the contents with those of another set.
+    template <typename S> void assign(S const& t) {
+        clear();
+        for (auto const& k : t) {
+            insert(k);
+        }
+    }
+};
+
+//----------------------------------------------------------------------------
+// Vector: records undo a push_back, a pop_back or an assignment to an element.
+
+template <typename T>
+class journaled_vector : public journaled {
+    using vector_type = vector<T>;
+
+    enum class change {pushed, popped, assigned};
+
+    struct record {
+        change what;
+        size_t index;
+        T value;
+    };
+
+    vector_type v;
+    vector<record> undos;
+
+    void save(change const what, size_t const index, T const& value) {
+        undos.push_back(record {what, index, value});
+        changed();
+    }
+
+    virtual void undo() override {
+        record& u = undos.back();
+        switch (u.what) {
+            case change::pushed:
+                v.pop_back();
+                break;
+            case change::popped:
+                v.push_back(move(u.value));
+                break;
+            case change::assigned:
+                v[u.index] = move(u.value);
+                break;
+        }
+        undos.pop_back();
+    }
+
+    virtual void forget() override {
+        undos.clear();
+    }
+
+public:
+    using const_iterator = typename vector_type::const_iterator;
+
+    explicit journaled_vector(journal& k) : journaled(k) {}
+
+    vector_type const& get() const {
+        return v;
+    }
+
+    const_iterator begin() const {
+        return v.cbegin();
+    }
+
+    const_iterator end() const {
+        return v.cend();
+    }
+
+    T const& operator[] (size_t const n) const {
+        return v[n];
+    }
+
+    T const& back() const {
+        return v.back();
+    }
+
+    size_t size() const {
+        return v.size();
+    }
+
+    bool empty() const {
+        return v.empty();
+    }
+
+    void push_back(T const& x) {
+        if (recording()) {
+            save(change::pushed, v.size(), T {});
+        }
+        v.push_back(x);
+    }
+
+    void pop_back() {
+        if (recording()) {
+            save(change::popped, v.size() - 1, v.back());
+        }
+        v.pop_back();
+    }
+
+    void assign(size_t const n, T const& x) {
+        if (recording()) {
+            save(change::assigned, n, v[n]);
+        }
+        v[n] = x;
+    }
+
+    void clear() {
+        while (recording() && !v.empty()) {
+            pop_back();
+        }
+        v.clear();
+    }
+};
+
+#endif // JOURNAL_HPP
@@ -0,0 +1,72 @@
+//----------------------------------------------------------------------------
+// copyright 2014 Keean Schupke
+// compile with -std=c++11
+// memory_range.hpp
+
+#ifndef MEMORY_RANGE_HPP
+#define MEMORY_RANGE_HPP
+
+#include <string>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#include "parser_combinators.hpp"
+
+using namespace std;
+
+//============================================================================
+// Memory Range
+//
+// A range over characters already in memory: a string, a vector, or a
+// pointer and size. The iterators are pointers, so the range is contiguous
+// and parsers take their pointer (memchr, SIMD) paths. The range does not
+// own or copy the characters, which must outlive it, so it is cheap enough
+// to make one for each of many small records.
+
+class memory_range {
+    mutable unique_ptr<line_index> index;
+
+public:
+    using iterator = char const*;
+
+    iterator const first;
+    iterator const last;
+
+    memory_range(memory_range const&) = delete;
+
+    memory_range(char const* data, size_t const size) : first(data), last(data + size) {}
+
+    explicit memory_range(string const& s) : memory_range(s.data(), s.size()) {}
+    explicit memory_range(vector<char> const& v) : memory_range(v.data(), v.size()) {}
+
+    // the characters would be gone before the range.
+    explicit memory_range(string&&) = delete;
+    explicit memory_range(vector<char>&&) = delete;
+
+#if __cplusplus >= 201703L
+    explicit memory_range(string_view const s) : memory_range(s.data(), s.size()) {}
+#endif
+
+    // built the first time an error needs it.
+    line_index const& lines() const {
+        if (index == nullptr) {
+            index.reset(new line_index(*this));
+        }
+        return *index;
+    }
+};
+
+#ifdef USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using pmemory_handle = parser_inline_handle<memory_range::iterator, memory_range, Synthesize, Inherit>;
+
+#else // USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using pmemory_handle = parser_handle<memory_range::iterator, memory_range, Synthesize, Inherit>;
+
+#endif // USE_INLINE_HANDLE
+
+#endif // MEMORY_RANGE_HPP
@@ -0,0 +1,390 @@
+//----------------------------------------------------------------------------
+// copyright 2014 Keean Schupke
+// compile with -std=c++11
+// mmap_range.hpp
+
+#ifndef MMAP_RANGE_HPP
+#define MMAP_RANGE_HPP
+
+#include <deque>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "parser_combinators.hpp"
+
+using namespace std;
+
+//============================================================================
+// Mapping Files
+//
+// How a file is mapped: 'sequential' and 'willneed' are advice to the kernel
+// (to read ahead and drop pages behind, and to start reading now), 'populate'
+// reads the whole mapping in before it is used, so parsing takes no faults,
+// and 'hugepages' aligns the mapping to 2MB and asks for transparent huge
+// pages, so there are fewer faults and TLB misses (where the kernel and file
+// system support them for files).
+
+struct mmap_options {
+    bool sequential;
+    bool willneed;
+    bool populate;
+    bool hugepages;
+
+    mmap_options() : sequential(true), willneed(false), populate(false), hugepages(false) {}
+};
+
+// the page faults taken by the process so far, to compare before and after.
+struct fault_counts {
+    long minor;
+    long major;
+
+    static fault_counts now() {
+        struct rusage u;
+        getrusage(RUSAGE_SELF, &u);
+        return fault_counts {u.ru_minflt, u.ru_majflt};
+    }
+
+    fault_counts operator- (fault_counts const& f) const {
+        return fault_counts {minor - f.minor, major - f.major};
+    }
+};
+
+class mapped_file {
+    static constexpr size_t huge_page = size_t(1) << 21;
+
+    static size_t page_size() {
+        static size_t const p = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return p;
+    }
+
+public:
+    int const fd;
+    streamoff const size;
+    mmap_options const options;
+
+    mapped_file(char const* name, mmap_options const& o) : fd(::open(name, O_RDONLY)),
+        size(size_of(fd)), options(o) {
+        if (fd < 0) {
+            throw runtime_error("unable to open file");
+        }
+    }
+
+    ~mapped_file() {
+        ::close(fd);
+    }
+
+    mapped_file(mapped_file const&) = delete;
+    mapped_file& operator= (mapped_file const&) = delete;
+
+    static streamoff size_of(int const fd) {
+        struct stat s;
+        return (fd >= 0 && fstat(fd, &s) == 0) ? static_cast<streamoff>(s.st_size) : 0;
+    }
+
+    // offsets of mappings must be multiples of this.
+    size_t granule() const {
+        return options.hugepages ? huge_page : page_size();
+    }
+
+    char const* map(streamoff const offset, size_t const length) const {
+        size_t const rounded = (length + page_size() - 1) & ~(page_size() - 1);
+        int const flags = MAP_PRIVATE | (options.populate ? MAP_POPULATE : 0);
+        void* p;
+        if (options.hugepages) {
+            // reserve enough to align, then map the file over the aligned part.
+            char* const r = static_cast<char*>(mmap(nullptr, rounded + huge_page, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+            if (r == MAP_FAILED) {
+                throw system_error(errno, system_category(), "unable to map file");
+            }
+            char* const a = reinterpret_cast<char*>(
+                (reinterpret_cast<uintptr_t>(r) + huge_page - 1) & ~(huge_page - 1));
+            if (a > r) {
+                munmap(r, a - r);
+            }
+            if (r + huge_page > a) {
+                munmap(a + rounded, (r + huge_page) - a);
+            }
+            p = mmap(a, length, PROT_READ, flags | MAP_FIXED, fd, offset);
+            if (p == MAP_FAILED) {
+                munmap(a, rounded);
+            } else {
+                madvise(p, length, MADV_HUGEPAGE);
+            }
+        } else {
+            p = mmap(nullptr, length, PROT_READ, flags, fd, offset);
+        }
+        if (p == MAP_FAILED) {
+            throw system_error(errno, system_category(), "unable to map file");
+        }
+        if (options.sequential) {
+            madvise(p, length, MADV_SEQUENTIAL);
+        }
+        if (options.willneed) {
+            madvise(p, length, MADV_WILLNEED);
+        }
+        return static_cast<char const*>(p);
+    }
+
+    static void unmap(char const* const p, size_t const length) {
+        munmap(const_cast<char*>(p), length);
+    }
+};
+
+//============================================================================
+// Memory Mapped Range
+//
+// The whole file mapped, so the iterators are pointers (the range is
+// contiguous, like the USE_MMAP stream_range) but with the mapping tuned by
+// mmap_options.
+
+struct mmap_whole : mapped_file {
+    char const* const data;
+
+    mmap_whole(char const* name, mmap_options const& o) : mapped_file(name, o),
+        data((size > 0) ? map(0, static_cast<size_t>(size)) : "") {}
+
+    ~mmap_whole() {
+        if (size > 0) {
+            unmap(data, static_cast<size_t>(size));
+        }
+    }
+};
+
+class mmap_range : private mmap_whole {
+    mutable unique_ptr<line_index> index;
+
+public:
+    using iterator = char const*;
+
+    iterator const first;
+    iterator const last;
+
+    mmap_range(mmap_range const&) = delete;
+
+    explicit mmap_range(char const* name, mmap_options const& o = mmap_options())
+        : mmap_whole(name, o), first(data), last(data + size) {}
+
+    explicit mmap_range(string const& name, mmap_options const& o = mmap_options())
+        : mmap_range(name.c_str(), o) {}
+
+    // built the first time an error needs it.
+    line_index const& lines() const {
+        if (index == nullptr) {
+            index.reset(new line_index(*this));
+        }
+        return *index;
+    }
+};
+
+//============================================================================
+// Sliding Window Range
+//
+// The file mapped a window at a time, for files too large for the address
+// space. The file is mapped in chunks as the parser reaches them (and read
+// ahead of it with 'willneed'), and chunks are unmapped once they are more
+// than 'window' behind the furthest position read, and before any position
+// still marked (see Marks in "parser_combinators.hpp"). The parsers that go
+// back (attempt) mark where they start, so backtracking to a marked position,
+// or within the window, is always possible. Going back further throws.
+// Iterators are pointers into a chunk, and only go back to the range at the
+// end of one, so an iterator from before the window must not be read (errors
+// check holds() first).
+
+class mmap_window_range : private mapped_file {
+    struct chunk {
+        char const* data;
+        size_t length;
+        size_t lines;           // newlines before the chunk
+        streamoff line_start;   // offset of the line the chunk starts in
+    };
+
+    static char const* sentinel() {
+        static char const s = 0;
+        return &s;
+    }
+
+    size_t const chunk_size;
+    streamoff const window;
+    deque<chunk> chunks;
+    size_t base;
+    size_t lines;
+    streamoff line_start;
+    input_marks marks;
+    size_t mapped_most;
+
+    size_t round_chunk(size_t const n) const {
+        return max(granule(), (n + granule() - 1) / granule() * granule());
+    }
+
+    void map_next() {
+        streamoff const offset = static_cast<streamoff>((base + chunks.size()) * chunk_size);
+        size_t const length = static_cast<size_t>(min(static_cast<streamoff>(chunk_size), size - offset));
+        char const* const d = map(offset, length);
+        chunks.push_back(chunk {d, length, lines, line_start});
+        for (char const* i = d; (i = static_cast<char const*>(memchr(i, '\n', d + length - i))) != nullptr;) {
+            ++lines;
+            line_start = offset + (++i - d);
+        }
+        if (options.willneed && offset + static_cast<streamoff>(length) < size) {
+            posix_fadvise(fd, offset + length, chunk_size, POSIX_FADV_WILLNEED);
+        }
+        slide(offset);
+        mapped_most = max(mapped_most, chunks.size() * chunk_size);
+    }
+
+    // unmap the chunks before the window, and before the oldest mark.
+    void slide(streamoff const at) {
+        streamoff const keep = marks.oldest(at - window);
+        for (; keep > 0 && static_cast<size_t>(keep) / chunk_size > base && chunks.size() > 1; ++base) {
+            unmap(chunks.front().data, chunks.front().length);
+            chunks.pop_front();
+        }
+    }
+
+public:
+    class iterator {
+        friend class mmap_window_range;
+
+        mmap_window_range* r;
+        streamoff pos;
+        char const* p;
+        char const* end;
+
+        iterator(mmap_window_range* r, streamoff const pos) : r(r), pos(pos), p(sentinel()),
+            end(sentinel()) {}
+
+    public:
+        char operator* () const {
+            return *p;
+        }
+
+        bool operator== (iterator const& i) const {
+            return pos == i.pos;
+        }
+
+        bool operator!= (iterator const& i) const {
+            return pos != i.pos;
+        }
+
+        streamoff operator- (iterator const& i) const {
+            return pos - i.pos;
+        }
+
+        iterator& operator++ () {
+            ++pos;
+            if (++p == end) {
+                r->load(*this);
+            }
+            return *this;
+        }
+
+        iterator& operator-- () {
+            --pos;
+            r->load(*this);
+            return *this;
+        }
+    };
+
+private:
+    iterator start() {
+        iterator i(this, 0);
+        load(i);
+        return i;
+    }
+
+public:
+    iterator const last;
+    iterator const first;
+
+    explicit mmap_window_range(char const* name, size_t const chunk = size_t(1) << 24,
+        streamoff const window = streamoff(1) << 26, mmap_options const& o = mmap_options())
+        : mapped_file(name, o), chunk_size(round_chunk(chunk)), window(window), base(0), lines(0),
+        line_start(0), mapped_most(0), last(this, size), first(start()) {}
+
+    explicit mmap_window_range(string const& name, size_t const chunk = size_t(1) << 24,
+        streamoff const window = streamoff(1) << 26, mmap_options const& o = mmap_options())
+        : mmap_window_range(name.c_str(), chunk, window, o) {}
+
+    ~mmap_window_range() {
+        for (chunk const& c : chunks) {
+            unmap(c.data, c.length);
+        }
+    }
+
+    mmap_window_range(mmap_window_range const&) = delete;
+    mmap_window_range& operator= (mmap_window_range const&) = delete;
+
+    // point an iterator at its position, mapping as far as it if needed.
+    void load(iterator& i) {
+        if (i.pos >= size) {
+            i.p = i.end = sentinel();
+            return;
+        }
+        size_t const b = static_cast<size_t>(i.pos) / chunk_size;
+        if (b < base) {
+            throw runtime_error("input before the window has been unmapped");
+        }
+        while (b >= base + chunks.size()) {
+            map_next();
+        }
+        chunk const& c = chunks[b - base];
+        i.p = c.data + (static_cast<size_t>(i.pos) - b * chunk_size);
+        i.end = c.data + c.length;
+    }
+
+    // the range can go back as far as the iterator until the mark is released.
+    size_t mark(iterator const& i) const {
+        return marks.mark(i.pos);
+    }
+
+    void release(size_t const m) const {
+        marks.release(m);
+    }
+
+    bool holds(ptrdiff_t const offset) const {
+        return offset >= 0 && offset < size && static_cast<size_t>(offset) / chunk_size >= base
+            && static_cast<size_t>(offset) / chunk_size < base + chunks.size();
+    }
+
+    // the most of the file mapped at once.
+    size_t high_water() const {
+        return mapped_most;
+    }
+
+    // line and column (from 1) of an offset that is still mapped.
+    pair<size_t, size_t> locate(ptrdiff_t const offset) const {
+        size_t const b = static_cast<size_t>(offset) / chunk_size;
+        if (b < base || b >= base + chunks.size()) {
+            return make_pair(size_t(0), size_t(0));
+        }
+        chunk const& c = chunks[b - base];
+        size_t row = c.lines + 1;
+        streamoff start = c.line_start;
+        streamoff const at = static_cast<streamoff>(b * chunk_size);
+        for (streamoff j = at; j < offset; ++j) {
+            if (c.data[j - at] == '\n') {
+                ++row;
+                start = j + 1;
+            }
+        }
+        return make_pair(row, static_cast<size_t>(offset - start + 1));
+    }
+};
+
+#ifdef USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using pmmap_handle = parser_inline_handle<mmap_range::iterator, mmap_range, Synthesize, Inherit>;
+
+#else // USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using pmmap_handle = parser_handle<mmap_range::iterator, mmap_range, Synthesize, Inherit>;
+
+#endif // USE_INLINE_HANDLE
+
+#endif // MMAP_RANGE_HPP
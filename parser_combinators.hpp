@@ -8,28 +8,54 @@
 
 #include <istream>
 #include <sstream>
+#include <locale>
 #include <stdexcept>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <array>
+#include <initializer_list>
 #include <tuple>
 #include <type_traits>
 #include <memory>
+#include <new>
 #include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <limits>
+#include <cmath>
 #include <iterator>
+#include <algorithm>
 #include <utility>
+#include <exception>
+#include <atomic>
+#include <thread>
+#include <mutex>
 #include <type_traits>
 #include "function_traits.hpp"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PARSER_COMBINATORS_X86
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 //============================================================================
 // Character Predicates
+//
+// Predicates classify symbols (0 - 255 or EOF) using locale independent ASCII
+// semantics. They are all constexpr, so that any combination of them can be
+// folded into a char_class table at compile time.
 
 struct is_any {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_any() {};
-    bool operator() (int const c) const {
+    constexpr bool operator() (int const c) const {
         return c != EOF;
     }
     string name() const {
@@ -41,8 +67,8 @@ struct is_alnum {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_alnum() {}
-    bool operator() (int const c) const {
-        return ::isalnum(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
     }
     string name() const {
         return "alphanumeric";
@@ -53,8 +79,8 @@ struct is_alpha {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_alpha() {}
-    bool operator() (int const c) const {
-        return ::isalpha(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
     }
     string name() const {
         return "alphabetic";
@@ -65,8 +91,8 @@ struct is_blank {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_blank() {}
-    bool operator() (int const c) const {
-        return ::isblank(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return c == ' ' || c == '\t';
     }
     string name() const {
         return "blank";
@@ -77,8 +103,8 @@ struct is_cntrl {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_cntrl() {}
-    bool operator() (int const c) const {
-        return ::iscntrl(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return (c >= 0 && c < ' ') || c == 127;
     }
     string name() const {
         return "control";
@@ -89,8 +115,8 @@ struct is_digit {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_digit() {}
-    bool operator() (int const c) const {
-        return ::isdigit(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return c >= '0' && c <= '9';
     }
     string name() const {
         return "digit";
@@ -101,8 +127,8 @@ struct is_graph {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_graph() {}
-    bool operator() (int const c) const {
-        return ::isgraph(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return c > ' ' && c < 127;
     }
     string name() const {
         return "graphic";
@@ -113,8 +139,8 @@ struct is_lower {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_lower() {}
-    bool operator() (int const c) const {
-        return ::islower(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return c >= 'a' && c <= 'z';
     }
     string name() const {
         return "lowercase";
@@ -125,8 +151,8 @@ struct is_print {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_print() {}
-    bool operator() (int const c) const {
-        return ::isprint(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return c >= ' ' && c < 127;
     }
     string name() const {
         return "printable";
@@ -137,8 +163,9 @@ struct is_punct {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_punct() {}
-    bool operator() (int const c) const {
-        return ::ispunct(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return (c > ' ' && c < '0') || (c > '9' && c < 'A')
+            || (c > 'Z' && c < 'a') || (c > 'z' && c < 127);
     }
     string name() const {
         return "punctuation";
@@ -149,8 +176,8 @@ struct is_space {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_space() {}
-    bool operator() (int const c) const {
-        return ::isspace(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return c == ' ' || (c >= '\t' && c <= '\r');
     }
     string name() const {
         return "space";
@@ -161,8 +188,8 @@ struct is_upper {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_upper() {}
-    bool operator() (int const c) const {
-        return ::isupper(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return c >= 'A' && c <= 'Z';
     }
     string name() const {
         return "uppercase";
@@ -173,8 +200,8 @@ struct is_xdigit {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_xdigit() {}
-    bool operator() (int const c) const {
-        return ::isxdigit(c) != 0;
+    constexpr bool operator() (int const c) const {
+        return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');
     }
     string name() const {
         return "hexdigit";
@@ -185,7 +212,7 @@ struct is_eol {
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr is_eol() {}
-    bool operator() (int const c) const {
+    constexpr bool operator() (int const c) const {
         return c == '\n';
     }
     string name() const {
@@ -197,14 +224,16 @@ struct is_eol {
 // Any single character
 
 class is_char {
+    friend struct grammar_rewrite;
+
     int const k;
 
 public:
     using is_predicate_type = true_type;
     static constexpr int rank = 0;
     constexpr explicit is_char(char const c)
-        : k(c) {}
-    bool operator() (int const c) const {
+        : k(static_cast<unsigned char>(c)) {}
+    constexpr bool operator() (int const c) const {
         return k == c;
     }
     string name() const {
@@ -212,7 +241,17 @@ public:
     }
 };
 
-is_char constexpr is_eof(EOF);
+struct is_eof {
+    using is_predicate_type = true_type;
+    static constexpr int rank = 0;
+    constexpr is_eof() {}
+    constexpr bool operator() (int const c) const {
+        return c == EOF;
+    }
+    string name() const {
+        return "EOF";
+    }
+} constexpr is_eof;
 
 //----------------------------------------------------------------------------
 // Combining character predicates
@@ -235,7 +274,7 @@ public:
     static constexpr int rank = 1;
     constexpr is_either(P1 const& p1, P2 const& p2)
         : p1(p1), p2(p2) {}
-    bool operator() (int const c) const {
+    constexpr bool operator() (int const c) const {
         return p1(c) || p2(c);
     }
     string name() const {
@@ -261,7 +300,7 @@ public:
     static constexpr int rank = 0;
     constexpr explicit is_except(P1 const& p1, P2 const& p2) 
         : p1(p1), p2(p2) {}
-    bool operator() (int const c) const {
+    constexpr bool operator() (int const c) const {
         return p1(c) && !p2(c);
     }
     string name() const {
@@ -276,88 +315,620 @@ constexpr is_except<P1, P2> const operator- (P1 const& p1, P2 const& p2) {
     return is_except<P1, P2>(p1, p2);
 }
 
+//----------------------------------------------------------------------------
+// Character classes: a predicate tree folded into a 256 bit table plus an EOF
+// bit, so that testing a symbol costs a single indexed load however the
+// predicate was composed.
+
+class char_class {
+    template <typename P>
+    static constexpr uint64_t fold_word(P const& p, int const w, int const b = 0) {
+        return (b == 64) ? 0 : ((p(64 * w + b) ? (uint64_t(1) << b) : 0)
+            | fold_word(p, w, b + 1));
+    }
+
+public:
+    uint64_t const bits[4];
+    bool const eof;
+
+    template <typename P, typename = typename P::is_predicate_type>
+    constexpr explicit char_class(P const& p) : bits {fold_word(p, 0),
+        fold_word(p, 1), fold_word(p, 2), fold_word(p, 3)}, eof(p(EOF)) {}
+
+    constexpr char_class(uint64_t const b0, uint64_t const b1, uint64_t const b2,
+        uint64_t const b3, bool const e) : bits {b0, b1, b2, b3}, eof(e) {}
+
+    static constexpr char_class none() {
+        return char_class(0, 0, 0, 0, false);
+    }
+
+    static constexpr char_class all() {
+        return char_class(~uint64_t(0), ~uint64_t(0), ~uint64_t(0), ~uint64_t(0), true);
+    }
+
+    static constexpr char_class single(unsigned char const c) {
+        return char_class((c >> 6 == 0) ? uint64_t(1) << (c & 63) : 0,
+            (c >> 6 == 1) ? uint64_t(1) << (c & 63) : 0,
+            (c >> 6 == 2) ? uint64_t(1) << (c & 63) : 0,
+            (c >> 6 == 3) ? uint64_t(1) << (c & 63) : 0, false);
+    }
+
+    constexpr char_class operator| (char_class const& c) const {
+        return char_class(bits[0] | c.bits[0], bits[1] | c.bits[1],
+            bits[2] | c.bits[2], bits[3] | c.bits[3], eof || c.eof);
+    }
+
+    // Test a symbol read from the input, negative chars are mapped to 128 - 255.
+    constexpr bool operator() (int const c) const {
+        return (c == EOF) ? eof : test(static_cast<unsigned char>(c));
+    }
+
+    constexpr bool test(unsigned char const c) const {
+        return ((bits[c >> 6] >> (c & 63)) & 1) != 0;
+    }
+};
+
 //===========================================================================
 // Default Inherited Attribute
 
 struct default_inherited {};
 
+//============================================================================
+// Input Traits
+
+// Iterators over memory that can be read through a pointer.
+template <typename Iterator> struct is_contiguous : integral_constant<bool,
+    is_same<Iterator, char const*>::value || is_same<Iterator, char*>::value> {};
+
+// Ranges over contiguous memory (like memory_range, or a stream_range when
+// USE_MMAP is defined), for which parsers take their pointer paths.
+template <typename Range> struct is_contiguous_range : is_contiguous<typename Range::iterator> {};
+
+// Iterators over a sequence of contiguous buffers (like rope_range), which
+// give the addresses of [first, last) when it lies within one buffer, with
+// 'bool contiguous(Iterator const& last, char const*& f, char const*& l) const'.
+template <typename Iterator, typename = void> struct is_segmented : false_type {};
+
+template <typename Iterator> struct is_segmented<Iterator, typename enable_if<is_same<
+    decltype(declval<Iterator const&>().contiguous(declval<Iterator const&>(),
+    declval<char const*&>(), declval<char const*&>())), bool>::value>::type> : true_type {};
+
+//----------------------------------------------------------------------------
+// Line index: the offsets of the line starts in a range, built in one pass
+// (with memchr, which is vectorised, on contiguous input), so that finding
+// the line and column of an offset is a binary search. A range can cache one
+// by providing 'line_index const& lines() const', otherwise an error counts
+// the lines up to its position. A thrown error ends the parse, so that is
+// once per parse; an error_channel, which can report an error for each
+// record, keeps what it has counted and extends it.
+
+class line_index {
+    vector<ptrdiff_t> starts;
+    ptrdiff_t scanned;
+
+    template <typename Iterator>
+    void scan(Iterator const& f, Iterator const& l, true_type /*contiguous*/) {
+        for (char const* i = f; (i = static_cast<char const*>(memchr(i, '\n', l - i))) != nullptr;) {
+            starts.push_back(scanned + (++i - f));
+        }
+    }
+
+    template <typename Iterator>
+    void scan(Iterator f, Iterator const& l, false_type /*contiguous*/) {
+        for (ptrdiff_t n = scanned + 1; f != l; ++f, ++n) {
+            if (*f == '\n') {
+                starts.push_back(n);
+            }
+        }
+    }
+
+public:
+    line_index() : starts {0}, scanned(0) {}
+
+    template <typename Iterator>
+    line_index(Iterator const& f, Iterator const& l) : line_index() {
+        extend(f, l);
+    }
+
+    template <typename Range>
+    explicit line_index(Range const& r) : line_index(r.first, r.last) {}
+
+    // index [f, l) as well, where f is the end of what is indexed so far.
+    template <typename Iterator>
+    void extend(Iterator const& f, Iterator const& l) {
+        scan(f, l, is_contiguous<Iterator>());
+        scanned += l - f;
+    }
+
+    // how much of the input is indexed.
+    ptrdiff_t size() const {
+        return scanned;
+    }
+
+    // line and column (from 1) of an offset.
+    pair<size_t, size_t> locate(ptrdiff_t const offset) const {
+        size_t const row = upper_bound(starts.begin(), starts.end(), offset) - starts.begin();
+        return make_pair(row, static_cast<size_t>(offset - starts[row - 1] + 1));
+    }
+};
+
+template <typename Range, typename = void> struct has_line_index : false_type {};
+
+template <typename Range> struct has_line_index<Range, typename enable_if<is_same<
+    decltype(declval<Range const&>().lines()), line_index const&>::value>::type> : true_type {};
+
+// A range that does not keep all of its input can locate an offset itself,
+// by providing 'pair<size_t, size_t> locate(ptrdiff_t) const'.
+template <typename Range, typename = void> struct has_locate : false_type {};
+
+template <typename Range> struct has_locate<Range, typename enable_if<is_same<
+    decltype(declval<Range const&>().locate(ptrdiff_t())), pair<size_t, size_t>>::value>::type>
+    : true_type {};
+
+//----------------------------------------------------------------------------
+// Marks: a range that frees its input behind the parser (like block_range)
+// needs to know where a parser may still go back to. It provides
+// 'size_t mark(iterator const&) const' to pin a position, and
+// 'void release(size_t) const' to unpin it, in the reverse order (releasing a
+// mark releases the marks made after it), and 'bool holds(ptrdiff_t) const'
+// to say if the input at an offset is still there. Parsers that go back
+// (attempt) or read their input again (a span gathered from blocks) pin where
+// they start with an input_pin. Other parsers only keep positions for errors,
+// which show the excerpt when the input is still held.
+
+template <typename Range, typename = void> struct has_mark : false_type {};
+
+template <typename Range> struct has_mark<Range, typename enable_if<is_same<
+    decltype(declval<Range const&>().mark(declval<typename Range::iterator const&>())), size_t>::value>::type>
+    : true_type {};
+
+template <typename Range, bool = has_mark<Range>::value> class input_pin {
+public:
+    template <typename Iterator>
+    input_pin(Range const&, Iterator const&) {}
+};
+
+template <typename Range> class input_pin<Range, true> {
+    Range const& r;
+    size_t const m;
+
+public:
+    template <typename Iterator>
+    input_pin(Range const& r, Iterator const& i) : r(r), m(r.mark(i)) {}
+
+    ~input_pin() {
+        r.release(m);
+    }
+
+    input_pin(input_pin const&) = delete;
+    input_pin& operator= (input_pin const&) = delete;
+};
+
+template <typename Range>
+bool holds_input(Range const& r, ptrdiff_t const offset, true_type /*has_mark*/) {
+    return r.holds(offset);
+}
+
+template <typename Range>
+bool holds_input(Range const& r, ptrdiff_t const offset, false_type /*has_mark*/) {
+    return true;
+}
+
+// is the input at the offset still there.
+template <typename Range>
+bool holds_input(Range const& r, ptrdiff_t const offset) {
+    return holds_input(r, offset, has_mark<Range>());
+}
+
+// The marks of a range that frees its input, as a stack of positions.
+class input_marks {
+    mutable vector<streamoff> marks;
+
+public:
+    size_t mark(streamoff const at) const {
+        marks.push_back(at);
+        return marks.size() - 1;
+    }
+
+    void release(size_t const m) const {
+        if (m < marks.size()) {
+            marks.resize(m);
+        }
+    }
+
+    // the input before this can be freed, given the furthest position read.
+    streamoff oldest(streamoff const at) const {
+        return marks.empty() ? at : min(at, *min_element(marks.begin(), marks.end()));
+    }
+};
+
 //===========================================================================
 // Parsing Errors
+//
+// A parse_error records the position, line and column of the error, a short
+// excerpt of the line, and a copy of the parser that failed. The full message
+// with the EBNF of what was expected is only formatted when what() is called,
+// or detach() is called to format it and drop the copy. As the error owns
+// what it describes, it can leave the scope of a grammar built locally. The
+// short reason is available from reason().
 
 using unique_defs = map<string, string>;
 
-struct parse_error : public runtime_error {
+class parse_error : public runtime_error {
+public:
+    // describes what the parser expected, given a pointer to the parser.
+    using describe_type = string (*)(void const*, unique_defs*);
 
-    template <typename Parser, typename Iterator, typename Range>
-    static string message(string const& what, Parser const& p,
-        Iterator const &f, Iterator const &l, Range const &r
-    ) {
-        stringstream err;
+    template <typename Parser>
+    static string describe_parser(void const* p, unique_defs* defs) {
+        return static_cast<Parser const*>(p)->ebnf(defs);
+    }
+
+private:
+    static constexpr size_t excerpt_max = 80;
+
+    mutable shared_ptr<void const> parser;
+    describe_type describe;
+    ptrdiff_t offset;
+    size_t row;
+    size_t column;
+    char excerpt[excerpt_max];
+    size_t excerpt_size;
+    size_t caret;
+    size_t caret_size;
+    mutable string message;
+
+    template <typename Iterator, typename Range>
+    void locate(Iterator const& f, Range const& r, true_type /*has_line_index*/) {
+        auto const rc = r.lines().locate(offset);
+        row = rc.first;
+        column = rc.second;
+    }
+
+    template <typename Iterator, typename Range>
+    void locate(Iterator const& f, Range const& r, false_type /*has_line_index*/) {
+        count(f, r, has_locate<Range>());
+    }
 
-        Iterator i(r.first);
-        Iterator line_start(r.first);
-        int row = 1;
-        while ((i != r.last) && (i != f)) {
+    template <typename Iterator, typename Range>
+    void count(Iterator const& f, Range const& r, true_type /*has_locate*/) {
+        auto const rc = r.locate(offset);
+        row = rc.first;
+        column = rc.second;
+    }
+
+    template <typename Iterator, typename Range>
+    void count(Iterator const& f, Range const& r, false_type /*has_locate*/) {
+        auto const rc = line_index(r.first, f).locate(offset);
+        row = rc.first;
+        column = rc.second;
+    }
+
+    // copy at most excerpt_max symbols of the line around [f, l), of the
+    // input the range still holds.
+    template <typename Iterator, typename Range>
+    void extract(Iterator const& f, Iterator const& l, Range const& r) {
+        caret = 0;
+        caret_size = 0;
+        excerpt_size = 0;
+        if (!holds_input(r, offset)) {
+            return;
+        }
+        Iterator i = f;
+        size_t back = 0;
+        while (back < excerpt_max / 2 && i != r.first && holds_input(r, (i - r.first) - 1)) {
+            --i;
             if (*i == '\n') {
-                ++row;
-                line_start = ++i;
-            } else {
                 ++i;
+                break;
             }
+            ++back;
         }
-
-        err << what << " at line: " << row
-            << " column: " << f - line_start + 1 << endl;
-
-        bool in = true;
-        for (Iterator i(line_start); (i != r.last) && (in || *i != '\n'); ++i) {
+        caret = back;
+        for (bool in = true; excerpt_size < excerpt_max && i != r.last && (in || *i != '\n'); ++i) {
             if (i == l) {
                 in = false;
             }
-            if (is_space(*i)) {
-                err << ' ';
-            } else {
-                err << static_cast<char>(*i);
+            if (in && excerpt_size > caret) {
+                ++caret_size;
             }
+            excerpt[excerpt_size++] = is_space(*i) ? ' ' : static_cast<char>(*i);
         }
-        err << endl;
-
-        i = line_start;
-        while (i != f) {
-            err << ' ';
-            ++i;
-        }
-
-        err << '^';
-        ++i;
+    }
 
-        if (i != l) {
-            ++i;
-            while (i != l) {
-                err << '-';
-                ++i;
+    string format() const {
+        stringstream err;
+        if (row == 0) {
+            // the range has freed the input there.
+            err << runtime_error::what() << " at offset: " << offset << endl;
+        } else {
+            err << runtime_error::what() << " at line: " << row << " column: " << column << endl;
+            err.write(excerpt, excerpt_size);
+            err << endl << string(caret, ' ') << '^';
+            if (caret_size > 0) {
+                err << string(caret_size - 1, '-') << '^';
             }
-            err << "^";
+            err << endl;
         }
-        
-        err << endl << "expecting: ";
-       
+        err << "expecting: ";
         unique_defs defs;
-        err << p.ebnf(&defs) << endl << "where:" << endl;
-
+        err << describe(parser.get(), &defs) << endl << "where:" << endl;
         for (auto const& d : defs) {
             err << "\t" << d.first << " = " << d.second << ";" << endl;
         }
-
         return err.str();
     }
 
+public:
     template <typename Parser, typename Iterator, typename Range>
     parse_error(string const& what, Parser const& p,
         Iterator const &f, Iterator const &l, Range const &r
-    ) : runtime_error(message(what, p, f, l, r)) {}
+    ) : parse_error(what, make_shared<Parser const>(p), describe_parser<Parser>, f, l, r) {}
+
+    // the parser is only referenced, the message must be formatted (with
+    // detach) while it exists.
+    template <typename Iterator, typename Range>
+    parse_error(string const& what, void const* p, describe_type d,
+        Iterator const &f, Iterator const &l, Range const &r
+    ) : parse_error(what, shared_ptr<void const>(p, [](void const*) {}), d, f, l, r) {}
+
+    template <typename Iterator, typename Range>
+    parse_error(string const& what, shared_ptr<void const> p, describe_type d,
+        Iterator const &f, Iterator const &l, Range const &r
+    ) : runtime_error(what), parser(move(p)), describe(d), offset(f - r.first) {
+        locate(f, r, has_line_index<Range>());
+        extract(f, l, r);
+    }
+
+    char const* what() const noexcept override {
+        try {
+            detach();
+        } catch (...) {
+            return runtime_error::what();
+        }
+        return message.c_str();
+    }
+
+    // Format the message now, after which the parser is no longer held.
+    void detach() const {
+        if (parser != nullptr) {
+            message = format();
+            parser.reset();
+        }
+    }
+
+    char const* reason() const noexcept {
+        return runtime_error::what();
+    }
+
+    ptrdiff_t position() const {
+        return offset;
+    }
+
+    // 0 (as is col()) when the range had freed the input there.
+    size_t line() const {
+        return row;
+    }
+
+    size_t col() const {
+        return column;
+    }
+};
+
+//============================================================================
+// Error Policy
+//
+// By default hard errors (strict, a failed parser that consumed input, a
+// functor that throws, a number that overflows) are thrown as a parse_error.
+// Parsing through an error_channel instead records the error in the channel
+// and fails, so that the outcome is three-way: success, failure, or failure
+// with error() set. Every combinator stops at a recorded error rather than
+// trying alternatives. The channel also keeps the furthest position at which
+// a recogniser failed and what was expected there, and either can be turned
+// into a parse_error at the top level. The policy is selected by the type of
+// the range, so the default costs nothing. Handles take either the range
+// they are declared for, or an error_channel over it.
+
+enum class parse_status {ok, fail, error};
+
+template <typename Range> class error_channel {
+    using iterator_type = typename Range::iterator;
+    using describe_type = parse_error::describe_type;
+
+    static constexpr size_t expected_max = 8;
+
+    struct expectation {
+        void const* parser;
+        describe_type describe;
+    };
+
+    Range const& range;
+
+    mutable bool hard;
+    mutable string reason;
+    mutable expectation culprit;
+    mutable iterator_type error_first;
+    mutable iterator_type error_last;
+
+    mutable ptrdiff_t furthest_offset;
+    mutable iterator_type furthest_at;
+    mutable expectation expected[expected_max];
+    mutable size_t expected_size;
+
+    // the lines counted so far, for a range that neither indexes nor
+    // locates them itself.
+    mutable line_index counted;
+    mutable iterator_type counted_to;
+
+    pair<size_t, size_t> locate(ptrdiff_t const offset, true_type /*has_locate*/) const {
+        return range.locate(offset);
+    }
+
+    pair<size_t, size_t> locate(ptrdiff_t const offset, false_type /*has_locate*/) const {
+        return counted.locate(offset);
+    }
+
+    // count the lines up to i, if the range does not.
+    void count_lines(iterator_type const& i) const {
+        if (!has_line_index<Range>::value && !has_locate<Range>::value && i - first > counted.size()) {
+            counted.extend(counted_to, i);
+            counted_to = i;
+        }
+    }
+
+    static string describe_expected(void const* c, unique_defs* defs) {
+        error_channel const& e = *static_cast<error_channel const*>(c);
+        string s;
+        for (size_t j = 0; j < e.expected_size; ++j) {
+            string const d = e.expected[j].describe(e.expected[j].parser, defs);
+            if (s.find(d) == string::npos) {
+                s += (s.empty() ? "" : " | ") + d;
+            }
+        }
+        return s;
+    }
+
+public:
+    using iterator = iterator_type;
+
+    iterator const first;
+    iterator const last;
+
+    explicit error_channel(Range const& r) : range(r), hard(false),
+        culprit {nullptr, nullptr}, error_first(r.first), error_last(r.first),
+        furthest_offset(-1), furthest_at(r.first), expected_size(0),
+        counted_to(r.first), first(r.first), last(r.last) {}
+
+    template <typename R = Range, typename = typename enable_if<has_line_index<R>::value>::type>
+    line_index const& lines() const {
+        return range.lines();
+    }
+
+    template <typename R = Range, typename = typename enable_if<!has_line_index<R>::value>::type>
+    pair<size_t, size_t> locate(ptrdiff_t const offset) const {
+        return locate(offset, has_locate<R>());
+    }
+
+    template <typename R = Range, typename = typename enable_if<has_mark<R>::value>::type>
+    size_t mark(iterator const& i) const {
+        return range.mark(i);
+    }
+
+    template <typename R = Range, typename = typename enable_if<has_mark<R>::value>::type>
+    void release(size_t const m) const {
+        range.release(m);
+    }
+
+    template <typename R = Range, typename = typename enable_if<has_mark<R>::value>::type>
+    bool holds(ptrdiff_t const offset) const {
+        return range.holds(offset);
+    }
+
+    // forget any error, to parse another record.
+    void clear() const {
+        hard = false;
+        furthest_offset = -1;
+        expected_size = 0;
+    }
+
+    bool error() const {
+        return hard;
+    }
+
+    parse_status status(bool const ok) const {
+        return ok ? parse_status::ok : hard ? parse_status::error : parse_status::fail;
+    }
+
+    ptrdiff_t furthest() const {
+        return furthest_offset;
+    }
+
+    // the first hard error is kept, later ones are consequences of it.
+    template <typename Parser>
+    void raise(string const& what, Parser const& p, iterator const& f, iterator const& l) const {
+        if (!hard) {
+            hard = true;
+            reason = what;
+            culprit = expectation {&p, parse_error::describe_parser<Parser>};
+            error_first = f;
+            error_last = l;
+        }
+    }
+
+    template <typename Parser>
+    void expect(Parser const& p, iterator const& i) const {
+        ptrdiff_t const offset = i - first;
+        if (offset > furthest_offset) {
+            furthest_offset = offset;
+            furthest_at = i;
+            expected_size = 0;
+        } else if (offset < furthest_offset) {
+            return;
+        }
+        for (size_t j = 0; j < expected_size; ++j) {
+            if (expected[j].parser == &p) {
+                return;
+            }
+        }
+        if (expected_size < expected_max) {
+            expected[expected_size++] = expectation {&p, parse_error::describe_parser<Parser>};
+        }
+    }
+
+    // The hard error, or else the furthest failure, as a parse_error. The
+    // message is formatted straight away, but the parsers must still exist.
+    parse_error to_error() const {
+        if (hard) {
+            count_lines(error_first);
+            parse_error e(reason, culprit.parser, culprit.describe, error_first, error_last, *this);
+            e.detach();
+            return e;
+        }
+        count_lines(furthest_at);
+        parse_error e("unexpected input", this, describe_expected, furthest_at, furthest_at, *this);
+        e.detach();
+        return e;
+    }
 };
 
+template <typename Range>
+error_channel<Range> make_error_channel(Range const& r) {
+    return error_channel<Range>(r);
+}
+
+// Report a hard error: throws by default, recorded by an error_channel.
+template <typename Parser, typename Iterator, typename Range>
+bool raise_error(string const& what, Parser const& p, Iterator const& f, Iterator const& l, Range const& r) {
+    throw parse_error(what, p, f, l, r);
+}
+
+template <typename Parser, typename Iterator, typename Range>
+bool raise_error(string const& what, Parser const& p, Iterator const& f, Iterator const& l,
+    error_channel<Range> const& r) {
+    r.raise(what, p, f, l);
+    return false;
+}
+
+// Has a hard error been recorded, always false when errors are thrown.
+template <typename Range>
+constexpr bool in_error(Range const& r) {
+    return false;
+}
+
+template <typename Range>
+bool in_error(error_channel<Range> const& r) {
+    return r.error();
+}
+
+// Note that a recogniser failed at i.
+template <typename Parser, typename Iterator, typename Range>
+void note_failure(Parser const& p, Iterator const& i, Range const& r) {}
+
+template <typename Parser, typename Iterator, typename Range>
+void note_failure(Parser const& p, Iterator const& i, error_channel<Range> const& r) {
+    r.expect(p, i);
+}
+
 //============================================================================
 // Type Helpers
 
@@ -445,70 +1016,304 @@ string format_name(P const& p, int const rank, unique_defs* defs = nullptr) {
 }
 
 //============================================================================
-// Primitive String Recognisers: accept, accept_str
+// Scanning Runs of a Character Class
+//
+// Contiguous input (pointer iterators, as used by the mmap'd file_vector) can
+// be scanned for the end of a run of a char_class 16 or 32 bytes at a time.
+// AVX2 is selected at run time and handles any class using nibble lookup
+// tables; SSE2 handles classes of up to three ranges (digits, identifiers,
+// whitespace and most other token classes). Anything else falls back to the
+// table lookup one symbol at a time.
+
+class span_scanner {
+    char_class const cls;
+
+    // ranges of the class, used by the SSE2 scanner.
+    static constexpr int next_in(char_class const& c, int const x) {
+        return (x >= 256 || c.test(x)) ? x : next_in(c, x + 1);
+    }
 
-//----------------------------------------------------------------------------
-// Stream is advanced if symbol matches, and symbol is appended to result.
+    static constexpr int next_out(char_class const& c, int const x) {
+        return (x >= 256 || !c.test(x)) ? x : next_out(c, x + 1);
+    }
 
-template <typename Predicate> class recogniser_accept {
-    Predicate const p;
+    static constexpr int range_start(char_class const& c, int const k) {
+        return next_in(c, (k == 0) ? 0 : range_end(c, k - 1));
+    }
 
-public:
-    using is_parser_type = true_type;
-    using is_handle_type = false_type;
-    using has_side_effects = false_type;
-    using result_type = string;
-    int const rank;
+    static constexpr int range_end(char_class const& c, int const k) {
+        return next_out(c, range_start(c, k));
+    }
 
-    constexpr explicit recogniser_accept(Predicate const& p) : p(p), rank(p.rank) {}
+    // bit h of row lo is set if the symbol (16 * (h + h0) + lo) is in the class.
+    static constexpr uint8_t nibble_row(char_class const& c, int const lo, int const h0, int const h = 0) {
+        return (h == 8) ? 0 : ((c.test(16 * (h + h0) + lo) ? (1 << h) : 0)
+            | nibble_row(c, lo, h0, h + 1));
+    }
 
-    template <typename Iterator, typename Range, typename Inherit = default_inherited>
-    bool operator() (
-        Iterator &i,
-        Range const &r,
-        string *result = nullptr,
-        Inherit* st = nullptr
-    ) const {
-        int sym;
-        if (i == r.last) {
-            sym = EOF;
-        } else {
-            sym = *i;
+    static constexpr int clamp_range(int const x) {
+        return (x > 255) ? 255 : x;
+    }
+
+    uint8_t const lo_rows[16];
+    uint8_t const hi_rows[16];
+    uint8_t const starts[3];
+    uint8_t const lengths[3];
+    bool const simple;
+
+    template <size_t... Is>
+    constexpr span_scanner(char_class const& c, size_sequence<Is...>) : cls(c),
+        lo_rows {nibble_row(c, Is, 0)...}, hi_rows {nibble_row(c, Is, 8)...},
+        starts {uint8_t(clamp_range(range_start(c, 0))), uint8_t(clamp_range(range_start(c, 1))),
+            uint8_t(clamp_range(range_start(c, 2)))},
+        lengths {uint8_t(range_end(c, 0) - range_start(c, 0)), uint8_t(range_end(c, 1) - range_start(c, 1)),
+            uint8_t(range_end(c, 2) - range_start(c, 2))},
+        simple(range_start(c, 3) >= 256 && range_end(c, 0) - range_start(c, 0) < 256) {}
+
+    char const* scan_symbols(char const* f, char const* const l) const {
+        while (f != l && cls.test(*f)) {
+            ++f;
         }
-        if (!p(sym)) {
-            return false;
+        return f;
+    }
+
+#ifdef PARSER_COMBINATORS_X86
+#ifdef __AVX2__
+    static constexpr bool has_avx2() {
+        return true;
+    }
+#else
+    static bool has_avx2() {
+        static bool const avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+        return avx2;
+    }
+
+    __attribute__((target("avx2")))
+#endif
+    char const* scan_avx2(char const* f, char const* const l) const {
+        __m256i const lo_tab = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(lo_rows)));
+        __m256i const hi_tab = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<__m128i const*>(hi_rows)));
+        __m256i const bit_tab = _mm256_setr_epi8(
+            1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+            1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+        __m256i const nibble = _mm256_set1_epi8(0x0f);
+        __m256i const zero = _mm256_setzero_si256();
+        for (; l - f >= 32; f += 32) {
+            __m256i const x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(f));
+            __m256i const lo = _mm256_and_si256(x, nibble);
+            __m256i const hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+            __m256i const row = _mm256_blendv_epi8(_mm256_shuffle_epi8(lo_tab, lo),
+                _mm256_shuffle_epi8(hi_tab, lo), x);
+            __m256i const bit = _mm256_shuffle_epi8(bit_tab, hi);
+            unsigned const miss = static_cast<unsigned>(_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), zero)));
+            if (miss != 0) {
+                return f + __builtin_ctz(miss);
+            }
         }
-        ++i;
-        if (result != nullptr) {
-            result->push_back(sym);
+        return simple ? scan_sse2(f, l) : scan_symbols(f, l);
+    }
+
+    char const* scan_sse2(char const* f, char const* const l) const {
+        __m128i const s0 = _mm_set1_epi8(static_cast<char>(0x80 - starts[0]));
+        __m128i const n0 = _mm_set1_epi8(static_cast<char>(lengths[0] - 0x80));
+        __m128i const s1 = _mm_set1_epi8(static_cast<char>(0x80 - starts[1]));
+        __m128i const n1 = _mm_set1_epi8(static_cast<char>(lengths[1] - 0x80));
+        __m128i const s2 = _mm_set1_epi8(static_cast<char>(0x80 - starts[2]));
+        __m128i const n2 = _mm_set1_epi8(static_cast<char>(lengths[2] - 0x80));
+        for (; l - f >= 16; f += 16) {
+            __m128i const x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(f));
+            __m128i const in = _mm_or_si128(_mm_or_si128(
+                _mm_cmplt_epi8(_mm_add_epi8(x, s0), n0),
+                _mm_cmplt_epi8(_mm_add_epi8(x, s1), n1)),
+                _mm_cmplt_epi8(_mm_add_epi8(x, s2), n2));
+            unsigned const miss = static_cast<unsigned>(_mm_movemask_epi8(in)) ^ 0xffff;
+            if (miss != 0) {
+                return f + __builtin_ctz(miss);
+            }
         }
-        return true;
+        return scan_symbols(f, l);
     }
+#endif // PARSER_COMBINATORS_X86
 
-    string ebnf(unique_defs* defs = nullptr) const {
-        return p.name();
+public:
+    constexpr explicit span_scanner(char_class const& c)
+        : span_scanner(c, range<0, 16>()) {}
+
+    // Returns the end of the run of class members starting at f.
+    char const* operator() (char const* f, char const* const l) const {
+        // most runs are short, so test the first few symbols one at a time.
+        for (int k = 0; k < 4; ++k, ++f) {
+            if (f == l || !cls.test(*f)) {
+                return f;
+            }
+        }
+#ifdef PARSER_COMBINATORS_X86
+        if (l - f >= 32 && has_avx2()) {
+            return scan_avx2(f, l);
+        } else if (simple) {
+            return scan_sse2(f, l);
+        }
+#endif
+        return scan_symbols(f, l);
     }
 };
 
-template <typename P, typename = typename P::is_predicate_type>
-constexpr recogniser_accept<P> accept(P const &p) {
-    return recogniser_accept<P>(p);
+//============================================================================
+// FIRST Sets and Choice Dispatch
+//
+// Every parser reports the symbols it can start with (its FIRST set), and
+// whether it can succeed without consuming input. Parsers that are only known
+// at run time (references, strict) report everything. A choice builds a table
+// from the FIRST sets of its alternatives, so that a single lookup on the next
+// symbol selects the one alternative that can match, and ordered trial is only
+// needed where the FIRST sets overlap.
+
+class first_set {
+public:
+    char_class const symbols;
+    bool const nullable;
+
+    constexpr first_set(char_class const& s, bool const n) : symbols(s), nullable(n) {}
+
+    // can match anything, used when the parser is unknown.
+    static constexpr first_set all() {
+        return first_set(char_class::all(), true);
+    }
+
+    // matches the empty string only.
+    static constexpr first_set empty() {
+        return first_set(char_class::none(), true);
+    }
+
+    // never matches.
+    static constexpr first_set none() {
+        return first_set(char_class::none(), false);
+    }
+
+    // Can the parser succeed, or consume input, when the next symbol is c.
+    constexpr bool operator() (int const c) const {
+        return nullable || symbols(c);
+    }
+
+    // FIRST of a choice.
+    constexpr first_set operator| (first_set const& f) const {
+        return first_set(symbols | f.symbols, nullable || f.nullable);
+    }
+
+    // FIRST of a sequence.
+    constexpr first_set then(first_set const& f) const {
+        return nullable ? first_set(symbols | f.symbols, f.nullable) : *this;
+    }
+
+    // FIRST of zero or more repetitions.
+    constexpr first_set repeat() const {
+        return first_set(symbols, true);
+    }
+};
+
+template <size_t N> struct first_sets {
+    first_set const sets[N];
+};
+
+// Parsers defined outside the library need not report their FIRST set, one
+// without a first() member is taken to start with anything.
+template <typename Parser, typename = void> struct has_first : false_type {};
+
+template <typename Parser> struct has_first<Parser, typename enable_if<is_convertible<
+    decltype(declval<Parser const&>().first()), first_set>::value>::type> : true_type {};
+
+template <typename Parser>
+constexpr first_set first_set_of(Parser const& p, true_type /*has_first*/) {
+    return p.first();
 }
 
-//-----------------------------------------------------------------------------
-// String Parser.
+template <typename Parser>
+constexpr first_set first_set_of(Parser const& p, false_type /*has_first*/) {
+    return first_set::all();
+}
 
-class accept_str {
-    char const* s;
+template <typename Parser>
+constexpr first_set first_set_of(Parser const& p) {
+    return first_set_of(p, has_first<Parser>());
+}
+
+//----------------------------------------------------------------------------
+// Route the next symbol (0 - 255, or 256 for the end of input) to the index of
+// the only alternative that can match, to the first of several alternatives
+// to try in order (tagged with trial), or to none. The routes are built when
+// the choice is, and kept out of line, shared by the copies of the choice, so
+// a choice only holds a shared pointer, and still fits in an inline handle.
+//
+// A choice holds copies of its alternatives, so assigning to a handle after
+// it is used in a choice changes neither the choice nor its routes. Grammars
+// that refer to a handle before it is assigned (recursion) do so through fix
+// or a reference, which can start with anything.
+
+template <size_t N> class choice_table {
+    static_assert(N < 127, "choice_table supports at most 126 alternatives");
+
+public:
+    enum : uint8_t {none = 0x7f, trial = 0x80};
+
+private:
+    using routes_type = array<uint8_t, 257>;
+
+    shared_ptr<routes_type const> const route;
+
+    static shared_ptr<routes_type const> routes(first_sets<N> const& f) {
+        shared_ptr<routes_type> const r = make_shared<routes_type>();
+        for (int c = 0; c < 257; ++c) {
+            int const s = (c == 256) ? EOF : c;
+            size_t k = 0;
+            while (k < N && !f.sets[k](s)) {
+                ++k;
+            }
+            size_t j = k + 1;
+            while (j < N && !f.sets[j](s)) {
+                ++j;
+            }
+            (*r)[c] = (k == N) ? uint8_t(none) : (j < N) ? uint8_t(trial | k) : uint8_t(k);
+        }
+        return r;
+    }
+
+public:
+    explicit choice_table(first_sets<N> const& f) : route(routes(f)) {}
+
+    template <typename Iterator, typename Range>
+    uint8_t operator() (Iterator const& i, Range const& r) const {
+        return (*route)[(i == r.last) ? 256 : static_cast<unsigned char>(*i)];
+    }
+};
+
+//============================================================================
+// Primitive String Recognisers: accept, accept_str, accept_any_str, as_span
+
+//----------------------------------------------------------------------------
+// Stream is advanced if symbol matches, and symbol is appended to result.
+
+template <typename Predicate> class recogniser_accept {
+    friend struct grammar_rewrite;
+
+    Predicate const p;
+    char_class const cls;
 
 public:
     using is_parser_type = true_type;
     using is_handle_type = false_type;
     using has_side_effects = false_type;
     using result_type = string;
-    int const rank = 0;
+    int const rank;
+
+    constexpr explicit recogniser_accept(Predicate const& p)
+        : p(p), cls(p), rank(p.rank) {}
 
-    constexpr explicit accept_str(char const* s) : s(s) {}
+    constexpr char_class const& symbols() const {
+        return cls;
+    }
 
     template <typename Iterator, typename Range, typename Inherit = default_inherited>
     bool operator() (
@@ -517,718 +1322,3566 @@ public:
         string *result = nullptr,
         Inherit* st = nullptr
     ) const {
-        for (auto j = s; *j != 0;  ++j) {
-            if (i == r.last || *i != *j) {
-                return false;
-            }
-            ++i;
+        int sym;
+        if (i == r.last) {
+            sym = EOF;
+        } else {
+            sym = static_cast<unsigned char>(*i);
+        }
+        if (!cls(sym)) {
+            note_failure(*this, i, r);
+            return false;
         }
+        ++i;
         if (result != nullptr) {
-            result->append(s);
+            result->push_back(sym);
         }
         return true;
     }
 
+    constexpr first_set first() const {
+        return first_set(cls, false);
+    }
+
     string ebnf(unique_defs* defs = nullptr) const {
-        return "\"" + string(s) + "\"";
+        return p.name();
     }
 };
 
-//============================================================================
-// Constant Parsers: succ, fail
+template <typename P, typename = typename P::is_predicate_type>
+constexpr recogniser_accept<P> accept(P const &p) {
+    return recogniser_accept<P>(p);
+}
 
-//----------------------------------------------------------------------------
-// Always succeeds.
+//-----------------------------------------------------------------------------
+// String Parser.
 
-struct parser_succ {
+class accept_str {
+    char const* s;
+    size_t const n;
+
+    static constexpr size_t length(char const* s) {
+        return (*s == 0) ? 0 : 1 + length(s + 1);
+    }
+
+    template <typename Iterator, typename Range>
+    bool match(Iterator &i, Range const &r, false_type /*contiguous*/) const {
+        for (auto j = s; *j != 0;  ++j) {
+            if (i == r.last || *i != *j) {
+                return false;
+            }
+            ++i;
+        }
+        return true;
+    }
+
+    // compare the whole string at once, on failure 'i' stops at the
+    // first difference as above.
+    template <typename Iterator, typename Range>
+    bool match(Iterator &i, Range const &r, true_type /*contiguous*/) const {
+        size_t const m = min(n, static_cast<size_t>(r.last - i));
+        if (m == n && memcmp(i, s, n) == 0) {
+            i += n;
+            return true;
+        }
+        i = mismatch(i, i + m, s).first;
+        return false;
+    }
+
+public:
     using is_parser_type = true_type;
     using is_handle_type = false_type;
     using has_side_effects = false_type;
-    using result_type = void;
+    using result_type = string;
     int const rank = 0;
 
-    constexpr parser_succ() {}
+    constexpr explicit accept_str(char const* s) : s(s), n(length(s)) {}
 
     template <typename Iterator, typename Range, typename Inherit = default_inherited>
     bool operator() (
         Iterator &i,
         Range const &r,
-        void *result = nullptr,
+        string *result = nullptr,
         Inherit* st = nullptr
     ) const {
+        Iterator const first = i;
+        if (!match(i, r, is_contiguous<Iterator>())) {
+            note_failure(*this, first, r);
+            return false;
+        }
+        if (result != nullptr) {
+            result->append(s, n);
+        }
         return true;
     }
 
+    constexpr first_set first() const {
+        return (*s == 0) ? first_set::empty() : first_set(char_class::single(*s), false);
+    }
+
     string ebnf(unique_defs* defs = nullptr) const {
-        return "succ";
+        return "\"" + string(s) + "\"";
     }
-} constexpr succ;
+};
 
-//----------------------------------------------------------------------------
-// Always fails.
+//-----------------------------------------------------------------------------
+// Literal Set Parser: matches the longest of a set of literals, optionally
+// ignoring (ASCII) case, in a single pass over the input. The result is the
+// index of the literal matched. The set is compiled into a trie when the
+// parser is constructed: symbols are mapped to classes (only those used in
+// the literals are distinguished), and each node has a dense transition row
+// indexed by class. The trie is shared by copies of the parser. An empty
+// literal in the set matches when no other literal does.
+
+class accept_any_str {
+    struct trie {
+        vector<string> literals;
+        unsigned char classes[256];
+        int width;
+        vector<int> delta;
+        vector<int> accepts;
+
+        static unsigned char fold(unsigned char const c, bool const ignore_case) {
+            return (ignore_case && c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+        }
 
-struct parser_fail {
+        trie(initializer_list<char const*> ls, bool const ignore_case)
+            : literals(ls.begin(), ls.end()), width(1) {
+            fill(classes, classes + 256, 0);
+            for (auto const& l : literals) {
+                for (char const c : l) {
+                    unsigned char const k = fold(c, ignore_case);
+                    if (classes[k] == 0) {
+                        classes[k] = width++;
+                    }
+                }
+            }
+            if (ignore_case) {
+                for (int c = 'A'; c <= 'Z'; ++c) {
+                    classes[c] = classes[c - 'A' + 'a'];
+                }
+            }
+            accepts.push_back(-1);
+            delta.resize(width, -1);
+            for (size_t j = 0; j < literals.size(); ++j) {
+                int n = 0;
+                for (char const c : literals[j]) {
+                    int const e = n * width + classes[fold(c, ignore_case)];
+                    if (delta[e] < 0) {
+                        delta[e] = accepts.size();
+                        accepts.push_back(-1);
+                        delta.resize(delta.size() + width, -1);
+                    }
+                    n = delta[e];
+                }
+                if (accepts[n] < 0) {
+                    accepts[n] = j;
+                }
+            }
+        }
+    };
+
+    shared_ptr<trie const> t;
+
+public:
     using is_parser_type = true_type;
     using is_handle_type = false_type;
     using has_side_effects = false_type;
-    using result_type = void;
-    int const rank = 0;
+    using result_type = int;
+    int const rank;
 
-    constexpr parser_fail() {}
+    explicit accept_any_str(initializer_list<char const*> ls, bool const ignore_case = false)
+        : t(make_shared<trie const>(ls, ignore_case)), rank((ls.size() > 1) ? 1 : 0) {}
+
+    string const& literal(int const j) const {
+        return t->literals[j];
+    }
 
     template <typename Iterator, typename Range, typename Inherit = default_inherited>
     bool operator() (
         Iterator &i,
         Range const &r,
-        void *result = nullptr,
+        int *result = nullptr,
         Inherit* st = nullptr
     ) const {
-        return false;
+        trie const& d = *t;
+        int found = d.accepts[0];
+        int n = 0;
+        Iterator j = i;
+        Iterator end = i;
+        while (j != r.last
+            && (n = d.delta[n * d.width + d.classes[static_cast<unsigned char>(*j)]]) >= 0) {
+            ++j;
+            if (d.accepts[n] >= 0) {
+                found = d.accepts[n];
+                end = j;
+            }
+        }
+        if (found < 0) {
+            note_failure(*this, i, r);
+            return false;
+        }
+        i = end;
+        if (result != nullptr) {
+            *result = found;
+        }
+        return true;
+    }
+
+    first_set first() const {
+        uint64_t b[4] {0, 0, 0, 0};
+        for (int c = 0; c < 256; ++c) {
+            if (t->delta[t->classes[c]] >= 0) {
+                b[c >> 6] |= uint64_t(1) << (c & 63);
+            }
+        }
+        return first_set(char_class(b[0], b[1], b[2], b[3], false), t->accepts[0] >= 0);
     }
 
     string ebnf(unique_defs* defs = nullptr) const {
-        return "fail";
+        string s;
+        for (auto const& l : t->literals) {
+            if (!s.empty()) {
+                s += " | ";
+            }
+            s += "\"" + l + "\"";
+        }
+        return s;
     }
-} constexpr fail;
+};
 
-//============================================================================
-// Lifting String Recognisers to Parsers, and Parsers up one level: any, all
+//-----------------------------------------------------------------------------
+// Span results: a slice of the input. On contiguous input this is a view of
+// [first, last) and costs no allocation or copying, adjacent slices are
+// extended in place. On segmented input it is a view when the slice lies in
+// one buffer. Otherwise the symbols are gathered into a buffer owned by the
+// span.
+
+class char_span {
+    char const* f;
+    char const* l;
+    string buf;
+
+    void gathered() {
+        f = buf.data();
+        l = f + buf.size();
+    }
 
-//----------------------------------------------------------------------------
-// as soon as one parser succeeds, pass result to user supplied functor
+public:
+    char_span() : f(nullptr), l(nullptr) {}
 
-template <typename Functor, typename Inherit, typename = void> class call_any {}; 
+    char_span(char const* first, char const* last) : f(first), l(last) {}
 
-template <typename Functor, typename Inherit>
-class call_any<Functor, Inherit, typename enable_if<is_same<Inherit, default_inherited>::value>::type> {
-    Functor const f;
+    char_span(char_span const& s) : f(s.f), l(s.l), buf(s.buf) {
+        if (!buf.empty()) {
+            gathered();
+        }
+    }
 
-public: 
-    explicit call_any(Functor const& f) : f(f) {}
-    
-    template <typename Result, typename Rs, size_t... I>
-    void any(Result* r, int j, Rs& rs, Inherit* st, size_t...) {
-        f(r, j, get<I>(rs)...);
+    char_span& operator= (char_span const& s) {
+        buf = s.buf;
+        if (buf.empty()) {
+            f = s.f;
+            l = s.l;
+        } else {
+            gathered();
+        }
+        return *this;
     }
-};
 
-template <typename Functor, typename Inherit>
-class call_any<Functor, Inherit, typename enable_if<!is_same<Inherit, default_inherited>::value>::type> {
-    Functor const f;
+    char const* begin() const {
+        return f;
+    }
 
-public: 
-    explicit call_any(Functor const& f) : f(f) {}
-    
-    template <typename Result, typename Rs, size_t... I>
-    void any(Result* r, int j, Rs& rs, Inherit* st, size_t...) {
-        f(r, j, get<I>(rs)..., st);
+    char const* end() const {
+        return l;
     }
-};
 
-template <typename Functor, typename... Parsers> class fmap_choice {
-    using functor_traits = function_traits<Functor>;
-    using tuple_type = tuple<Parsers...>;
-    using tmp_type = tuple<typename Parsers::result_type...>;
+    char const* data() const {
+        return f;
+    }
 
-public:
-    using is_parser_type = true_type;
-    using is_handle_type = false_type;
-    using has_side_effects = true_type;
-    using result_type = typename remove_pointer<typename functor_traits::template argument<0>::type>::type;
+    size_t size() const {
+        return l - f;
+    }
 
-private:
-    tuple_type const ps;
-    Functor const f;
+    bool empty() const {
+        return f == l;
+    }
 
-    template <typename Iterator, typename Range, typename Inherit, typename Rs, size_t I0, size_t... Is> 
-    int any_parsers(Iterator &i, Range const &r, Inherit* st, Rs &rs, size_t, size_t...) const {
-        if (get<I0>(ps)(i, r, &get<I0>(rs), st)) {
-            return I0;
-        }
-        return any_parsers<Iterator, Range, Inherit, Rs, Is...>(i, r, st, rs, Is...);
+    string str() const {
+        return string(f, l);
     }
 
-    template <typename Iterator, typename Range, typename Inherit, typename Rs, size_t I0>
-    int any_parsers(Iterator &i, Range const &r, Inherit* st, Rs &rs, size_t) const {
-        if (get<I0>(ps)(i, r, &get<I0>(rs), st)) {
-            return I0;
+    // keep the first n symbols.
+    void truncate(size_t const n) {
+        if (buf.empty()) {
+            l = f + n;
+        } else {
+            buf.resize(n);
+            gathered();
         }
-        return -1;
     }
 
-    template <typename Iterator, typename Range, typename Inherit, size_t... I> bool fmap_any(
-        Iterator &i,
-        Range const &r,
-        size_sequence<I...> seq,
-        result_type *result,
-        Inherit* st
-    ) const {
-        tmp_type tmp {};
-        Iterator const first = i;
-        int const j = any_parsers<Iterator, Range, Inherit, tmp_type, I...>(i, r, st, tmp, I...);
-        if (j >= 0) {
-            if (result != nullptr) {
-                call_any<Functor, Inherit> call_f(f);
-                try {
-                    call_f.template any<result_type, tmp_type, I...>(result, j, tmp, st, I...);
-                } catch (runtime_error &e) {
-                    throw parse_error(e.what(), *this, first, i, r);
-                }
+    template <typename Iterator>
+    void append(Iterator first, Iterator last, true_type /*contiguous*/) {
+        if (buf.empty() && (f == l || l == first)) {
+            if (f == l) {
+                f = first;
             }
-            return true;
+            l = last;
+        } else {
+            if (buf.empty()) {
+                buf.assign(f, l);
+            }
+            buf.append(first, last - first);
+            gathered();
         }
-        return false;
     }
 
-public:
-    int const rank = 1;
+    template <typename Iterator>
+    void append(Iterator first, Iterator const& last, false_type /*contiguous*/) {
+        if (buf.empty()) {
+            buf.assign(f, l);
+        }
+        for (; first != last; ++first) {
+            buf.push_back(*first);
+        }
+        gathered();
+    }
 
-    constexpr explicit fmap_choice(Functor const& f, Parsers const&... ps)
-        : f(f), ps(ps...) {}
+    friend bool operator== (char_span const& s, char const* t) {
+        return s.size() == char_traits<char>::length(t) && equal(s.f, s.l, t);
+    }
 
-    template <typename Iterator, typename Range, typename Inherit>
-    bool operator() (
-        Iterator &i,
-        Range const &r,
-        result_type *result = nullptr,
-        Inherit* st = nullptr
-    ) const {
-        return fmap_any(i, r, range<0, sizeof...(Parsers)>(), result, st);
+    friend bool operator== (char const* t, char_span const& s) {
+        return s == t;
     }
 
-    class choice_ebnf {
-        int const rank;
-        unique_defs* defs;
+    friend bool operator!= (char_span const& s, char const* t) {
+        return !(s == t);
+    }
 
-    public:
-        choice_ebnf(int r, unique_defs* d) : rank(r), defs(d) {}
-        template <typename P>
-        string operator() (string const& s, P&& p) const {
-            if (s.length() == 0) {
-                return format_name(p, rank, defs);
-            }
-            return s + " | "  + format_name(p, rank, defs);
-        }
-    };
+    friend bool operator!= (char const* t, char_span const& s) {
+        return !(s == t);
+    }
 
-    string ebnf(unique_defs* defs = nullptr) const {
-        return fold_tuple(choice_ebnf(rank, defs), string(), ps);
+    friend ostream& operator<< (ostream& out, char_span const& s) {
+        return out.write(s.f, s.size());
     }
 };
 
-template <typename F, typename... PS>
-constexpr fmap_choice<F, PS...> const any(F const& f, PS const&... ps) {
-    return fmap_choice<F, PS...>(f, ps...);
-}
-
-//----------------------------------------------------------------------------
-// If all parsers succeed, pass all results as arguments to user supplied functor
-
-template <typename Functor, typename Inherit, typename = void> class call_all {}; 
+//-----------------------------------------------------------------------------
+// Return the input matched by a recogniser as a char_span, rather than
+// building a string.
 
-template <typename Functor, typename Inherit>
-class call_all<Functor, Inherit, typename enable_if<is_same<Inherit, default_inherited>::value>::type> {
-    Functor const f;
+template <typename Parser> class recogniser_span {
+    Parser const p;
 
-public: 
-    explicit call_all(Functor const& f) : f(f) {}
-    
-    template <typename Result, typename Rs, size_t... I>
-    void all(Result* r, Rs& rs, Inherit* st, size_t...) {
-        f(r, get<I>(rs)...);
+    template <typename Iterator, typename Range, typename Inherit>
+    bool span_of(Iterator &i, Range const &r, char_span *result, Inherit* st, true_type) const {
+        Iterator const first = i;
+        typename Parser::result_type *const discard_result = nullptr;
+        if (!p(i, r, discard_result, st)) {
+            return false;
+        }
+        if (result != nullptr) {
+            result->append(first, i, true_type());
+        }
+        return true;
     }
-};
-
-template <typename Functor, typename Inherit>
-class call_all<Functor, Inherit, typename enable_if<!is_same<Inherit, default_inherited>::value>::type> {
-    Functor const f;
 
-public: 
-    explicit call_all(Functor const& f) : f(f) {}
-    
-    template <typename Result, typename Rs, size_t... I>
-    void all(Result* r, Rs& rs, Inherit* st, size_t...) {
-        f(r, get<I>(rs)..., st);
+    template <typename Iterator, typename Range, typename Inherit>
+    bool span_of(Iterator &i, Range const &r, char_span *result, Inherit* st, false_type) const {
+        return segment_of(i, r, result, st, is_segmented<Iterator>());
     }
-};
-
-template <typename Functor, typename... Parsers> class fmap_sequence {
-    using functor_traits = function_traits<Functor>;
-    using tuple_type = tuple<Parsers...>;
-    using tmp_type = tuple<typename Parsers::result_type...>;
-
-public:
-    using is_parser_type = true_type;
-    using is_handle_type = false_type;
-    using has_side_effects = true_type;
-    using result_type = typename remove_pointer<typename functor_traits::template argument<0>::type>::type;
-
-private:
-    tuple_type const ps;
-    Functor const f;
 
-    template <typename Iterator, typename Range, typename Inherit, typename Rs, size_t I0, size_t... Is> 
-    bool all_parsers(Iterator &i, Range const &r, Inherit* st, Rs &rs, size_t, size_t...) const {
-        if (get<I0>(ps)(i, r, &get<I0>(rs), st)) {
-            return all_parsers<Iterator, Range, Inherit, Rs, Is...>(i, r, st, rs, Is...);
+    // A view when the span is within one buffer, gathered when it straddles.
+    template <typename Iterator, typename Range, typename Inherit>
+    bool segment_of(Iterator &i, Range const &r, char_span *result, Inherit* st, true_type) const {
+        input_pin<Range> const pin(r, i);
+        Iterator const first = i;
+        typename Parser::result_type *const discard_result = nullptr;
+        if (!p(i, r, discard_result, st)) {
+            return false;
         }
-        return false;
+        if (result != nullptr) {
+            char const* f;
+            char const* l;
+            if (first.contiguous(i, f, l)) {
+                result->append(f, l, true_type());
+            } else {
+                result->append(first, i, false_type());
+            }
+        }
+        return true;
     }
 
-    template <typename Iterator, typename Range, typename Inherit, typename Rs, size_t I0>
-    bool all_parsers(Iterator &i, Range const &r, Inherit* st, Rs &rs, size_t) const {
-        return get<I0>(ps)(i, r, &get<I0>(rs), st);
+    // Gather from a non-contiguous input as it is parsed, to avoid reading
+    // the symbols a second time.
+    template <typename Iterator, typename Range, typename Inherit>
+    bool segment_of(Iterator &i, Range const &r, char_span *result, Inherit* st, false_type) const {
+        return gather(i, r, result, st, is_same<typename Parser::result_type, string>());
     }
 
-    template <typename Iterator, typename Range, typename Inherit, size_t... I>
-    bool fmap_all(Iterator &i, Range const &r, size_sequence<I...> seq, result_type *result, Inherit* st) const {
-        tmp_type tmp {};
+    template <typename Iterator, typename Range, typename Inherit>
+    bool gather(Iterator &i, Range const &r, char_span *result, Inherit* st, true_type) const {
+        string tmp;
+        if (!p(i, r, (result != nullptr) ? &tmp : nullptr, st)) {
+            return false;
+        }
+        if (result != nullptr) {
+            result->append(tmp.cbegin(), tmp.cend(), false_type());
+        }
+        return true;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit>
+    bool gather(Iterator &i, Range const &r, char_span *result, Inherit* st, false_type) const {
+        input_pin<Range> const pin(r, i);
         Iterator const first = i;
-        if (all_parsers<Iterator, Range, Inherit, tmp_type, I...>(i, r, st, tmp, I...)) {
-            if (result != nullptr) {
-                call_all<Functor, Inherit> call_f(f);
-                try {
-                    call_f.template all<result_type, tmp_type, I...>(result, tmp, st, I...);
-                } catch (runtime_error &e) {
-                    throw parse_error(e.what(), *this, first, i, r);
-                }
-            }
-            return true;
+        typename Parser::result_type *const discard_result = nullptr;
+        if (!p(i, r, discard_result, st)) {
+            return false;
         }
-        return false;
+        if (result != nullptr) {
+            result->append(first, i, false_type());
+        }
+        return true;
     }
 
 public:
-    int const rank = 0;
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = char_span;
+    int const rank;
 
-    constexpr fmap_sequence(Functor const& f, Parsers const&... ps)
-        : f(f), ps(ps...) {}
+    constexpr explicit recogniser_span(Parser const& q) : p(q), rank(q.rank) {}
 
     template <typename Iterator, typename Range, typename Inherit = default_inherited>
     bool operator() (
         Iterator &i,
         Range const &r,
-        result_type *result = nullptr,
+        char_span *result = nullptr,
         Inherit* st = nullptr
     ) const {
-        return fmap_all(i, r, range<0, sizeof...(Parsers)>(), result, st);
+        return span_of(i, r, result, st, is_contiguous<Iterator>());
     }
 
-    class sequence_ebnf {
-        int const rank;
-        unique_defs* defs;
-
-    public:
-        sequence_ebnf(int r, unique_defs* d) : rank(r), defs(d) {}
-        template <typename P>
-        string operator() (string const &s, P&& p) const {
-            if (s.size() == 0) {
-                return format_name(p, rank, defs);
-            }
-            return s + ", "  + format_name(p, rank, defs);
-        }
-    };
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
 
     string ebnf(unique_defs* defs = nullptr) const {
-        if (tuple_size<tuple_type>::value == 1) {
-            return format_name(get<0>(ps), rank, defs);
-        } else {
-            return fold_tuple(sequence_ebnf(rank, defs), string(), ps);
-        }
+        return p.ebnf(defs);
     }
 };
 
-template <typename F, typename... PS>
-constexpr fmap_sequence<F, PS...> const all(F const& f, PS const&... ps) {
-    return fmap_sequence<F, PS...>(f, ps...);
+template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type>
+constexpr recogniser_span<P> as_span(P const& p) {
+    return recogniser_span<P>(p);
 }
 
 //============================================================================
-// Combinators For Both Parsers and Recognisers: ||, &&, many 
+// Numeric Recognisers: accept_int, accept_real
+//
+// Convert numbers as they are recognised, so that the result is the numeric
+// value rather than a string that has to be scanned again. Numbers that do
+// not fit the result type are reported as a parse_error at their position.
 
 //----------------------------------------------------------------------------
-// Run the second parser only if the first fails.
+// Digit accumulation. On contiguous input digits are converted eight at a
+// time using SWAR (SIMD within a register) arithmetic.
 
-template <typename Parser1, typename Parser2> class combinator_choice { 
-    Parser1 const p1;
-    Parser2 const p2;
+struct digits {
+    static constexpr bool is_digit(int const c) {
+        return c >= '0' && c <= '9';
+    }
 
-public:
-    using is_parser_type = true_type;
-    using is_handle_type = false_type;
-    using has_side_effects =
-        integral_constant<bool, Parser1::has_side_effects::value || Parser2::has_side_effects::value>;
-    using result_type = typename least_general<Parser1, Parser2>::result_type;
-    int const rank = 1;
+    static uint64_t power(int const n) {
+        static uint64_t const p[] {1, 10, 100, 1000, 10000, 100000, 1000000,
+            10000000, 100000000};
+        return p[n];
+    }
 
-    constexpr combinator_choice(Parser1 const& p1, Parser2 const& p2) : p1(p1), p2(p2) {}
+    // accumulate the next digit, returns false on overflow.
+    static bool accumulate(uint64_t& acc, uint64_t const scale, uint64_t const d) {
+        return !__builtin_mul_overflow(acc, scale, &acc)
+            && !__builtin_add_overflow(acc, d, &acc);
+    }
 
-    template <typename Iterator, typename Range, typename Inherit = default_inherited>
-    bool operator() (
-        Iterator &i,
-        Range const &r,
-        result_type *result = nullptr,
-        Inherit* st = nullptr
-    ) const {
-        Iterator const first = i;
-        if (p1(i, r, result, st)) {
-            return true;
-        }
-        if (first != i) {
-            throw parse_error("failed parser consumed input", p1, first, i, r);
+    template <typename Iterator, typename Range>
+    static int read(Iterator &i, Range const &r, uint64_t& acc, bool& overflow, false_type) {
+        int n = 0;
+        for (; i != r.last && is_digit(*i); ++i, ++n) {
+            overflow |= !accumulate(acc, 10, *i - '0');
         }
-        if (p2(i, r, result, st)) {
-            return true;
+        return n;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    template <typename Iterator, typename Range>
+    static int read(Iterator &i, Range const &r, uint64_t& acc, bool& overflow, true_type) {
+        int n = 0;
+        while (r.last - i >= 8) {
+            uint64_t x;
+            memcpy(&x, i, 8);
+            x ^= 0x3030303030303030;
+            // the top bit of each byte that is not a digit.
+            uint64_t const t = (((x & 0x7f7f7f7f7f7f7f7f) + 0x7676767676767676) | x)
+                & 0x8080808080808080;
+            int const m = (t == 0) ? 8 : (__builtin_ctzll(t) >> 3);
+            if (m == 0) {
+                return n;
+            }
+            x <<= 8 * (8 - m);
+            x = ((x & 0x0f0f0f0f0f0f0f0f) * 2561) >> 8;
+            x = ((x & 0x00ff00ff00ff00ff) * 6553601) >> 16;
+            x = ((x & 0x0000ffff0000ffff) * 42949672960001) >> 32;
+            if (acc == 0) {
+                acc = x;
+            } else {
+                overflow |= !accumulate(acc, power(m), x);
+            }
+            i += m;
+            n += m;
+            if (m < 8) {
+                return n;
+            }
         }
-        return false;
+        return n + read(i, r, acc, overflow, false_type());
     }
+#else
+    template <typename Iterator, typename Range>
+    static int read(Iterator &i, Range const &r, uint64_t& acc, bool& overflow, true_type) {
+        return read(i, r, acc, overflow, false_type());
+    }
+#endif
 
-    string ebnf(unique_defs* defs = nullptr) const {
-        return format_name(p1, rank, defs) + " | " + format_name(p2, rank, defs);
+    // Is the symbol after the next one a digit (without moving i).
+    template <typename Iterator, typename Range>
+    static bool digit_after(Iterator const& i, Range const &r) {
+        Iterator j = i;
+        return ++j != r.last && is_digit(*j);
     }
 };
 
-template <typename P1, typename P2,
-    typename = typename enable_if<is_same<typename P1::is_parser_type, true_type>::value
-        || is_same<typename P1::is_handle_type, true_type>::value>::type,
-    typename = typename enable_if<is_same<typename P2::is_parser_type, true_type>::value
-        || is_same<typename P2::is_handle_type, true_type>::value>::type,
-    typename = typename enable_if<is_compatible<typename P1::result_type, typename P2::result_type>::value, pair<typename P1::result_type, typename P2::result_type>>::type>
-constexpr combinator_choice<P1, P2> const operator|| (P1 const& p1, P2 const& p2) {
-    return combinator_choice<P1, P2>(p1, p2);
-}
-
 //----------------------------------------------------------------------------
-// Run the second parser only if the first succeeds. 
+// Integers of any width, signed types accept a leading minus.
 
-template <typename Parser1, typename Parser2> class combinator_sequence {
-    Parser1 const p1;
-    Parser2 const p2;
+template <typename T> class recogniser_int {
+    static_assert(is_integral<T>::value && sizeof(T) <= sizeof(uint64_t),
+        "recogniser_int requires an integer type of at most 64 bits");
 
 public:
     using is_parser_type = true_type;
     using is_handle_type = false_type;
-    using has_side_effects =
-        integral_constant<bool, Parser1::has_side_effects::value || Parser2::has_side_effects::value>;
-    using result_type = typename least_general<Parser1, Parser2>::result_type;
+    using has_side_effects = false_type;
+    using result_type = T;
     int const rank = 0;
 
-    constexpr combinator_sequence(Parser1 const& p1, Parser2 const& p2) : p1(p1), p2(p2) {}
+    constexpr recogniser_int() {}
 
     template <typename Iterator, typename Range, typename Inherit = default_inherited>
     bool operator() (
         Iterator &i,
         Range const &r,
-        result_type *result = nullptr,
+        T *result = nullptr,
         Inherit* st = nullptr
     ) const {
-        return p1(i, r, result, st) && p2(i, r, result, st);
+        Iterator const first = i;
+        bool neg = false;
+        if (is_signed<T>::value && i != r.last && *i == '-') {
+            if (!digits::digit_after(i, r)) {
+                note_failure(*this, first, r);
+                return false;
+            }
+            neg = true;
+            ++i;
+        }
+        uint64_t mag = 0;
+        bool overflow = false;
+        if (digits::read(i, r, mag, overflow, is_contiguous<Iterator>()) == 0) {
+            note_failure(*this, first, r);
+            return false;
+        }
+        uint64_t const max = static_cast<uint64_t>(numeric_limits<T>::max()) + (neg ? 1 : 0);
+        if (overflow || mag > max) {
+            return raise_error("integer overflow", *this, first, i, r);
+        }
+        if (result != nullptr) {
+            *result = static_cast<T>(neg ? (0 - mag) : mag);
+        }
+        return true;
+    }
+
+    constexpr first_set first() const {
+        return first_set(is_signed<T>::value ? char_class(is_digit || is_char('-'))
+            : char_class(is_digit), false);
     }
 
     string ebnf(unique_defs* defs = nullptr) const {
-        return format_name(p1, rank, defs) + ", " + format_name(p2, rank, defs);
+        string const n = is_signed<T>::value ? "integer" : "natural";
+        if (defs != nullptr) {
+            defs->emplace(n, is_signed<T>::value ? "[\"-\"], {digit}-" : "{digit}-");
+        }
+        return n;
     }
 };
 
-template <typename P1, typename P2,
-    typename = typename enable_if<is_same<typename P1::is_parser_type, true_type>::value
-        || is_same<typename P1::is_handle_type, true_type>::value>::type,
-    typename = typename enable_if<is_same<typename P2::is_parser_type, true_type>::value
-        || is_same<typename P2::is_handle_type, true_type>::value>::type,
-    typename = typename enable_if<is_compatible<typename P1::result_type, typename P2::result_type>::value>::type>
-constexpr combinator_sequence<P1, P2> operator&& (P1 const& p1, P2 const& p2) {
-    return combinator_sequence<P1, P2>(p1, p2);
+template <typename T>
+constexpr recogniser_int<T> accept_int() {
+    return recogniser_int<T>();
 }
 
 //----------------------------------------------------------------------------
-// Accept the parser zero or more times.
+// Floating point numbers. Mantissas and exponents small enough to be exact
+// use Clinger's fast path, a single correctly rounded multiply or divide.
+// Anything else is converted by the standard library, in the classic locale.
+
+template <typename T> class recogniser_real {
+    static_assert(is_same<T, double>::value || is_same<T, float>::value,
+        "recogniser_real requires float or double");
+
+    // largest power of ten that is exact in T, and the exact mantissa limit.
+    static constexpr int max_exact = is_same<T, double>::value ? 22 : 10;
+    static constexpr uint64_t max_mantissa = uint64_t(1) << numeric_limits<T>::digits;
+
+    static T power(int const n) {
+        static T const p[] {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+            T(1e11), T(1e12), T(1e13), T(1e14), T(1e15), T(1e16), T(1e17), T(1e18),
+            T(1e19), T(1e20), T(1e21), T(1e22)};
+        return p[n];
+    }
 
-template <typename Parser> class combinator_many {
-    Parser const p;
+    // in the classic locale, as strtod depends on LC_NUMERIC. Overflow fails,
+    // underflow rounds towards zero.
+    template <typename Iterator>
+    static bool slow_path(Iterator first, Iterator const& last, T& result) {
+        string s;
+        for (; first != last; ++first) {
+            s.push_back(*first);
+        }
+        istringstream in(s);
+        in.imbue(locale::classic());
+        in >> result;
+        return !in.fail();
+    }
 
 public:
     using is_parser_type = true_type;
     using is_handle_type = false_type;
-    using has_side_effects = typename Parser::has_side_effects;
-    using result_type = typename Parser::result_type;
+    using has_side_effects = false_type;
+    using result_type = T;
     int const rank = 0;
 
-    constexpr explicit combinator_many(Parser const& p) : p(p) {}
+    constexpr recogniser_real() {}
 
     template <typename Iterator, typename Range, typename Inherit = default_inherited>
     bool operator() (
         Iterator &i,
         Range const &r,
-        result_type *result = nullptr,
+        T *result = nullptr,
         Inherit* st = nullptr
     ) const {
+        using contiguous = is_contiguous<Iterator>;
+        Iterator const first = i;
+        bool neg = false;
+        if (i != r.last && *i == '-') {
+            if (!digits::digit_after(i, r)) {
+                note_failure(*this, first, r);
+                return false;
+            }
+            neg = true;
+            ++i;
+        }
+        uint64_t mantissa = 0;
+        bool inexact = false;
+        if (digits::read(i, r, mantissa, inexact, contiguous()) == 0) {
+            note_failure(*this, first, r);
+            return false;
+        }
+        int exponent = 0;
+        if (i != r.last && *i == '.' && digits::digit_after(i, r)) {
+            ++i;
+            exponent = -digits::read(i, r, mantissa, inexact, contiguous());
+        }
+        if (i != r.last && (*i == 'e' || *i == 'E')) {
+            Iterator j = i;
+            ++j;
+            bool eneg = false;
+            if (j != r.last && (*j == '-' || *j == '+')) {
+                eneg = (*j == '-');
+                ++j;
+            }
+            if (j != r.last && digits::is_digit(*j)) {
+                i = j;
+                uint64_t e = 0;
+                bool big = false;
+                digits::read(i, r, e, big, contiguous());
+                inexact |= big || e > 100000;
+                exponent += eneg ? -static_cast<int>(e) : static_cast<int>(e);
+            }
+        }
+        T x;
+        if (!inexact && mantissa <= max_mantissa
+            && exponent >= -max_exact && exponent <= max_exact) {
+            x = static_cast<T>(mantissa);
+            x = (exponent < 0) ? x / power(-exponent) : x * power(exponent);
+            x = neg ? -x : x;
+        } else if (!slow_path(first, i, x)) {
+            return raise_error("real overflow", *this, first, i, r);
+        }
+        if (result != nullptr) {
+            *result = x;
+        }
+        return true;
+    }
+
+    constexpr first_set first() const {
+        return first_set(char_class(is_digit || is_char('-')), false);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        if (defs != nullptr) {
+            defs->emplace("real", "[\"-\"], {digit}-, [\".\", {digit}-], "
+                "[(\"e\" | \"E\"), [\"+\" | \"-\"], {digit}-]");
+        }
+        return "real";
+    }
+};
+
+template <typename T = double>
+constexpr recogniser_real<T> accept_real() {
+    return recogniser_real<T>();
+}
+
+//============================================================================
+// Backtracking Results
+//
+// Results that parsers append to (strings, vectors and spans) are truncated
+// back to a mark when a parser that has partly built them fails, so that
+// backtracking leaves no partial output behind. Specialise rollback_traits
+// for other result types that accumulate. The default does nothing, which is
+// right for results that are assigned rather than appended to.
+
+template <typename T> struct rollback_traits {
+    using mark_type = size_t;
+
+    static mark_type mark(T const&) {
+        return 0;
+    }
+
+    static void rollback(T&, mark_type) {}
+};
+
+template <> struct rollback_traits<void> {
+    using mark_type = size_t;
+};
+
+template <typename C, typename Traits, typename Alloc>
+struct rollback_traits<basic_string<C, Traits, Alloc>> {
+    using mark_type = size_t;
+
+    static mark_type mark(basic_string<C, Traits, Alloc> const& s) {
+        return s.size();
+    }
+
+    static void rollback(basic_string<C, Traits, Alloc>& s, mark_type const m) {
+        s.resize(m);
+    }
+};
+
+template <typename T, typename Alloc> struct rollback_traits<vector<T, Alloc>> {
+    using mark_type = size_t;
+
+    static mark_type mark(vector<T, Alloc> const& v) {
+        return v.size();
+    }
+
+    static void rollback(vector<T, Alloc>& v, mark_type const m) {
+        v.erase(v.begin() + m, v.end());
+    }
+};
+
+template <> struct rollback_traits<char_span> {
+    using mark_type = size_t;
+
+    static mark_type mark(char_span const& s) {
+        return s.size();
+    }
+
+    static void rollback(char_span& s, mark_type const m) {
+        s.truncate(m);
+    }
+};
+
+template <typename T>
+typename rollback_traits<T>::mark_type result_mark(T const* result) {
+    return (result != nullptr) ? rollback_traits<T>::mark(*result)
+        : typename rollback_traits<T>::mark_type {};
+}
+
+template <typename T>
+void result_rollback(T* result, typename rollback_traits<T>::mark_type const& m) {
+    if (result != nullptr) {
+        rollback_traits<T>::rollback(*result, m);
+    }
+}
+
+inline size_t result_mark(void const*) {
+    return 0;
+}
+
+inline void result_rollback(void*, size_t) {}
+
+//============================================================================
+// Constant Parsers: succ, fail
+
+//----------------------------------------------------------------------------
+// Always succeeds.
+
+struct parser_succ {
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = false_type;
+    using result_type = void;
+    int const rank = 0;
+
+    constexpr parser_succ() {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        void *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return true;
+    }
+
+    constexpr first_set first() const {
+        return first_set::empty();
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return "succ";
+    }
+} constexpr succ;
+
+//----------------------------------------------------------------------------
+// Always fails.
+
+struct parser_fail {
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = false_type;
+    using result_type = void;
+    int const rank = 0;
+
+    constexpr parser_fail() {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        void *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return false;
+    }
+
+    constexpr first_set first() const {
+        return first_set::none();
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return "fail";
+    }
+} constexpr fail;
+
+//============================================================================
+// Lifting String Recognisers to Parsers, and Parsers up one level: any, all
+
+//----------------------------------------------------------------------------
+// as soon as one parser succeeds, pass result to user supplied functor
+
+template <typename Functor, typename Inherit, typename = void> class call_any {}; 
+
+template <typename Functor, typename Inherit>
+class call_any<Functor, Inherit, typename enable_if<is_same<Inherit, default_inherited>::value>::type> {
+    Functor const f;
+
+public: 
+    explicit call_any(Functor const& f) : f(f) {}
+    
+    template <typename Result, typename Rs, size_t... I>
+    void any(Result* r, int j, Rs& rs, Inherit* st, size_t...) {
+        f(r, j, get<I>(rs)...);
+    }
+};
+
+template <typename Functor, typename Inherit>
+class call_any<Functor, Inherit, typename enable_if<!is_same<Inherit, default_inherited>::value>::type> {
+    Functor const f;
+
+public: 
+    explicit call_any(Functor const& f) : f(f) {}
+    
+    template <typename Result, typename Rs, size_t... I>
+    void any(Result* r, int j, Rs& rs, Inherit* st, size_t...) {
+        f(r, j, get<I>(rs)..., st);
+    }
+};
+
+template <typename Functor, typename... Parsers> class fmap_choice {
+    friend struct grammar_rewrite;
+
+    using functor_traits = function_traits<Functor>;
+    using tuple_type = tuple<Parsers...>;
+    using tmp_type = tuple<typename Parsers::result_type...>;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = true_type;
+    using result_type = typename remove_pointer<typename functor_traits::template argument<0>::type>::type;
+
+private:
+    tuple_type const ps;
+    Functor const f;
+    choice_table<sizeof...(Parsers)> const table;
+
+    // try the parsers from..to in order.
+    template <typename Iterator, typename Range, typename Inherit, typename Rs, size_t I0, size_t... Is> 
+    int any_parsers(size_t const from, size_t const to, Iterator &i, Range const &r, Inherit* st, Rs &rs, size_t, size_t...) const {
+        if (I0 >= from && get<I0>(ps)(i, r, &get<I0>(rs), st)) {
+            return I0;
+        }
+        if (I0 >= to || in_error(r)) {
+            return -1;
+        }
+        return any_parsers<Iterator, Range, Inherit, Rs, Is...>(from, to, i, r, st, rs, Is...);
+    }
+
+    template <typename Iterator, typename Range, typename Inherit, typename Rs, size_t I0>
+    int any_parsers(size_t const from, size_t const to, Iterator &i, Range const &r, Inherit* st, Rs &rs, size_t) const {
+        if (get<I0>(ps)(i, r, &get<I0>(rs), st)) {
+            return I0;
+        }
+        return -1;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit, size_t... I> bool fmap_any(
+        Iterator &i,
+        Range const &r,
+        size_sequence<I...> seq,
+        result_type *result,
+        Inherit* st
+    ) const {
+        using table_type = choice_table<sizeof...(Parsers)>;
+        uint8_t const k = table(i, r);
+        if (k == table_type::none) {
+            note_failure(*this, i, r);
+            return false;
+        }
+        size_t const from = k & ~table_type::trial;
+        size_t const to = (k & table_type::trial) ? sizeof...(Parsers) - 1 : from;
+        tmp_type tmp {};
+        Iterator const first = i;
+        int const j = any_parsers<Iterator, Range, Inherit, tmp_type, I...>(from, to, i, r, st, tmp, I...);
+        if (j >= 0) {
+            if (result != nullptr) {
+                call_any<Functor, Inherit> call_f(f);
+                try {
+                    call_f.template any<result_type, tmp_type, I...>(result, j, tmp, st, I...);
+                } catch (runtime_error &e) {
+                    return raise_error(e.what(), *this, first, i, r);
+                }
+            }
+            return true;
+        }
+        return false;
+    }
+
+    template <size_t I0, size_t... Is>
+    constexpr first_set first_of(size_sequence<I0, Is...>) const {
+        return first_set_of(get<I0>(ps)) | first_of(size_sequence<Is...>());
+    }
+
+    constexpr first_set first_of(size_sequence<>) const {
+        return first_set::none();
+    }
+
+public:
+    int const rank = 1;
+
+    explicit fmap_choice(Functor const& f, Parsers const&... ps)
+        : ps(ps...), f(f), table(first_sets<sizeof...(Parsers)> {{first_set_of(ps)...}}) {}
+
+    template <typename Iterator, typename Range, typename Inherit>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return fmap_any(i, r, range<0, sizeof...(Parsers)>(), result, st);
+    }
+
+    class choice_ebnf {
+        int const rank;
+        unique_defs* defs;
+
+    public:
+        choice_ebnf(int r, unique_defs* d) : rank(r), defs(d) {}
+        template <typename P>
+        string operator() (string const& s, P&& p) const {
+            if (s.length() == 0) {
+                return format_name(p, rank, defs);
+            }
+            return s + " | "  + format_name(p, rank, defs);
+        }
+    };
+
+    constexpr first_set first() const {
+        return first_of(range<0, sizeof...(Parsers)>());
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return fold_tuple(choice_ebnf(rank, defs), string(), ps);
+    }
+};
+
+template <typename F, typename... PS>
+constexpr fmap_choice<F, PS...> const any(F const& f, PS const&... ps) {
+    return fmap_choice<F, PS...>(f, ps...);
+}
+
+//----------------------------------------------------------------------------
+// If all parsers succeed, pass all results as arguments to user supplied functor
+
+template <typename Functor, typename Inherit, typename = void> class call_all {}; 
+
+template <typename Functor, typename Inherit>
+class call_all<Functor, Inherit, typename enable_if<is_same<Inherit, default_inherited>::value>::type> {
+    Functor const f;
+
+public: 
+    explicit call_all(Functor const& f) : f(f) {}
+    
+    template <typename Result, typename Rs, size_t... I>
+    void all(Result* r, Rs& rs, Inherit* st, size_t...) {
+        f(r, get<I>(rs)...);
+    }
+};
+
+template <typename Functor, typename Inherit>
+class call_all<Functor, Inherit, typename enable_if<!is_same<Inherit, default_inherited>::value>::type> {
+    Functor const f;
+
+public: 
+    explicit call_all(Functor const& f) : f(f) {}
+    
+    template <typename Result, typename Rs, size_t... I>
+    void all(Result* r, Rs& rs, Inherit* st, size_t...) {
+        f(r, get<I>(rs)..., st);
+    }
+};
+
+template <typename Functor, typename... Parsers> class fmap_sequence {
+    friend struct grammar_rewrite;
+
+    using functor_traits = function_traits<Functor>;
+    using tuple_type = tuple<Parsers...>;
+    using tmp_type = tuple<typename Parsers::result_type...>;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = true_type;
+    using result_type = typename remove_pointer<typename functor_traits::template argument<0>::type>::type;
+
+private:
+    tuple_type const ps;
+    Functor const f;
+
+    template <typename Iterator, typename Range, typename Inherit, typename Rs, size_t I0, size_t... Is> 
+    bool all_parsers(Iterator &i, Range const &r, Inherit* st, Rs &rs, size_t, size_t...) const {
+        if (get<I0>(ps)(i, r, &get<I0>(rs), st)) {
+            return all_parsers<Iterator, Range, Inherit, Rs, Is...>(i, r, st, rs, Is...);
+        }
+        return false;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit, typename Rs, size_t I0>
+    bool all_parsers(Iterator &i, Range const &r, Inherit* st, Rs &rs, size_t) const {
+        return get<I0>(ps)(i, r, &get<I0>(rs), st);
+    }
+
+    template <typename Iterator, typename Range, typename Inherit, size_t... I>
+    bool fmap_all(Iterator &i, Range const &r, size_sequence<I...> seq, result_type *result, Inherit* st) const {
+        tmp_type tmp {};
+        Iterator const first = i;
+        if (all_parsers<Iterator, Range, Inherit, tmp_type, I...>(i, r, st, tmp, I...)) {
+            if (result != nullptr) {
+                call_all<Functor, Inherit> call_f(f);
+                try {
+                    call_f.template all<result_type, tmp_type, I...>(result, tmp, st, I...);
+                } catch (runtime_error &e) {
+                    return raise_error(e.what(), *this, first, i, r);
+                }
+            }
+            return true;
+        }
+        return false;
+    }
+
+    template <size_t I0, size_t... Is>
+    constexpr first_set first_of(size_sequence<I0, Is...>) const {
+        return first_set_of(get<I0>(ps)).then(first_of(size_sequence<Is...>()));
+    }
+
+    constexpr first_set first_of(size_sequence<>) const {
+        return first_set::empty();
+    }
+
+public:
+    int const rank = 0;
+
+    constexpr fmap_sequence(Functor const& f, Parsers const&... ps)
+        : f(f), ps(ps...) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return fmap_all(i, r, range<0, sizeof...(Parsers)>(), result, st);
+    }
+
+    class sequence_ebnf {
+        int const rank;
+        unique_defs* defs;
+
+    public:
+        sequence_ebnf(int r, unique_defs* d) : rank(r), defs(d) {}
+        template <typename P>
+        string operator() (string const &s, P&& p) const {
+            if (s.size() == 0) {
+                return format_name(p, rank, defs);
+            }
+            return s + ", "  + format_name(p, rank, defs);
+        }
+    };
+
+    constexpr first_set first() const {
+        return first_of(range<0, sizeof...(Parsers)>());
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        if (tuple_size<tuple_type>::value == 1) {
+            return format_name(get<0>(ps), rank, defs);
+        } else {
+            return fold_tuple(sequence_ebnf(rank, defs), string(), ps);
+        }
+    }
+};
+
+template <typename F, typename... PS>
+constexpr fmap_sequence<F, PS...> const all(F const& f, PS const&... ps) {
+    return fmap_sequence<F, PS...>(f, ps...);
+}
+
+//============================================================================
+// Combinators For Both Parsers and Recognisers: ||, &&, many 
+
+//----------------------------------------------------------------------------
+// Run the second parser only if the first fails.
+
+template <typename Parser1, typename Parser2> class combinator_choice { 
+    friend struct grammar_rewrite;
+
+    Parser1 const p1;
+    Parser2 const p2;
+    choice_table<2> const table;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects =
+        integral_constant<bool, Parser1::has_side_effects::value || Parser2::has_side_effects::value>;
+    using result_type = typename least_general<Parser1, Parser2>::result_type;
+    int const rank = 1;
+
+    combinator_choice(Parser1 const& p1, Parser2 const& p2)
+        : p1(p1), p2(p2), table(first_sets<2> {{first_set_of(p1), first_set_of(p2)}}) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        uint8_t const k = table(i, r);
+        if (k == 1) {
+            return p2(i, r, result, st);
+        } else if (k == choice_table<2>::none) {
+            note_failure(*this, i, r);
+            return false;
+        }
+        Iterator const first = i;
+        auto const m = result_mark(result);
+        if (p1(i, r, result, st)) {
+            return true;
+        }
+        if (first != i) {
+            return raise_error("failed parser consumed input", p1, first, i, r);
+        }
+        result_rollback(result, m);
+        if (k == 0 || in_error(r)) {
+            return false;
+        }
+        if (p2(i, r, result, st)) {
+            return true;
+        }
+        return false;
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p1) | first_set_of(p2);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return format_name(p1, rank, defs) + " | " + format_name(p2, rank, defs);
+    }
+};
+
+template <typename P1, typename P2,
+    typename = typename enable_if<is_same<typename P1::is_parser_type, true_type>::value
+        || is_same<typename P1::is_handle_type, true_type>::value>::type,
+    typename = typename enable_if<is_same<typename P2::is_parser_type, true_type>::value
+        || is_same<typename P2::is_handle_type, true_type>::value>::type,
+    typename = typename enable_if<is_compatible<typename P1::result_type, typename P2::result_type>::value, pair<typename P1::result_type, typename P2::result_type>>::type>
+constexpr combinator_choice<P1, P2> const operator|| (P1 const& p1, P2 const& p2) {
+    return combinator_choice<P1, P2>(p1, p2);
+}
+
+//----------------------------------------------------------------------------
+// Run the second parser only if the first succeeds. 
+
+template <typename Parser1, typename Parser2> class combinator_sequence {
+    friend struct grammar_rewrite;
+
+    Parser1 const p1;
+    Parser2 const p2;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects =
+        integral_constant<bool, Parser1::has_side_effects::value || Parser2::has_side_effects::value>;
+    using result_type = typename least_general<Parser1, Parser2>::result_type;
+    int const rank = 0;
+
+    constexpr combinator_sequence(Parser1 const& p1, Parser2 const& p2) : p1(p1), p2(p2) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return p1(i, r, result, st) && p2(i, r, result, st);
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p1).then(first_set_of(p2));
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return format_name(p1, rank, defs) + ", " + format_name(p2, rank, defs);
+    }
+};
+
+template <typename P1, typename P2,
+    typename = typename enable_if<is_same<typename P1::is_parser_type, true_type>::value
+        || is_same<typename P1::is_handle_type, true_type>::value>::type,
+    typename = typename enable_if<is_same<typename P2::is_parser_type, true_type>::value
+        || is_same<typename P2::is_handle_type, true_type>::value>::type,
+    typename = typename enable_if<is_compatible<typename P1::result_type, typename P2::result_type>::value>::type>
+constexpr combinator_sequence<P1, P2> operator&& (P1 const& p1, P2 const& p2) {
+    return combinator_sequence<P1, P2>(p1, p2);
+}
+
+//----------------------------------------------------------------------------
+// Accept the parser zero or more times.
+
+template <typename Parser> class combinator_many {
+    friend struct grammar_rewrite;
+
+    Parser const p;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank = 0;
+
+    constexpr explicit combinator_many(Parser const& p) : p(p) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        Iterator first = i;
+        while (p(i, r, result, st)) {
+            first = i;
+        }
+        if (first != i) {
+            return raise_error("failed many-parser consumed input", p, first, i, r);
+        }
+        return !in_error(r);
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p).repeat();
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return "{" + p.ebnf(defs) + "}";
+    }
+};
+
+// Many of a single symbol recogniser does not need to backtrack, and on
+// contiguous input scans for the end of the run and appends it in one go.
+
+template <typename Predicate> class combinator_many<recogniser_accept<Predicate>> {
+    friend struct grammar_rewrite;
+
+    using Parser = recogniser_accept<Predicate>;
+    Parser const p;
+    span_scanner const scan;
+
+    template <typename Iterator, typename Range>
+    bool many_symbols(Iterator &i, Range const &r, string *result, true_type) const {
+        Iterator const first = i;
+        i = scan(i, r.last);
+        if (result != nullptr) {
+            result->append(first, i - first);
+        }
+        return true;
+    }
+
+    template <typename Iterator, typename Range>
+    bool many_symbols(Iterator &i, Range const &r, string *result, false_type) const {
+        while (p(i, r, result)) {}
+        return true;
+    }
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank = 0;
+
+    constexpr explicit combinator_many(Parser const& p) : p(p), scan(p.symbols()) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return many_symbols(i, r, result, is_contiguous<Iterator>());
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p).repeat();
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return "{" + p.ebnf(defs) + "}";
+    }
+};
+
+template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type>
+constexpr combinator_many<P> const many(P const& p) {
+    return combinator_many<P>(p);
+}
+
+//----------------------------------------------------------------------------
+// Exception parser
+
+template <typename Parser> class combinator_except {
+    friend struct grammar_rewrite;
+
+    Parser const p;
+    char const* x;
+
+    // string results are parsed straight into the caller's result, and the
+    // new part compared, rather than into a temporary.
+    template <typename Iterator, typename Range, typename Inherit> 
+    bool except(Iterator &i, Range const &r, string *result, Inherit* st, true_type) const {
+        string tmp;
+        string* const out = (result != nullptr) ? result : &tmp;
+        size_t const m = out->size();
+        if (p(i, r, out, st) && out->compare(m, string::npos, x) != 0) {
+            return true;
+        }
+        out->resize(m);
+        return false;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit> 
+    bool except(Iterator &i, Range const &r, typename Parser::result_type *result, Inherit* st, false_type) const {
+        typename Parser::result_type tmp;
+        if (p(i, r, &tmp, st)) {
+            if (x != tmp) {
+                if (result != nullptr) {
+                    *result = tmp;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank = 0;
+
+    constexpr combinator_except(char const* x, Parser const& p) : p(p), x(x) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited> 
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return except(i, r, result, st, is_same<result_type, string>());
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return p.ebnf(defs) + " - \"" + x + "\"";
+    }
+};
+
+template <typename P, typename = typename enable_if<
+    is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value
+    >::type>
+constexpr combinator_except<P> const operator- (P const& p, char const* x) {
+    return combinator_except<P>(x, p);
+}
+
+//============================================================================
+// Memo Contexts
+//
+// The tables of memo parsers (see Memoization below) belong to a parse, not
+// to the rule: a memo_context made around a top level parse holds the tables
+// of the memo parsers called on its thread while it exists, and they go with
+// it, so the next parse starts empty. With no context a memo parser makes one
+// for the duration of its own call, which is always safe, but only shares
+// results between calls nested inside it. Threads never share a context, and
+// each thread of a parallel_many has its own. A memo parser finds its table
+// by hashing its state, so a call costs the same however many rules are
+// memoized.
+
+struct memo_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+class memo_context {
+public:
+    struct table_base {
+        virtual ~table_base() {}
+    };
+
+private:
+    struct slot {
+        void const* range;
+        void const* type;
+        unique_ptr<table_base> table;
+    };
+
+    // by memo parser, then range and iterator type (usually just one).
+    unordered_map<void const*, vector<slot>> tables;
+    memo_context* const outer;
+
+    static memo_context*& top() {
+        static thread_local memo_context* c = nullptr;
+        return c;
+    }
+
+public:
+    memo_context() : outer(top()) {
+        top() = this;
+    }
+
+    ~memo_context() {
+        top() = outer;
+    }
+
+    memo_context(memo_context const&) = delete;
+    memo_context& operator= (memo_context const&) = delete;
+
+    // the innermost context on this thread, if any.
+    static memo_context* current() {
+        return top();
+    }
+
+    // the table of a memo parser for a range, made on first use.
+    template <typename Table, typename Make>
+    Table& table(void const* owner, void const* range, void const* type, Make const& make) {
+        vector<slot>& ts = tables[owner];
+        for (slot const& t : ts) {
+            if (t.range == range && t.type == type) {
+                return static_cast<Table&>(*t.table);
+            }
+        }
+        ts.push_back(slot {range, type, unique_ptr<table_base>(make())});
+        return static_cast<Table&>(*ts.back().table);
+    }
+
+    // forget the tables of a memo parser.
+    void drop(void const* owner) {
+        tables.erase(owner);
+    }
+};
+
+//============================================================================
+// Parallel Parsing
+//
+// parallel_many(p, sync) accepts p zero or more times, like many, but on
+// contiguous input it splits what is left into chunks that start just after
+// a sync symbol (such as a newline), and parses the chunks on a pool of
+// threads. Threads take the next chunk from a shared counter, so a thread
+// that finishes early takes over work that is still waiting. Each chunk has
+// its own result, and the results are merged in input order. A chunk's start
+// is only a guess at a record boundary: the merge checks it against where the
+// previous chunk's last record ended, and parses the chunk again from there
+// if a record straddled the boundary, so the outcome (including which error
+// is reported) is the same as parsing in order. Every chunk is parsed over
+// the whole range, so records may hold handles for that range, and errors
+// report their global line and column. Parsers with inherited attributes,
+// input that is not contiguous and error channels are parsed in order, as by
+// many. Functors run concurrently, on results that are not shared.
+
+// Merge a chunk's result into the result so far. Accumulating results are
+// appended, results that are assigned keep the last.
+template <typename T> struct merge_traits {
+    static void merge(T& into, T&& from) {
+        into = move(from);
+    }
+};
+
+template <typename C, typename Traits, typename Alloc>
+struct merge_traits<basic_string<C, Traits, Alloc>> {
+    static void merge(basic_string<C, Traits, Alloc>& into, basic_string<C, Traits, Alloc>&& from) {
+        into.append(from);
+    }
+};
+
+template <typename T, typename Alloc> struct merge_traits<vector<T, Alloc>> {
+    static void merge(vector<T, Alloc>& into, vector<T, Alloc>&& from) {
+        into.insert(into.end(), make_move_iterator(from.begin()), make_move_iterator(from.end()));
+    }
+};
+
+template <> struct merge_traits<char_span> {
+    static void merge(char_span& into, char_span&& from) {
+        into.append(from.begin(), from.end(), true_type());
+    }
+};
+
+template <typename Range> struct is_error_channel : false_type {};
+template <typename Range> struct is_error_channel<error_channel<Range>> : true_type {};
+
+// A range's line index is built the first time an error needs it, which is
+// not thread safe, so it is built before parsing in parallel.
+template <typename Range>
+void prepare_lines(Range const& r, true_type /*has_line_index*/) {
+    r.lines();
+}
+
+template <typename Range>
+void prepare_lines(Range const& r, false_type /*has_line_index*/) {}
+
+template <typename Range>
+void prepare_lines(Range const& r) {
+    prepare_lines(r, has_line_index<Range>());
+}
+
+template <typename Parser> class combinator_parallel_many {
+    Parser const p;
+    char_class const sync;
+    unsigned const threads;
+    size_t const grain;
+
+    using Result = typename Parser::result_type;
+
+    template <typename T, typename = void> struct holder {
+        T value;
+        T* get() {
+            return &value;
+        }
+    };
+
+    template <typename T> struct holder<T, typename enable_if<is_void<T>::value>::type> {
+        void* get() {
+            return nullptr;
+        }
+    };
+
+    template <typename T> static void merge(T* into, holder<T>& from) {
+        merge_traits<T>::merge(*into, move(from.value));
+    }
+
+    static void merge(void*, holder<void>&) {}
+
+    template <typename Iterator> struct chunk {
+        Iterator start;
+        Iterator stop;
+        Iterator end;
+        size_t records;
+        bool stopped;
+        exception_ptr error;
+        holder<Result> result;
+    };
+
+    // records that start before the chunk's stop are its own.
+    template <typename Iterator, typename Range, typename Inherit>
+    void parse_chunk(chunk<Iterator>& c, Range const& r, Result* result, Inherit* st) const {
+        Iterator i = c.start;
+        c.records = 0;
+        c.stopped = false;
+        c.error = nullptr;
+        try {
+            while (i < c.stop) {
+                Iterator const first = i;
+                if (!p(i, r, result, st)) {
+                    if (i != first) {
+                        raise_error("failed many-parser consumed input", p, first, i, r);
+                    }
+                    c.stopped = true;
+                    break;
+                }
+                ++c.records;
+                if (i == first) {
+                    c.stopped = true;
+                    break;
+                }
+            }
+        } catch (...) {
+            c.error = current_exception();
+        }
+        c.end = i;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit>
+    bool parse(Iterator &i, Range const &r, Result *result, Inherit* st, false_type) const {
         Iterator first = i;
         while (p(i, r, result, st)) {
             first = i;
         }
-        if (first != i) {
-            throw parse_error("failed many-parser consumed input", p, first, i, r);
+        if (first != i) {
+            return raise_error("failed many-parser consumed input", p, first, i, r);
+        }
+        return !in_error(r);
+    }
+
+    template <typename Iterator, typename Range, typename Inherit>
+    bool parse(Iterator &i, Range const &r, Result *result, Inherit* st, true_type) const {
+        unsigned const n = (threads != 0) ? threads : max(thread::hardware_concurrency(), 1u);
+        size_t const size = r.last - i;
+        size_t const count = min(size / grain, static_cast<size_t>(n) * 4);
+        if (n < 2 || count < 2) {
+            return parse(i, r, result, st, false_type());
+        }
+
+        // chunks start after the first sync symbol at or after each split.
+        vector<chunk<Iterator>> chunks;
+        chunks.reserve(count);
+        Iterator start = i;
+        for (size_t k = 1; k <= count; ++k) {
+            Iterator stop = r.last;
+            if (k < count) {
+                stop = max(i + (size * k) / count, start);
+                while (stop != r.last && !sync.test(*stop)) {
+                    ++stop;
+                }
+                if (stop != r.last) {
+                    ++stop;
+                }
+            }
+            if (stop != start) {
+                chunks.push_back(chunk<Iterator> {start, stop, start, 0, false, nullptr, {}});
+                start = stop;
+            }
+        }
+
+        prepare_lines(r);
+        atomic<size_t> next(0);
+        auto const work = [&]() {
+            memo_context memos;
+            for (size_t k; (k = next++) < chunks.size();) {
+                parse_chunk(chunks[k], r, (k == 0 || result == nullptr) ? result
+                    : chunks[k].result.get(), st);
+            }
+        };
+        vector<thread> pool;
+        for (unsigned t = 1; t < n && t < chunks.size(); ++t) {
+            pool.emplace_back(work);
+        }
+        work();
+        for (thread& t : pool) {
+            t.join();
+        }
+
+        Iterator end = i;
+        for (size_t k = 0; k < chunks.size(); ++k) {
+            chunk<Iterator>& c = chunks[k];
+            if (k > 0 && end != c.start) {
+                // a record straddled the start of the chunk.
+                c.start = end;
+                c.result = holder<Result>();
+                parse_chunk(c, r, (result == nullptr) ? result : c.result.get(), st);
+            }
+            if (c.error != nullptr) {
+                i = c.end;
+                rethrow_exception(c.error);
+            }
+            if (k > 0 && c.records > 0 && result != nullptr) {
+                merge(result, c.result);
+            }
+            end = c.end;
+            if (c.stopped) {
+                break;
+            }
+        }
+        i = end;
+        return true;
+    }
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank = 0;
+
+    constexpr combinator_parallel_many(Parser const& p, char_class const& s, unsigned const t,
+        size_t const g) : p(p), sync(s), threads(t), grain(g) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return parse(i, r, result, st, integral_constant<bool, is_contiguous<Iterator>::value
+            && is_same<Inherit, default_inherited>::value && !is_error_channel<Range>::value>());
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p).repeat();
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return "{" + p.ebnf(defs) + "}";
+    }
+};
+
+// 'threads' defaults to the number of hardware threads, chunks are at least
+// 'grain' symbols long.
+template <typename P, typename S, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type, typename = typename S::is_predicate_type>
+constexpr combinator_parallel_many<P> parallel_many(P const& p, S const& sync,
+    unsigned const threads = 0, size_t const grain = 1 << 16) {
+    return combinator_parallel_many<P>(p, char_class(sync), threads, grain);
+}
+
+//============================================================================
+// Deep Recursion
+//
+// Each level of nesting in a recursive grammar costs several native stack
+// frames, so deeply nested input can overflow the thread's stack. deep(p)
+// (see "parser_deep.hpp", as it needs ucontext and mmap) runs p on a separate
+// stack allocated from the heap, large enough for deep nesting (the pages are
+// only committed as they are used), and limits how deeply recursion through
+// handles, references and rules may nest. Going deeper is a parse error,
+// reported like any other. Outside of a deep parser recursion is not counted.
+
+class recursion_depth {
+    size_t depth;
+    size_t const limit;
+
+public:
+    explicit recursion_depth(size_t const limit) : depth(0), limit(limit) {}
+
+    // the depth counter for this thread, if it is in a deep parser.
+    static recursion_depth*& current() {
+        static thread_local recursion_depth* d = nullptr;
+        return d;
+    }
+
+    friend class recursion_guard;
+};
+
+class recursion_guard {
+    recursion_depth* const d;
+
+public:
+    recursion_guard() : d(recursion_depth::current()) {
+        if (d != nullptr) {
+            ++(d->depth);
+        }
+    }
+
+    ~recursion_guard() {
+        if (d != nullptr) {
+            --(d->depth);
+        }
+    }
+
+    recursion_guard(recursion_guard const&) = delete;
+    recursion_guard& operator= (recursion_guard const&) = delete;
+
+    bool too_deep() const {
+        return d != nullptr && d->depth > d->limit;
+    }
+};
+
+//============================================================================
+// Run-time polymorphism
+
+//----------------------------------------------------------------------------
+// Handle: holds a runtime-polymorphic parser. It is mutable so that it can be
+// defined before the parser is assigned.
+
+template <typename Iterator, typename Range, typename Synthesize = void, typename Inherit = default_inherited>
+class parser_handle {
+
+    struct holder_base {
+        virtual ~holder_base() {}
+
+        virtual bool parse(
+            Iterator& i,
+            Range const &r,
+            Synthesize* result = nullptr,
+            Inherit* st = nullptr
+        ) const = 0;
+
+        virtual bool parse(
+            Iterator& i,
+            error_channel<Range> const &r,
+            Synthesize* result = nullptr,
+            Inherit* st = nullptr
+        ) const = 0;
+
+        virtual first_set first() const = 0;
+
+        virtual string ebnf(unique_defs* defs = nullptr) const = 0;
+    }; 
+
+    template <typename Parser>
+    class holder_poly : public holder_base {
+        Parser const p;
+
+    public:
+        explicit holder_poly(Parser const &q) : p(q) {}
+        explicit holder_poly(Parser &&q) : p(forward<Parser>(q)) {}
+
+        virtual bool parse(
+            Iterator &i,
+            Range const &r,
+            Synthesize* result = nullptr,
+            Inherit* st = nullptr
+        ) const override {
+            return p(i, r, result, st);
+        }
+
+        virtual bool parse(
+            Iterator &i,
+            error_channel<Range> const &r,
+            Synthesize* result = nullptr,
+            Inherit* st = nullptr
+        ) const override {
+            return p(i, r, result, st);
+        }
+
+        virtual first_set first() const override {
+            return first_set_of(p);
+        }
+
+        virtual string ebnf(unique_defs* defs = nullptr) const override {
+            return p.ebnf(defs);
+        }
+    };
+
+    shared_ptr<holder_base const> p;
+
+    template <typename R>
+    bool call(Iterator &i, R const &r, Synthesize* result, Inherit* st) const {
+        assert(p != nullptr);
+        recursion_guard const g;
+        if (g.too_deep()) {
+            return raise_error("nesting too deep", *this, i, i, r);
+        }
+        return p->parse(i, r, result, st);
+    }
+
+public:
+    using is_parser_type = false_type;
+    using is_handle_type = true_type;
+    using has_side_effects = true_type; // have to assume it does.
+    using result_type = Synthesize;
+    int const rank = 0;
+
+    constexpr parser_handle() {}
+
+    template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value>::type>
+    constexpr parser_handle(P const &q) : p(new holder_poly<P>(q)) {} 
+
+    // note: initialise name before moving q.
+    template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value>::type>
+    constexpr parser_handle(P &&q) : p(new holder_poly<P>(forward<P>(q))) {}
+
+    constexpr parser_handle(parser_handle&& q) : p(move(q.p)) {}
+
+    constexpr parser_handle(parser_handle const &q) : p(q.p) {}
+
+    template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value>::type>
+    parser_handle& operator= (P const &q) {
+        p = shared_ptr<holder_base const>(new holder_poly<P>(q));
+        return *this;
+    }
+
+    parser_handle& operator= (parser_handle const &q) {
+        p = q.p;
+        return *this;
+    }
+
+    template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type,true_type>::value>::type>
+    parser_handle& operator= (P &&q) {
+        p = shared_ptr<holder_base const>(new holder_poly<P>(forward<P>(q)));
+        return *this;
+    }
+
+    parser_handle& operator= (parser_handle &&q) {
+        p = move(q.p);
+        return *this;
+    }
+
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        Synthesize* result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return call(i, r, result, st);
+    }
+
+    // parsing through an error_channel, see Error Policy.
+    bool operator() (
+        Iterator &i,
+        error_channel<Range> const &r,
+        Synthesize* result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return call(i, r, result, st);
+    }
+
+    // a handle that has not been assigned yet could become anything.
+    first_set first() const {
+        return (p != nullptr) ? p->first() : first_set::all();
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return p->ebnf(defs);
+    }
+};
+
+//----------------------------------------------------------------------------
+// Inline Handle: a handle for grammars that are built once and then only
+// read. Instead of a virtual call through a shared_ptr, the handle keeps a
+// pointer to the parse function of the parser it holds, and the parser
+// itself in a small buffer inside the handle. A parser too big for the
+// buffer is allocated once and shared by the copies of the handle with a
+// plain (non-atomic) count. Parsing through copies of the handle from
+// several threads is safe, but copying or assigning them is not.
+
+template <typename Iterator, typename Range, typename Synthesize = void,
+    typename Inherit = default_inherited, size_t Size = 8 * sizeof(void*)>
+class parser_inline_handle {
+    using storage_type = typename aligned_storage<Size>::type;
+    using parse_type = bool (*)(void const*, Iterator&, Range const&, Synthesize*, Inherit*);
+
+    // parsing through an error_channel is rarer, so it is not kept inline.
+    struct operations {
+        bool (*parse_channel)(void const*, Iterator&, error_channel<Range> const&, Synthesize*, Inherit*);
+        void (*copy)(void*, void const*);
+        void (*destroy)(void*);
+        first_set (*first)(void const*);
+        string (*ebnf)(void const*, unique_defs*);
+    };
+
+    // the buffer holds the parser.
+    template <typename Parser> struct stored_inline {
+        static Parser const& get(void const* s) {
+            return *static_cast<Parser const*>(s);
+        }
+
+        static void make(void* s, Parser const& q) {
+            new (s) Parser(q);
+        }
+
+        static void copy(void* s, void const* t) {
+            new (s) Parser(get(t));
+        }
+
+        static void destroy(void* s) {
+            static_cast<Parser*>(s)->~Parser();
+        }
+    };
+
+    // the buffer holds a pointer to the parser and its count.
+    template <typename Parser> struct stored_shared {
+        struct counted {
+            Parser const p;
+            size_t count;
+
+            explicit counted(Parser const& q) : p(q), count(1) {}
+        };
+
+        static counted* ptr(void const* s) {
+            return *static_cast<counted* const*>(s);
+        }
+
+        static Parser const& get(void const* s) {
+            return ptr(s)->p;
+        }
+
+        static void make(void* s, Parser const& q) {
+            *static_cast<counted**>(s) = new counted(q);
+        }
+
+        static void copy(void* s, void const* t) {
+            counted* const c = ptr(t);
+            ++(c->count);
+            *static_cast<counted**>(s) = c;
+        }
+
+        static void destroy(void* s) {
+            counted* const c = ptr(s);
+            if (--(c->count) == 0) {
+                delete c;
+            }
+        }
+    };
+
+    template <typename Parser> struct holder {
+        using store = typename conditional<(sizeof(Parser) <= sizeof(storage_type)
+            && alignof(Parser) <= alignof(storage_type)),
+            stored_inline<Parser>, stored_shared<Parser>>::type;
+
+        template <typename R>
+        static bool parse(void const* s, Iterator& i, R const& r, Synthesize* result, Inherit* st) {
+            return store::get(s)(i, r, result, st);
+        }
+
+        static first_set first(void const* s) {
+            return first_set_of(store::get(s));
+        }
+
+        static string ebnf(void const* s, unique_defs* defs) {
+            return store::get(s).ebnf(defs);
+        }
+
+        static operations const* ops() {
+            static operations const o {parse<error_channel<Range>>, store::copy, store::destroy, first, ebnf};
+            return &o;
+        }
+    };
+
+    parse_type parse;
+    operations const* ops;
+    storage_type storage;
+
+    void acquire(parser_inline_handle const& q) {
+        parse = q.parse;
+        ops = q.ops;
+        if (ops != nullptr) {
+            ops->copy(&storage, &q.storage);
+        }
+    }
+
+    void release() {
+        if (ops != nullptr) {
+            ops->destroy(&storage);
+        }
+        parse = nullptr;
+        ops = nullptr;
+    }
+
+public:
+    using is_parser_type = false_type;
+    using is_handle_type = true_type;
+    using has_side_effects = true_type; // have to assume it does.
+    using result_type = Synthesize;
+    int const rank = 0;
+
+    parser_inline_handle() : parse(nullptr), ops(nullptr) {}
+
+    template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value>::type>
+    parser_inline_handle(P const &q) : parse(holder<P>::template parse<Range>), ops(holder<P>::ops()) {
+        holder<P>::store::make(&storage, q);
+    }
+
+    parser_inline_handle(parser_inline_handle const &q) {
+        acquire(q);
+    }
+
+    ~parser_inline_handle() {
+        release();
+    }
+
+    // the new parser may hold a copy of this handle, so build it first.
+    template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value>::type>
+    parser_inline_handle& operator= (P const &q) {
+        return *this = parser_inline_handle(q);
+    }
+
+    parser_inline_handle& operator= (parser_inline_handle const &q) {
+        if (this != &q) {
+            release();
+            acquire(q);
+        }
+        return *this;
+    }
+
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        Synthesize* result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        assert(parse != nullptr);
+        recursion_guard const g;
+        if (g.too_deep()) {
+            return raise_error("nesting too deep", *this, i, i, r);
+        }
+        return parse(&storage, i, r, result, st);
+    }
+
+    // parsing through an error_channel, see Error Policy.
+    bool operator() (
+        Iterator &i,
+        error_channel<Range> const &r,
+        Synthesize* result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        assert(ops != nullptr);
+        recursion_guard const g;
+        if (g.too_deep()) {
+            return raise_error("nesting too deep", *this, i, i, r);
+        }
+        return ops->parse_channel(&storage, i, r, result, st);
+    }
+
+    // a handle that has not been assigned yet could become anything.
+    first_set first() const {
+        return (ops != nullptr) ? ops->first(&storage) : first_set::all();
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return ops->ebnf(&storage, defs);
+    }
+};
+
+//----------------------------------------------------------------------------
+// Reference Parser, used to create a self reference in a recursive parser.
+
+template <typename Parser>
+class parser_ref {
+    Parser const* p;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank = 0;
+    char const* name;
+
+    constexpr parser_ref(char const* name, Parser const* q) : p(q), name(name) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (Iterator &i, Range const &r, result_type *result = nullptr, Inherit* st = nullptr) const {
+        recursion_guard const g;
+        if (g.too_deep()) {
+            return raise_error("nesting too deep", *this, i, i, r);
+        }
+        return (*p)(i, r, result, st);
+    }
+
+    // the referenced parser is still being constructed.
+    constexpr first_set first() const {
+        return first_set::all();
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        if (defs != nullptr) {
+            auto i = defs->find(name);
+            if (i == defs->end()) {
+                auto i = (defs->emplace(name, name)).first;
+                string const n = p->ebnf(defs);
+                i->second = n;
+            }
+        }
+        return name;
+    }
+};
+
+template <typename P, typename = typename P::is_parser_type>
+constexpr parser_ref<P> reference(char const* name, P const* p) {
+    return parser_ref<P>(name, p);
+}
+
+//----------------------------------------------------------------------------
+// Fixed Point Parser, neater way to define simple recursive parsers.
+
+template <typename F> class parser_fix {
+    using parser_type = typename function_traits<F>::return_type;
+    parser_type const p;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename parser_type::has_side_effects;
+    using result_type = typename parser_type::result_type;
+    int const rank = 0;
+    char const* name;
+
+    constexpr explicit parser_fix(char const* n, F f) : p(f(reference(n, &p))) , name(n) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (Iterator &i, Range const &r, result_type *result = nullptr, Inherit* st = nullptr) const {
+        return p(i, r, result, st);
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        string const n = p.ebnf(defs);
+        if (defs != nullptr) {
+            defs->emplace(name, n);
+        }
+        return name;
+    }
+};
+
+template <typename F> // , typename = typename function_traits<F>::result_type::is_parser_type>
+constexpr parser_fix<F> fix(char const* n, F f) {
+    return parser_fix<F>{n, f};
+}
+
+//----------------------------------------------------------------------------
+// Rule Parser: a static reference to a rule by a tag type, for mutually
+// recursive grammars without handles. The definition of a rule is found by
+// calling rule_definition(Tag()), which is looked up (by argument dependent
+// lookup) where the parser is used rather than where the rule is declared, so
+// rules can refer to rules that are defined later:
+//
+//     struct expr_rule {};
+//     constexpr parser_rule<expr_rule, int> expr("expr");
+//     auto const term = number || discard(open) && expr && discard(close);
+//     ...
+//     decltype(sum) const& rule_definition(expr_rule) {return sum;}
+//
+// Nothing is allocated and the compiler can see through every call. As with a
+// handle the rule must not be left recursive, and its FIRST set is unknown.
+
+template <typename Tag, typename Synthesize = void>
+class parser_rule {
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = true_type; // have to assume it does.
+    using result_type = Synthesize;
+    int const rank = 0;
+    char const* name;
+
+    constexpr explicit parser_rule(char const* name) : name(name) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (Iterator &i, Range const &r, result_type *result = nullptr, Inherit* st = nullptr) const {
+        recursion_guard const g;
+        if (g.too_deep()) {
+            return raise_error("nesting too deep", *this, i, i, r);
+        }
+        return rule_definition(Tag())(i, r, result, st);
+    }
+
+    // the definition may not exist yet.
+    constexpr first_set first() const {
+        return first_set::all();
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        if (defs != nullptr) {
+            auto i = defs->find(name);
+            if (i == defs->end()) {
+                auto i = (defs->emplace(name, name)).first;
+                string const n = rule_definition(Tag()).ebnf(defs);
+                i->second = n;
+            }
+        }
+        return name;
+    }
+};
+
+template <typename Tag, typename Synthesize = void>
+constexpr parser_rule<Tag, Synthesize> rule(char const* name) {
+    return parser_rule<Tag, Synthesize>(name);
+}
+
+//============================================================================
+// Memoization
+//
+// memo(p) caches the outcome of p at each input position: whether it
+// succeeded, where it stopped, and the synthesized result. Re-parsing the
+// same rule at the same position after backtracking becomes a table lookup,
+// which makes grammars that try several alternatives sharing a prefix linear
+// rather than exponential. Copies of a memo parser share their tables, so
+// memoize a rule once and use the copy everywhere the rule is referenced.
+//
+// The tables are kept in a memo_context (see above). Each is direct-mapped on
+// the input offset, so its memory is bounded by the capacity (rounded up to a
+// power of two, and no more than the input needs). A new entry replaces
+// whatever was in its slot. Hits, misses and evictions are added to the
+// memo_stats when the context ends.
+//
+// Only the result is replayed on a hit. Changes to inherited attributes are
+// not, so memoize rules whose inherited side effects can be repeated or are
+// not needed again. The result is replaced by the cached value, except for
+// string and char_span results which are appended to, as recognisers do. Left
+// recursive rules still do not terminate.
+
+template <typename T> struct memo_value {
+    T value {};
+
+    T* get() {
+        return &value;
+    }
+
+    void replay(T* result) const {
+        *result = value;
+    }
+};
+
+template <> struct memo_value<string> {
+    string value;
+
+    string* get() {
+        return &value;
+    }
+
+    void replay(string* result) const {
+        result->append(value);
+    }
+};
+
+template <> struct memo_value<char_span> {
+    char_span value;
+
+    char_span* get() {
+        return &value;
+    }
+
+    void replay(char_span* result) const {
+        if (result->empty()) {
+            *result = value;
+        } else {
+            result->append(value.begin(), value.end(), false_type());
+        }
+    }
+};
+
+template <> struct memo_value<void> {
+    void* get() {
+        return nullptr;
+    }
+
+    void replay(void* result) const {}
+};
+
+template <typename Parser> class parser_memo {
+    using value_type = memo_value<typename Parser::result_type>;
+
+    struct state {
+        size_t const capacity;
+        memo_stats own_stats;
+        memo_stats* stats;
+        mutex lock;
+
+        state(size_t const capacity, memo_stats* s) : capacity(capacity),
+            stats((s != nullptr) ? s : &own_stats) {}
+    };
+
+    template <typename Iterator> struct table : public memo_context::table_base {
+        struct entry {
+            ptrdiff_t start;
+            bool success;
+            Iterator end;
+            value_type v;
+
+            explicit entry(Iterator const& i) : start(-1), success(false), end(i) {}
+        };
+
+        shared_ptr<state> const s;
+        size_t const mask;
+        vector<entry> entries;
+        memo_stats counts;
+
+        // no larger than the input needs.
+        static size_t mask_for(size_t const capacity, size_t const length) {
+            size_t n = 1;
+            while (n < capacity && n <= length) {
+                n <<= 1;
+            }
+            return n - 1;
+        }
+
+        table(shared_ptr<state> const& s, Iterator const& i, size_t const length)
+            : s(s), mask(mask_for(s->capacity, length)), entries(mask + 1, entry(i)) {}
+
+        ~table() {
+            lock_guard<mutex> l(s->lock);
+            s->stats->hits += counts.hits;
+            s->stats->misses += counts.misses;
+            s->stats->evictions += counts.evictions;
+        }
+    };
+
+    template <typename Iterator> static void const* type_of() {
+        static char const tag = 0;
+        return &tag;
+    }
+
+    Parser const p;
+    shared_ptr<state> const s;
+
+    template <typename Iterator, typename Range, typename Inherit>
+    bool memoized(Iterator &i, Range const &r, typename Parser::result_type *result, Inherit* st,
+        memo_context& c) const {
+        shared_ptr<state> const& m = s;
+        table<Iterator>& t = c.table<table<Iterator>>(s.get(), &r, type_of<Iterator>(), [&m, &r] {
+            return new table<Iterator>(m, r.first, static_cast<size_t>(r.last - r.first));
+        });
+        ptrdiff_t const start = i - r.first;
+        auto& e = t.entries[static_cast<size_t>(start) & t.mask];
+        if (e.start == start) {
+            ++t.counts.hits;
+            i = e.end;
+            if (e.success && result != nullptr) {
+                e.v.replay(result);
+            }
+            return e.success;
+        }
+        ++t.counts.misses;
+        // the slot may be reused while p runs, so fill it in afterwards.
+        value_type v;
+        bool const success = p(i, r, v.get(), st);
+        if (in_error(r)) {
+            return false;
+        }
+        auto& f = t.entries[static_cast<size_t>(start) & t.mask];
+        if (f.start >= 0) {
+            ++t.counts.evictions;
+        }
+        f.start = start;
+        f.success = success;
+        f.end = i;
+        f.v = v;
+        if (success && result != nullptr) {
+            v.replay(result);
+        }
+        return success;
+    }
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank;
+
+    parser_memo(Parser const& q, size_t const capacity, memo_stats* stats)
+        : p(q), s(make_shared<state>(capacity, stats)), rank(q.rank) {}
+
+    // counts from the contexts that have ended.
+    memo_stats const& stats() const {
+        return *(s->stats);
+    }
+
+    // forget what is cached in the current context.
+    void reset() const {
+        if (memo_context* const c = memo_context::current()) {
+            c->drop(s.get());
+        }
+    }
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        if (memo_context* const c = memo_context::current()) {
+            return memoized(i, r, result, st, *c);
+        }
+        memo_context c;
+        return memoized(i, r, result, st, c);
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return p.ebnf(defs);
+    }
+};
+
+template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type>
+parser_memo<P> memo(P const& p, memo_stats* stats = nullptr, size_t const capacity = 1 << 16) {
+    return parser_memo<P>(p, capacity, stats);
+}
+
+//============================================================================
+// Parser modifiers: are not visible in parser naming.
+
+//----------------------------------------------------------------------------
+// Discard the result of the parser (and the result type), keep succeed or fail.
+
+template <typename Parser> class combinator_discard {
+    friend struct grammar_rewrite;
+
+    Parser const p;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = void;
+    int const rank;
+
+    constexpr explicit combinator_discard(Parser const& q)
+        : p(q), rank(q.rank) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        typename Parser::result_type *const discard_result = nullptr;
+        return p(i, r, discard_result, st);
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return p.ebnf(defs);
+    }
+};
+
+template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type>
+constexpr combinator_discard<P> const discard(P const& p) {
+    return combinator_discard<P>(p);
+}
+
+//----------------------------------------------------------------------------
+// Logging Parser
+
+template <typename Parser> 
+class parser_log {
+    friend struct grammar_rewrite;
+
+    Parser const p;
+    string const msg;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank;
+
+    constexpr explicit parser_log(string const& s, Parser const& q)
+        : p(q), msg(s), rank(q.rank) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        Iterator const x = i;
+
+        bool const b = p(i, r, result, st);
+
+#ifdef DEBUG
+        if (b) {
+            cout << msg << ": ";
+
+            if (result != nullptr) {
+                cout << *result;
+            }
+
+            cout << " @" << (x - r.first) << " - " << (i - r.first) << "\n";
+        }
+#endif
+
+        return b;
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return p.ebnf(defs);
+    }
+};
+
+template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type>
+constexpr parser_log<P> log(string const& s, P const& p) {
+    return parser_log<P>(s, p);
+}
+
+//----------------------------------------------------------------------------
+// Backtracking Parser
+
+template <typename Parser>
+class parser_try {
+    friend struct grammar_rewrite;
+
+    Parser const p;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank;
+
+    constexpr explicit parser_try(Parser const& q) : p(q), rank(q.rank) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        input_pin<Range> const pin(r, i);
+        Iterator const first = i;
+        auto const m = result_mark(result);
+        if (p(i, r, result, st)) {
+            return true;
+        } 
+        i = first;
+        result_rollback(result, m);
+        return false;
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return p.ebnf(defs);
+    }
+};
+
+// Inherited attributes can opt into a checkpoint protocol, so that they are
+// not copied to backtrack: 'mark' returns a checkpoint, 'rollback' undoes all
+// changes since the checkpoint, and 'commit' keeps them (see journal.hpp).
+// Marks are strictly nested, each is either rolled back or committed.
+
+template <typename Inherit, typename = void> struct has_checkpoint : false_type {};
+
+template <typename Inherit> struct has_checkpoint<Inherit, typename enable_if<is_same<
+    decltype(declval<Inherit&>().rollback(declval<Inherit&>().mark())),
+    decltype(declval<Inherit&>().commit(declval<Inherit&>().mark()))>::value>::type> : true_type {};
+
+template <typename Parser>
+class parser_try_side {
+    friend struct grammar_rewrite;
+
+    Parser const p;
+
+    template <typename Iterator, typename Range, typename Inherit>
+    bool attempt_state(Iterator &i, Range const &r, typename Parser::result_type *result,
+        Inherit* st, false_type /*has_checkpoint*/) const {
+        input_pin<Range> const pin(r, i);
+        Iterator const first = i;
+        auto const m = result_mark(result);
+        Inherit inh;
+        if (st != nullptr) {
+            inh = *st;
+        }
+        if (p(i, r, result, st)) {
+            return true;
+        } 
+        i = first;
+        result_rollback(result, m);
+        if (st != nullptr) {
+            *st = inh;
+        }
+        return false;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit>
+    bool attempt_state(Iterator &i, Range const &r, typename Parser::result_type *result,
+        Inherit* st, true_type /*has_checkpoint*/) const {
+        input_pin<Range> const pin(r, i);
+        Iterator const first = i;
+        auto const m = result_mark(result);
+        if (st == nullptr) {
+            if (p(i, r, result, st)) {
+                return true;
+            }
+            i = first;
+            result_rollback(result, m);
+            return false;
+        }
+        auto const n = st->mark();
+        if (p(i, r, result, st)) {
+            st->commit(n);
+            return true;
+        } 
+        i = first;
+        result_rollback(result, m);
+        st->rollback(n);
+        return false;
+    }
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank;
+
+    constexpr explicit parser_try_side(Parser const& q) : p(q), rank(q.rank) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return attempt_state(i, r, result, st, has_checkpoint<Inherit>());
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return p.ebnf(defs);
+    }
+};
+
+template <typename P, typename = typename enable_if<
+    (
+        is_same<typename P::is_parser_type, true_type>::value
+        || is_same<typename P::is_handle_type, true_type>::value
+    ) && is_same<typename P::has_side_effects, false_type>::value
+>::type>
+constexpr parser_try<P> attempt(P const& p) {
+    return parser_try<P>(p);
+}
+
+template <typename P, typename = typename enable_if<
+    (
+        is_same<typename P::is_parser_type, true_type>::value
+        || is_same<typename P::is_handle_type, true_type>::value
+    ) && is_same<typename P::has_side_effects, true_type>::value
+>::type>
+constexpr parser_try_side<P> attempt(P const& p) {
+    return parser_try_side<P>(p);
+}
+
+//----------------------------------------------------------------------------
+// Convert fail to error
+
+template <typename Parser>
+class parser_strict {
+    friend struct grammar_rewrite;
+
+    Parser const p;
+    char const* err;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank;
+
+    constexpr parser_strict(char const* s, Parser const& q) : p(q), err(s), rank(q.rank) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        Iterator const first = i;
+        if (!p(i, r, result, st)) {
+            return raise_error(err, p, first, i, r);
         }
         return true;
     }
 
+    // fails with an error on any symbol.
+    constexpr first_set first() const {
+        return first_set::all();
+    }
+
     string ebnf(unique_defs* defs = nullptr) const {
-        return "{" + p.ebnf(defs) + "}";
+        return p.ebnf(defs);
     }
 };
 
 template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
     || is_same<typename P::is_handle_type, true_type>::value>::type>
-constexpr combinator_many<P> const many(P const& p) {
-    return combinator_many<P>(p);
+constexpr parser_strict<P> strict(char const* s, P const& p) {
+    return parser_strict<P>(s, p);
+}
+
+//----------------------------------------------------------------------------
+// Name a parser (for better error readability)
+
+template <typename Parser, typename Name>
+class parser_name {
+    friend struct grammar_rewrite;
+
+    Parser const p;
+    Name const n;
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank;
+
+    constexpr parser_name(Name&& m, int r, Parser const& q)
+        : p(q), n(forward<Name>(m)), rank(r) {}
+
+    template <typename Iterator, typename Range, typename Inherit>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        return p(i, r, result, st);
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return n(defs);
+    }
+};
+
+template <typename P, typename N, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type>
+constexpr parser_name<P, N> rename(N&& n, int r, P const& p) {
+    return parser_name<P, N>(forward<N>(n), r, p);
 }
 
-//----------------------------------------------------------------------------
-// Exception parser
+//----------------------------------------------------------------------------
+// Define a sub-parser (for better error readability)
+
+template <typename Parser>
+class parser_def {
+    friend struct grammar_rewrite;
 
-template <typename Parser> class combinator_except {
     Parser const p;
-    char const* x;
 
 public:
     using is_parser_type = true_type;
     using is_handle_type = false_type;
     using has_side_effects = typename Parser::has_side_effects;
     using result_type = typename Parser::result_type;
-    int const rank = 0;
+    int const rank;
+    char const* name;
 
-    constexpr combinator_except(char const* x, Parser const& p) : p(p), x(x) {}
+    constexpr parser_def(char const* n, Parser const& q)
+        : p(q), rank(q.rank), name(n) {}
 
-    template <typename Iterator, typename Range, typename Inherit = default_inherited> 
+    template <typename Iterator, typename Range, typename Inherit>
     bool operator() (
         Iterator &i,
         Range const &r,
         result_type *result = nullptr,
         Inherit* st = nullptr
     ) const {
-        result_type tmp;
-        if (p(i, r, &tmp, st)) {
-            if (x != tmp) {
-                if (result != nullptr) {
-                    *result = tmp;
-                }
-                return true;
-            }
-        }
-        return false;
+        return p(i, r, result, st);
+    }
+    
+    constexpr first_set first() const {
+        return first_set_of(p);
     }
 
     string ebnf(unique_defs* defs = nullptr) const {
-        return p.ebnf(defs) + " - \"" + x + "\"";
+        string const n = p.ebnf(defs);
+        if (defs != nullptr) {
+            defs->emplace(name, n);
+        }
+        return name;
     }
 };
 
-template <typename P, typename = typename enable_if<
-    is_same<typename P::is_parser_type, true_type>::value
-    || is_same<typename P::is_handle_type, true_type>::value
-    >::type>
-constexpr combinator_except<P> const operator- (P const& p, char const* x) {
-    return combinator_except<P>(x, p);
+template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type>
+constexpr parser_def<P> define(char const* s, P const& p) {
+    return parser_def<P>(s, p);
 }
 
 //============================================================================
-// Run-time polymorphism
+// Some derived definitions for convenience: option, some
 
 //----------------------------------------------------------------------------
-// Handle: holds a runtime-polymorphic parser. It is mutable so that it can be
-// defined before the parser is assigned.
+// Optionally accept the parser once.
 
-template <typename Iterator, typename Range, typename Synthesize = void, typename Inherit = default_inherited>
-class parser_handle {
+template <typename Parser> struct option_name {
+    Parser const p;
+    constexpr option_name(Parser const& q) : p(q) {}
+    string operator() (unique_defs* defs = nullptr) const {
+        return "[" + p.ebnf(defs) + "]";
+    }
+};
 
-    struct holder_base {
-        virtual ~holder_base() {}
+template <typename P> constexpr auto option(P const& p)
+-> decltype(rename(option_name<P>(p), 0, p || succ)) {
+    return rename(option_name<P>(p), 0, p || succ);
+}
 
-        virtual bool parse(
-            Iterator& i,
-            Range const &r,
-            Synthesize* result = nullptr,
-            Inherit* st = nullptr
-        ) const = 0;
+//----------------------------------------------------------------------------
+// Accept the parser one or more times.
 
-        virtual string ebnf(unique_defs* defs = nullptr) const = 0;
-    }; 
+template <typename Parser> struct some_name {
+    Parser const p;
+    constexpr some_name(Parser const& q) : p(q) {}
+    string operator() (unique_defs* defs = nullptr) const {
+        return "{" + p.ebnf(defs) + "}-";
+    }
+};
 
-    template <typename Parser>
-    class holder_poly : public holder_base {
-        Parser const p;
+template <typename P> constexpr auto some(P const& p)
+-> decltype(rename(some_name<P>(p), 0, p && many(p))) {
+    return rename(some_name<P>(p), 0, p && many(p));
+}
 
-    public:
-        explicit holder_poly(Parser const &q) : p(q) {}
-        explicit holder_poly(Parser &&q) : p(forward<Parser>(q)) {}
+//----------------------------------------------------------------------------
+// Accept one parser separated by another
 
-        virtual bool parse(
-            Iterator &i,
-            Range const &r,
-            Synthesize* result = nullptr,
-            Inherit* st = nullptr
-        ) const override {
-            return p(i, r, result, st);
+template <typename P, typename Q> struct sepby_name {
+    P const p;
+    Q const q;
+    constexpr sepby_name(P const& p, Q const& q) : p(p), q(q) {}
+    string operator() (unique_defs* defs = nullptr) const {
+        return p.ebnf(defs) + ", {" + q.ebnf(defs) + ", " + p.ebnf() + "}";
+    }
+};
+
+template <typename P, typename Q> constexpr auto sep_by(P const& p, Q const& q)
+-> decltype (rename(sepby_name<P, Q>(p, q), 0, p && many(discard(q) && p))) {
+    return rename(sepby_name<P, Q>(p, q), 0, p && many(discard(q) && p));
+}
+
+//----------------------------------------------------------------------------
+// Lazy Tokenisation, by skipping the whitespace after each token we leave 
+// the input stream in a position where parsers can fail on the first
+// character without requiring backtracking. This requires using the 
+// "first_token" parser as the first parser to initialise lazy tokenization
+// properly.
+
+// skip to start of first token.
+constexpr auto first_token = discard(many(accept(is_space)));
+
+template <typename Parser> struct tok_name {
+    Parser const p;
+    constexpr tok_name(Parser const& q) : p(q) {}
+    string operator() (unique_defs* defs = nullptr) const {
+        return p.ebnf(defs);
+    }
+};
+
+template <typename R> constexpr auto tokenise(R const& r)
+-> decltype(rename(tok_name<R>(r), 0, r && first_token)) {
+    return rename(tok_name<R>(r), 0, r && first_token);
+}
+
+//============================================================================
+// Operator Precedence: operators, prefix, infix_left, infix_right, postfix
+//
+// Parse expressions of a primary parser and a table of operators by
+// precedence climbing, in one left to right pass. An operator is only tried
+// when its precedence is high enough to bind at the current level, so no
+// operator token is ever parsed twice and nothing backtracks. Tokens that
+// share a prefix must be listed longest first, as with ||.
+//
+// Each operator has a token parser and a functor, called as for all():
+// prefix f(result*, op, operand), infix f(result*, left, op, right) and
+// postfix f(result*, operand, op), with the inherited attribute appended when
+// there is one. A higher precedence binds more tightly.
+
+enum class fixity {prefix, infix_left, infix_right, postfix};
+
+template <fixity Fixity, typename Parser, typename Functor> struct operator_def {
+    static constexpr fixity kind = Fixity;
+    int const prec;
+    Parser const p;
+    Functor const f;
+
+    constexpr operator_def(int const n, Parser const& q, Functor const& g)
+        : prec(n), p(q), f(g) {}
+};
+
+template <typename P, typename F>
+constexpr operator_def<fixity::prefix, P, F> prefix(int const prec, P const& p, F const& f) {
+    return operator_def<fixity::prefix, P, F>(prec, p, f);
+}
+
+template <typename P, typename F>
+constexpr operator_def<fixity::infix_left, P, F> infix_left(int const prec, P const& p, F const& f) {
+    return operator_def<fixity::infix_left, P, F>(prec, p, f);
+}
+
+template <typename P, typename F>
+constexpr operator_def<fixity::infix_right, P, F> infix_right(int const prec, P const& p, F const& f) {
+    return operator_def<fixity::infix_right, P, F>(prec, p, f);
+}
+
+template <typename P, typename F>
+constexpr operator_def<fixity::postfix, P, F> postfix(int const prec, P const& p, F const& f) {
+    return operator_def<fixity::postfix, P, F>(prec, p, f);
+}
+
+template <typename Primary, typename... Ops> class combinator_operators {
+    using value_type = typename Primary::result_type;
+    static_assert(!is_void<value_type>::value, "operators requires a primary parser with a result");
+
+    enum class step {no_match, matched, failed};
+
+    Primary const primary;
+    tuple<Ops...> const ops;
+
+    template <typename Iterator, typename Range, typename Inherit, typename Functor, typename... Args>
+    bool apply(Functor const& f, value_type& v, Iterator const& first, Iterator const& i,
+        Range const& r, Inherit* st, Args&... args) const {
+        using args_type = tuple<Args&...>;
+        args_type rs(args...);
+        value_type x {};
+        call_all<Functor, Inherit> call_f(f);
+        try {
+            apply_args(call_f, &x, rs, st, range<0, sizeof...(Args)>());
+        } catch (runtime_error &e) {
+            return raise_error(e.what(), *this, first, i, r);
         }
+        v = move(x);
+        return true;
+    }
 
-        virtual string ebnf(unique_defs* defs = nullptr) const override {
-            return p.ebnf(defs);
+    // an operator that did not match, unless it consumed input or raised an error.
+    template <typename Iterator, typename Range>
+    static step missed(Iterator const& first, Iterator const& i, Range const& r) {
+        return (first == i && !in_error(r)) ? step::no_match : step::failed;
+    }
+
+    template <typename Call, typename Rs, typename Inherit, size_t... Is>
+    static void apply_args(Call& call_f, value_type* x, Rs& rs, Inherit* st, size_sequence<Is...>) {
+        call_f.template all<value_type, Rs, Is...>(x, rs, st, Is...);
+    }
+
+    // operators that may start an expression.
+    template <typename Iterator, typename Range, typename Inherit, typename P, typename F>
+    step before(operator_def<fixity::prefix, P, F> const& op, Iterator &i, Range const &r,
+        value_type& v, Inherit* st) const {
+        Iterator const first = i;
+        typename P::result_type o {};
+        if (!op.p(i, r, &o, st)) {
+            return missed(first, i, r);
         }
-    };
+        value_type x {};
+        if (!climb(i, r, x, op.prec, st)) {
+            return step::failed;
+        }
+        return apply(op.f, v, first, i, r, st, o, x) ? step::matched : step::failed;
+    }
 
-    shared_ptr<holder_base const> p;
+    template <typename Iterator, typename Range, typename Inherit, fixity K, typename P, typename F>
+    step before(operator_def<K, P, F> const& op, Iterator &i, Range const &r,
+        value_type& v, Inherit* st) const {
+        return step::no_match;
+    }
+
+    // operators that may follow an operand.
+    template <typename Iterator, typename Range, typename Inherit, typename P, typename F>
+    step after(operator_def<fixity::postfix, P, F> const& op, Iterator &i, Range const &r,
+        value_type& v, long long const min, Inherit* st) const {
+        if (op.prec < min) {
+            return step::no_match;
+        }
+        Iterator const first = i;
+        typename P::result_type o {};
+        if (!op.p(i, r, &o, st)) {
+            return missed(first, i, r);
+        }
+        return apply(op.f, v, first, i, r, st, v, o) ? step::matched : step::failed;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit, fixity K, typename P, typename F>
+    step after(operator_def<K, P, F> const& op, Iterator &i, Range const &r,
+        value_type& v, long long const min, Inherit* st) const {
+        if (op.prec < min) {
+            return step::no_match;
+        }
+        Iterator const first = i;
+        typename P::result_type o {};
+        if (!op.p(i, r, &o, st)) {
+            return missed(first, i, r);
+        }
+        value_type x {};
+        // in a wider type, as prec + 1 would overflow at INT_MAX.
+        if (!climb(i, r, x, (K == fixity::infix_left) ? op.prec + 1LL : op.prec, st)) {
+            return step::failed;
+        }
+        return apply(op.f, v, first, i, r, st, v, o, x) ? step::matched : step::failed;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit, typename P, typename F>
+    step after(operator_def<fixity::prefix, P, F> const& op, Iterator &i, Range const &r,
+        value_type& v, long long const min, Inherit* st) const {
+        return step::no_match;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit>
+    step before_any(Iterator &i, Range const &r, value_type& v, Inherit* st, size_sequence<>) const {
+        return step::no_match;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit, size_t I0, size_t... Is>
+    step before_any(Iterator &i, Range const &r, value_type& v, Inherit* st, size_sequence<I0, Is...>) const {
+        step const s = before(get<I0>(ops), i, r, v, st);
+        return (s != step::no_match) ? s : before_any(i, r, v, st, size_sequence<Is...>());
+    }
+
+    template <typename Iterator, typename Range, typename Inherit>
+    step after_any(Iterator &i, Range const &r, value_type& v, long long const min, Inherit* st, size_sequence<>) const {
+        return step::no_match;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit, size_t I0, size_t... Is>
+    step after_any(Iterator &i, Range const &r, value_type& v, long long const min, Inherit* st, size_sequence<I0, Is...>) const {
+        step const s = after(get<I0>(ops), i, r, v, min, st);
+        return (s != step::no_match) ? s : after_any(i, r, v, min, st, size_sequence<Is...>());
+    }
+
+    // parse an expression whose operators all have a precedence of at least min.
+    template <typename Iterator, typename Range, typename Inherit>
+    bool climb(Iterator &i, Range const &r, value_type& v, long long const min, Inherit* st) const {
+        step s = before_any(i, r, v, st, range<0, sizeof...(Ops)>());
+        if (s == step::failed || (s == step::no_match && !primary(i, r, &v, st))) {
+            return false;
+        }
+        while ((s = after_any(i, r, v, min, st, range<0, sizeof...(Ops)>())) == step::matched) {}
+        return s == step::no_match;
+    }
+
+    template <typename Op>
+    static int group(Op const& op) {
+        return (Op::kind == fixity::prefix) ? 0 : (Op::kind == fixity::postfix) ? 1 : 2;
+    }
+
+    string names(int const g, unique_defs* defs, size_sequence<>) const {
+        return string();
+    }
+
+    template <size_t I0, size_t... Is>
+    string names(int const g, unique_defs* defs, size_sequence<I0, Is...>) const {
+        string const rest = names(g, defs, size_sequence<Is...>());
+        if (group(get<I0>(ops)) != g) {
+            return rest;
+        }
+        string const n = format_name(get<I0>(ops).p, 1, defs);
+        return rest.empty() ? n : n + " | " + rest;
+    }
+
+    template <size_t I0, size_t... Is>
+    constexpr first_set first_of(size_sequence<I0, Is...>) const {
+        return ((tuple_element<I0, tuple<Ops...>>::type::kind == fixity::prefix)
+            ? first_set_of(get<I0>(ops).p) : first_set::none()) | first_of(size_sequence<Is...>());
+    }
+
+    constexpr first_set first_of(size_sequence<>) const {
+        return first_set_of(primary);
+    }
 
 public:
-    using is_parser_type = false_type;
-    using is_handle_type = true_type;
-    using has_side_effects = true_type; // have to assume it does.
-    using result_type = Synthesize;
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = true_type;
+    using result_type = value_type;
     int const rank = 0;
 
-    constexpr parser_handle() {}
+    constexpr explicit combinator_operators(Primary const& p, Ops const&... os)
+        : primary(p), ops(os...) {}
 
-    template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value>::type>
-    constexpr parser_handle(P const &q) : p(new holder_poly<P>(q)) {} 
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        value_type v {};
+        if (!climb(i, r, v, numeric_limits<int>::min(), st)) {
+            return false;
+        }
+        if (result != nullptr) {
+            *result = move(v);
+        }
+        return true;
+    }
 
-    // note: initialise name before moving q.
-    template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value>::type>
-    constexpr parser_handle(P &&q) : p(new holder_poly<P>(forward<P>(q))) {}
+    constexpr first_set first() const {
+        return first_of(range<0, sizeof...(Ops)>());
+    }
 
-    constexpr parser_handle(parser_handle&& q) : p(move(q.p)) {}
+    string ebnf(unique_defs* defs = nullptr) const {
+        string const pre = names(0, defs, range<0, sizeof...(Ops)>());
+        string const post = names(1, defs, range<0, sizeof...(Ops)>());
+        string const in = names(2, defs, range<0, sizeof...(Ops)>());
+        string const prefixes = pre.empty() ? string() : "{" + pre + "}, ";
+        string const operand = prefixes + format_name(primary, 0, defs);
+        string suffixes = post;
+        if (!in.empty()) {
+            suffixes += (suffixes.empty() ? "" : " | ") + string("(") + in + "), " + operand;
+        }
+        return suffixes.empty() ? operand : operand + ", {" + suffixes + "}";
+    }
+};
 
-    constexpr parser_handle(parser_handle const &q) : p(q.p) {}
+template <typename P, typename... Ops, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type>
+constexpr combinator_operators<P, Ops...> operators(P const& p, Ops const&... ops) {
+    return combinator_operators<P, Ops...>(p, ops...);
+}
 
-    template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value>::type>
-    parser_handle& operator= (P const &q) {
-        p = shared_ptr<holder_base const>(new holder_poly<P>(q));
-        return *this;
+//============================================================================
+// Grammar Optimisation: optimise
+//
+// optimise(p) rewrites a grammar, at compile time, into one that accepts the
+// same language with the same results, errors and EBNF, but that is smaller
+// and does less work per symbol:
+//
+//     - nested sequences become one flat sequence, and nested choices one flat
+//       choice, dispatched on the next symbol by a single table;
+//     - adjacent alternatives that each accept a single symbol become one
+//       recogniser for the union of their classes, so that
+//       many(accept(a) || accept(b)) is a single scanning loop;
+//     - runs of accept(is_char(c)) in a sequence become one literal;
+//     - some(p) becomes a single loop, rather than p followed by many(p).
+//
+// The rewrite looks through names, definitions and modifiers, and stops at
+// handles, references, rules and fixed points, which are kept as they are.
+
+template <bool... Bs> struct any_true : false_type {};
+
+template <bool B, bool... Bs> struct any_true<B, Bs...>
+    : integral_constant<bool, B || any_true<Bs...>::value> {};
+
+//----------------------------------------------------------------------------
+// Flat sequence: the result type is that of the sequence it replaces.
+
+template <typename Result, typename... Parsers> class combinator_chain {
+    using tuple_type = tuple<Parsers...>;
+
+    tuple_type const ps;
+
+    template <typename Iterator, typename Range, typename Inherit>
+    bool chain(Iterator &i, Range const &r, Result *result, Inherit* st, size_sequence<>) const {
+        return true;
     }
 
-    parser_handle& operator= (parser_handle const &q) {
-        p = q.p;
-        return *this;
+    template <typename Iterator, typename Range, typename Inherit, size_t I0, size_t... Is>
+    bool chain(Iterator &i, Range const &r, Result *result, Inherit* st, size_sequence<I0, Is...>) const {
+        return get<I0>(ps)(i, r, result, st) && chain(i, r, result, st, size_sequence<Is...>());
+    }
+
+    constexpr first_set first_of(size_sequence<>) const {
+        return first_set::empty();
     }
 
-    template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type,true_type>::value>::type>
-    parser_handle& operator= (P &&q) {
-        p = shared_ptr<holder_base const>(new holder_poly<P>(forward<P>(q)));
-        return *this;
+    template <size_t I0, size_t... Is>
+    constexpr first_set first_of(size_sequence<I0, Is...>) const {
+        return first_set_of(get<I0>(ps)).then(first_of(size_sequence<Is...>()));
     }
 
-    parser_handle& operator= (parser_handle &&q) {
-        p = move(q.p);
-        return *this;
+    template <size_t... Is>
+    string names(unique_defs* defs, size_sequence<Is...>) const {
+        return concat(", ", format_name(get<Is>(ps), 0, defs)...);
     }
 
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = integral_constant<bool, any_true<Parsers::has_side_effects::value...>::value>;
+    using result_type = Result;
+    int const rank = 0;
+
+    constexpr explicit combinator_chain(tuple_type const& ps) : ps(ps) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
     bool operator() (
         Iterator &i,
         Range const &r,
-        Synthesize* result = nullptr,
+        result_type *result = nullptr,
         Inherit* st = nullptr
     ) const {
-        assert(p != nullptr);
-        return p->parse(i, r, result, st);
+        return chain(i, r, result, st, range<0, sizeof...(Parsers)>());
+    }
+
+    constexpr first_set first() const {
+        return first_of(range<0, sizeof...(Parsers)>());
     }
 
     string ebnf(unique_defs* defs = nullptr) const {
-        return p->ebnf(defs);
+        return names(defs, range<0, sizeof...(Parsers)>());
     }
 };
 
 //----------------------------------------------------------------------------
-// Reference Parser, used to create a self reference in a recursive parser.
+// Flat choice: as a nested choice, an alternative that fails after consuming
+// input is an error, unless it is the last.
 
-template <typename Parser>
-class parser_ref {
-    Parser const* p;
+template <typename Result, typename... Parsers> class combinator_alternatives {
+    using tuple_type = tuple<Parsers...>;
+    using table_type = choice_table<sizeof...(Parsers)>;
+    static constexpr size_t last = sizeof...(Parsers) - 1;
+
+    tuple_type const ps;
+    table_type const table;
+
+    template <typename Iterator, typename Range, typename Inherit>
+    bool alternative(size_t const from, size_t const to, Iterator &i, Range const &r,
+        Result *result, Inherit* st, size_sequence<>) const {
+        return false;
+    }
+
+    template <typename Iterator, typename Range, typename Inherit, size_t I0, size_t... Is>
+    bool alternative(size_t const from, size_t const to, Iterator &i, Range const &r,
+        Result *result, Inherit* st, size_sequence<I0, Is...>) const {
+        if (I0 < from) {
+            return alternative(from, to, i, r, result, st, size_sequence<Is...>());
+        } else if (I0 == last) {
+            return get<I0>(ps)(i, r, result, st);
+        }
+        Iterator const first = i;
+        auto const m = result_mark(result);
+        if (get<I0>(ps)(i, r, result, st)) {
+            return true;
+        }
+        if (first != i) {
+            return raise_error("failed parser consumed input", get<I0>(ps), first, i, r);
+        }
+        result_rollback(result, m);
+        if (I0 >= to || in_error(r)) {
+            return false;
+        }
+        return alternative(from, to, i, r, result, st, size_sequence<Is...>());
+    }
+
+    template <size_t... Is>
+    combinator_alternatives(tuple_type const& ps, size_sequence<Is...>)
+        : ps(ps), table(first_sets<sizeof...(Parsers)> {{first_set_of(get<Is>(ps))...}}) {}
+
+    constexpr first_set first_of(size_sequence<>) const {
+        return first_set::none();
+    }
+
+    template <size_t I0, size_t... Is>
+    constexpr first_set first_of(size_sequence<I0, Is...>) const {
+        return first_set_of(get<I0>(ps)) | first_of(size_sequence<Is...>());
+    }
+
+    template <size_t... Is>
+    string names(unique_defs* defs, size_sequence<Is...>) const {
+        return concat(" | ", format_name(get<Is>(ps), 1, defs)...);
+    }
 
 public:
     using is_parser_type = true_type;
     using is_handle_type = false_type;
-    using has_side_effects = typename Parser::has_side_effects;
-    using result_type = typename Parser::result_type;
-    int const rank = 0;
-    char const* name;
+    using has_side_effects = integral_constant<bool, any_true<Parsers::has_side_effects::value...>::value>;
+    using result_type = Result;
+    int const rank = 1;
 
-    constexpr parser_ref(char const* name, Parser const* q) : p(q), name(name) {}
+    explicit combinator_alternatives(tuple_type const& ps)
+        : combinator_alternatives(ps, range<0, sizeof...(Parsers)>()) {}
 
     template <typename Iterator, typename Range, typename Inherit = default_inherited>
-    bool operator() (Iterator &i, Range const &r, result_type *result = nullptr, Inherit* st = nullptr) const {
-        return (*p)(i, r, result, st);
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        uint8_t const k = table(i, r);
+        if (k == table_type::none) {
+            note_failure(*this, i, r);
+            return false;
+        }
+        size_t const from = k & ~table_type::trial;
+        size_t const to = (k & table_type::trial) ? last : from;
+        return alternative(from, to, i, r, result, st, range<0, sizeof...(Parsers)>());
+    }
+
+    constexpr first_set first() const {
+        return first_of(range<0, sizeof...(Parsers)>());
     }
 
     string ebnf(unique_defs* defs = nullptr) const {
-        if (defs != nullptr) {
-            auto i = defs->find(name);
-            if (i == defs->end()) {
-                auto i = (defs->emplace(name, name)).first;
-                string const n = p->ebnf(defs);
-                i->second = n;
-            }
-        }
-        return name;
+        return names(defs, range<0, sizeof...(Parsers)>());
     }
 };
 
-template <typename P, typename = typename P::is_parser_type>
-constexpr parser_ref<P> reference(char const* name, P const* p) {
-    return parser_ref<P>(name, p);
-}
-
 //----------------------------------------------------------------------------
-// Fixed Point Parser, neater way to define simple recursive parsers.
+// Literal: a run of single symbols. As the sequence it replaces, it stops at
+// the first symbol that does not match.
 
-template <typename F> class parser_fix {
-    using parser_type = typename function_traits<F>::return_type;
-    parser_type const p;
+template <size_t N> class recogniser_literal {
+    template <size_t> friend class recogniser_literal;
+
+    char const s[N];
+
+    template <size_t... Is>
+    constexpr recogniser_literal(recogniser_literal<N - 1> const& l, char const c, size_sequence<Is...>)
+        : s {l.s[Is]..., c} {}
+
+    template <size_t... Is>
+    string names(size_sequence<Is...>) const {
+        return concat(", ", is_char(s[Is]).name()...);
+    }
 
 public:
     using is_parser_type = true_type;
     using is_handle_type = false_type;
-    using has_side_effects = typename parser_type::has_side_effects;
-    using result_type = typename parser_type::result_type;
+    using has_side_effects = false_type;
+    using result_type = string;
     int const rank = 0;
-    char const* name;
 
-    constexpr explicit parser_fix(char const* n, F f) : p(f(reference(n, &p))) , name(n) {}
+    constexpr explicit recogniser_literal(char const c) : s {c} {}
+
+    constexpr recogniser_literal(recogniser_literal<N - 1> const& l, char const c)
+        : recogniser_literal(l, c, range<0, N - 1>()) {}
 
     template <typename Iterator, typename Range, typename Inherit = default_inherited>
-    bool operator() (Iterator &i, Range const &r, result_type *result = nullptr, Inherit* st = nullptr) const {
-        return p(i, r, result, st);
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        string *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        Iterator const first = i;
+        for (size_t j = 0; j < N; ++j) {
+            if (i == r.last || static_cast<unsigned char>(*i) != static_cast<unsigned char>(s[j])) {
+                if (result != nullptr) {
+                    result->append(s, j);
+                }
+                note_failure(*this, first, r);
+                return false;
+            }
+            ++i;
+        }
+        if (result != nullptr) {
+            result->append(s, N);
+        }
+        return true;
+    }
+
+    constexpr first_set first() const {
+        return first_set(char_class::single(s[0]), false);
     }
 
     string ebnf(unique_defs* defs = nullptr) const {
-        string const n = p.ebnf(defs);
-        if (defs != nullptr) {
-            defs->emplace(name, n);
-        }
-        return name;
+        return names(range<0, N>());
     }
 };
 
-template <typename F> // , typename = typename function_traits<F>::result_type::is_parser_type>
-constexpr parser_fix<F> fix(char const* n, F f) {
-    return parser_fix<F>{n, f};
-}
-
-//============================================================================
-// Parser modifiers: are not visible in parser naming.
-
 //----------------------------------------------------------------------------
-// Discard the result of the parser (and the result type), keep succeed or fail.
+// One or more: a single loop. Repeated single symbols are scanned.
 
-template <typename Parser> class combinator_discard {
+template <typename Parser> class combinator_some {
     Parser const p;
 
 public:
     using is_parser_type = true_type;
     using is_handle_type = false_type;
     using has_side_effects = typename Parser::has_side_effects;
-    using result_type = void;
-    int const rank;
+    using result_type = typename Parser::result_type;
+    int const rank = 0;
 
-    constexpr explicit combinator_discard(Parser const& q)
-        : p(q), rank(q.rank) {}
+    constexpr explicit combinator_some(Parser const& p) : p(p) {}
 
     template <typename Iterator, typename Range, typename Inherit = default_inherited>
     bool operator() (
@@ -1237,38 +4890,42 @@ public:
         result_type *result = nullptr,
         Inherit* st = nullptr
     ) const {
-        typename Parser::result_type *const discard_result = nullptr;
-        return p(i, r, discard_result, st);
+        Iterator first = i;
+        bool matched = false;
+        while (p(i, r, result, st)) {
+            first = i;
+            matched = true;
+        }
+        if (!matched) {
+            return false;
+        } else if (first != i) {
+            return raise_error("failed many-parser consumed input", p, first, i, r);
+        }
+        return !in_error(r);
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p);
     }
 
     string ebnf(unique_defs* defs = nullptr) const {
-        return p.ebnf(defs);
+        return "{" + p.ebnf(defs) + "}-";
     }
 };
 
-template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
-    || is_same<typename P::is_handle_type, true_type>::value>::type>
-constexpr combinator_discard<P> const discard(P const& p) {
-    return combinator_discard<P>(p);
-}
-
-//----------------------------------------------------------------------------
-// Logging Parser
-
-template <typename Parser> 
-class parser_log {
+template <typename Predicate> class combinator_some<recogniser_accept<Predicate>> {
+    using Parser = recogniser_accept<Predicate>;
     Parser const p;
-    string const msg;
+    combinator_many<Parser> const rest;
 
 public:
     using is_parser_type = true_type;
     using is_handle_type = false_type;
-    using has_side_effects = typename Parser::has_side_effects;
-    using result_type = typename Parser::result_type;
-    int const rank;
+    using has_side_effects = false_type;
+    using result_type = string;
+    int const rank = 0;
 
-    constexpr explicit parser_log(string const& s, Parser const& q)
-        : p(q), msg(s), rank(q.rank) {}
+    constexpr explicit combinator_some(Parser const& p) : p(p), rest(p) {}
 
     template <typename Iterator, typename Range, typename Inherit = default_inherited>
     bool operator() (
@@ -1277,329 +4934,405 @@ public:
         result_type *result = nullptr,
         Inherit* st = nullptr
     ) const {
-        Iterator const x = i;
+        return p(i, r, result, st) && rest(i, r, result, st);
+    }
 
-        bool const b = p(i, r, result, st);
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
 
-#ifdef DEBUG
-        if (b) {
-            cout << msg << ": ";
+    string ebnf(unique_defs* defs = nullptr) const {
+        return "{" + p.ebnf(defs) + "}-";
+    }
+};
 
-            if (result != nullptr) {
-                cout << *result;
-            }
+//----------------------------------------------------------------------------
+// The rewrite rules. Each rule has the type of the rewritten parser, and a
+// function to rewrite a parser of that kind.
 
-            cout << " @" << (x - r.first) << " - " << (i - r.first) << "\n";
-        }
-#endif
+struct grammar_rewrite {
+    template <typename P> static constexpr auto parser(P const& x) -> decltype((x.p)) {
+        return x.p;
+    }
 
-        return b;
+    template <typename P> static constexpr auto left(P const& x) -> decltype((x.p1)) {
+        return x.p1;
     }
 
-    string ebnf(unique_defs* defs = nullptr) const {
-        return p.ebnf(defs);
+    template <typename P> static constexpr auto right(P const& x) -> decltype((x.p2)) {
+        return x.p2;
+    }
+
+    template <typename P> static constexpr auto parsers(P const& x) -> decltype((x.ps)) {
+        return x.ps;
+    }
+
+    template <typename P> static constexpr auto functor(P const& x) -> decltype((x.f)) {
+        return x.f;
+    }
+
+    template <typename P> static constexpr auto name(P const& x) -> decltype((x.n)) {
+        return x.n;
+    }
+
+    template <typename P> static constexpr auto error(P const& x) -> decltype((x.err)) {
+        return x.err;
+    }
+
+    template <typename P> static constexpr auto message(P const& x) -> decltype((x.msg)) {
+        return x.msg;
+    }
+
+    template <typename P> static constexpr auto except(P const& x) -> decltype((x.x)) {
+        return x.x;
+    }
+
+    template <typename P> static constexpr auto predicate(P const& x) -> decltype((x.p)) {
+        return x.p;
+    }
+
+    static constexpr char symbol(is_char const& x) {
+        return static_cast<char>(x.k);
     }
 };
 
-template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
-    || is_same<typename P::is_handle_type, true_type>::value>::type>
-constexpr parser_log<P> log(string const& s, P const& p) {
-    return parser_log<P>(s, p);
-}
+template <typename Parser, typename = void> struct optimise_rule {
+    using type = Parser;
+
+    static constexpr type run(Parser const& p) {
+        return p;
+    }
+};
+
+template <typename P> using optimised = typename optimise_rule<P>::type;
 
 //----------------------------------------------------------------------------
-// Backtracking Parser
+// Lists of parsers, kept in tuples. Pushing a parser onto a list merges it
+// with the last one when Merge<Last, Parser> allows.
 
-template <typename Parser>
-class parser_try {
-    Parser const p;
+template <typename... Ts> struct last_type {
+    using type = void;
+};
 
-public:
-    using is_parser_type = true_type;
-    using is_handle_type = false_type;
-    using has_side_effects = typename Parser::has_side_effects;
-    using result_type = typename Parser::result_type;
-    int const rank;
+template <typename T> struct last_type<T> {
+    using type = T;
+};
+
+template <typename T, typename... Ts> struct last_type<T, Ts...> {
+    using type = typename last_type<Ts...>::type;
+};
+
+template <size_t... Is> constexpr size_sequence<Is...> indices(size_sequence<Is...>) {
+    return size_sequence<Is...>();
+}
+
+template <typename List, typename Sequence, typename X> struct replace_last;
+
+template <typename... Ts, size_t... Is, typename X> struct replace_last<tuple<Ts...>, size_sequence<Is...>, X> {
+    using type = tuple<typename tuple_element<Is, tuple<Ts...>>::type..., X>;
+};
+
+template <template <typename, typename> class Merge, typename List, typename P, typename = void>
+struct push_list;
+
+template <template <typename, typename> class Merge, typename... Ts, typename P>
+struct push_list<Merge, tuple<Ts...>, P, typename enable_if<
+    !Merge<typename last_type<Ts...>::type, P>::value>::type> {
+    using type = tuple<Ts..., P>;
+
+    template <size_t... Is>
+    static constexpr type run(tuple<Ts...> const& l, P const& p, size_sequence<Is...>) {
+        return type(get<Is>(l)..., p);
+    }
+
+    static constexpr type run(tuple<Ts...> const& l, P const& p) {
+        return run(l, p, range<0, sizeof...(Ts)>());
+    }
+};
+
+template <template <typename, typename> class Merge, typename... Ts, typename P>
+struct push_list<Merge, tuple<Ts...>, P, typename enable_if<
+    Merge<typename last_type<Ts...>::type, P>::value>::type> {
+    using merge = Merge<typename last_type<Ts...>::type, P>;
+    using type = typename replace_last<tuple<Ts...>, decltype(indices(range<0, sizeof...(Ts) - 1>())),
+        typename merge::type>::type;
+
+    template <size_t... Is>
+    static constexpr type run(tuple<Ts...> const& l, P const& p, size_sequence<Is...>) {
+        return type(get<Is>(l)..., merge::run(get<sizeof...(Ts) - 1>(l), p));
+    }
+
+    static constexpr type run(tuple<Ts...> const& l, P const& p) {
+        return run(l, p, range<0, sizeof...(Ts) - 1>());
+    }
+};
+
+template <template <typename, typename> class Merge, typename Left, typename Right> struct join_lists;
+
+template <template <typename, typename> class Merge, typename Left>
+struct join_lists<Merge, Left, tuple<>> {
+    using type = Left;
+
+    static constexpr type run(Left const& l, tuple<> const&) {
+        return l;
+    }
+};
+
+template <template <typename, typename> class Merge, typename Left, typename P, typename... Ps>
+struct join_lists<Merge, Left, tuple<P, Ps...>> {
+    using push = push_list<Merge, Left, P>;
+    using rest = join_lists<Merge, typename push::type, tuple<Ps...>>;
+    using type = typename rest::type;
+
+    template <size_t... Is>
+    static constexpr tuple<Ps...> tail(tuple<P, Ps...> const& r, size_sequence<Is...>) {
+        return tuple<Ps...>(get<Is + 1>(r)...);
+    }
 
-    constexpr explicit parser_try(Parser const& q) : p(q), rank(q.rank) {}
+    static constexpr type run(Left const& l, tuple<P, Ps...> const& r) {
+        return rest::run(push::run(l, get<0>(r)), tail(r, range<0, sizeof...(Ps)>()));
+    }
+};
 
-    template <typename Iterator, typename Range, typename Inherit = default_inherited>
-    bool operator() (
-        Iterator &i,
-        Range const &r,
-        result_type *result = nullptr,
-        Inherit* st = nullptr
-    ) const {
-        Iterator const first = i;
-        if (p(i, r, result, st)) {
-            return true;
-        } 
-        i = first;
-        return false;
+// a list of one parser is that parser, otherwise it is wrapped by Make.
+template <template <typename, typename...> class Make, typename Result, typename List>
+struct make_list;
+
+template <template <typename, typename...> class Make, typename Result, typename... Ps>
+struct make_list<Make, Result, tuple<Ps...>> {
+    using type = Make<Result, Ps...>;
+
+    static constexpr type run(tuple<Ps...> const& l) {
+        return type(l);
     }
+};
 
-    string ebnf(unique_defs* defs = nullptr) const {
-        return p.ebnf(defs);
+template <template <typename, typename...> class Make, typename Result, typename P>
+struct make_list<Make, Result, tuple<P>> {
+    using type = P;
+
+    static constexpr type run(tuple<P> const& l) {
+        return get<0>(l);
     }
 };
 
-template <typename Parser>
-class parser_try_side {
-    Parser const p;
+//----------------------------------------------------------------------------
+// Choices: adjacent single symbol alternatives are merged.
 
-public:
-    using is_parser_type = true_type;
-    using is_handle_type = false_type;
-    using has_side_effects = typename Parser::has_side_effects;
-    using result_type = typename Parser::result_type;
-    int const rank;
+template <typename P1, typename P2> struct merge_alternative {
+    static constexpr bool value = false;
+};
 
-    constexpr explicit parser_try_side(Parser const& q) : p(q), rank(q.rank) {}
+template <typename A, typename B> struct merge_alternative<recogniser_accept<A>, recogniser_accept<B>> {
+    static constexpr bool value = true;
+    using type = recogniser_accept<is_either<A, B>>;
 
-    template <typename Iterator, typename Range, typename Inherit = default_inherited>
-    bool operator() (
-        Iterator &i,
-        Range const &r,
-        result_type *result = nullptr,
-        Inherit* st = nullptr
-    ) const {
-        Iterator const first = i;
-        Inherit inh;
-        if (st != nullptr) {
-            inh = *st;
-        }
-        if (p(i, r, result, st)) {
-            return true;
-        } 
-        i = first;
-        if (st != nullptr) {
-            *st = inh;
-        }
-        return false;
+    static constexpr type run(recogniser_accept<A> const& a, recogniser_accept<B> const& b) {
+        return type(is_either<A, B>(grammar_rewrite::predicate(a), grammar_rewrite::predicate(b)));
     }
+};
 
-    string ebnf(unique_defs* defs = nullptr) const {
-        return p.ebnf(defs);
+template <typename P> struct alternatives_of {
+    using type = tuple<optimised<P>>;
+
+    static constexpr type run(P const& p) {
+        return type(optimise_rule<P>::run(p));
     }
 };
 
-template <typename P, typename = typename enable_if<
-    (
-        is_same<typename P::is_parser_type, true_type>::value
-        || is_same<typename P::is_handle_type, true_type>::value
-    ) && is_same<typename P::has_side_effects, false_type>::value
->::type>
-constexpr parser_try<P> attempt(P const& p) {
-    return parser_try<P>(p);
-}
+template <typename P1, typename P2> struct alternatives_of<combinator_choice<P1, P2>> {
+    using join = join_lists<merge_alternative,
+        typename alternatives_of<P1>::type, typename alternatives_of<P2>::type>;
+    using type = typename join::type;
 
-template <typename P, typename = typename enable_if<
-    (
-        is_same<typename P::is_parser_type, true_type>::value
-        || is_same<typename P::is_handle_type, true_type>::value
-    ) && is_same<typename P::has_side_effects, true_type>::value
->::type>
-constexpr parser_try_side<P> attempt(P const& p) {
-    return parser_try_side<P>(p);
-}
+    static constexpr type run(combinator_choice<P1, P2> const& p) {
+        return join::run(alternatives_of<P1>::run(grammar_rewrite::left(p)),
+            alternatives_of<P2>::run(grammar_rewrite::right(p)));
+    }
+};
 
 //----------------------------------------------------------------------------
-// Convert fail to error
+// Sequences: adjacent single characters are merged into literals.
 
-template <typename Parser>
-class parser_strict {
-    Parser const p;
-    char const* err;
+template <typename P1, typename P2> struct merge_sequence {
+    static constexpr bool value = false;
+};
 
-public:
-    using is_parser_type = true_type;
-    using is_handle_type = false_type;
-    using has_side_effects = typename Parser::has_side_effects;
-    using result_type = typename Parser::result_type;
-    int const rank;
+template <> struct merge_sequence<recogniser_accept<is_char>, recogniser_accept<is_char>> {
+    static constexpr bool value = true;
+    using type = recogniser_literal<2>;
 
-    constexpr parser_strict(char const* s, Parser const& q) : p(q), err(s), rank(q.rank) {}
+    static constexpr type run(recogniser_accept<is_char> const& a, recogniser_accept<is_char> const& b) {
+        return type(recogniser_literal<1>(grammar_rewrite::symbol(grammar_rewrite::predicate(a))),
+            grammar_rewrite::symbol(grammar_rewrite::predicate(b)));
+    }
+};
 
-    template <typename Iterator, typename Range, typename Inherit = default_inherited>
-    bool operator() (
-        Iterator &i,
-        Range const &r,
-        result_type *result = nullptr,
-        Inherit* st = nullptr
-    ) const {
-        Iterator const first = i;
-        if (!p(i, r, result, st)) {
-            throw parse_error(err, p, first, i, r);
-        }
-        return true;
+template <size_t N> struct merge_sequence<recogniser_literal<N>, recogniser_accept<is_char>> {
+    static constexpr bool value = true;
+    using type = recogniser_literal<N + 1>;
+
+    static constexpr type run(recogniser_literal<N> const& a, recogniser_accept<is_char> const& b) {
+        return type(a, grammar_rewrite::symbol(grammar_rewrite::predicate(b)));
     }
+};
 
-    string ebnf(unique_defs* defs = nullptr) const {
-        return p.ebnf(defs);
+template <typename P> struct sequence_of {
+    using type = tuple<optimised<P>>;
+
+    static constexpr type run(P const& p) {
+        return type(optimise_rule<P>::run(p));
     }
 };
 
-template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
-    || is_same<typename P::is_handle_type, true_type>::value>::type>
-constexpr parser_strict<P> strict(char const* s, P const& p) {
-    return parser_strict<P>(s, p);
-}
+template <typename P1, typename P2> struct sequence_of<combinator_sequence<P1, P2>> {
+    using join = join_lists<merge_sequence,
+        typename sequence_of<P1>::type, typename sequence_of<P2>::type>;
+    using type = typename join::type;
+
+    static constexpr type run(combinator_sequence<P1, P2> const& p) {
+        return join::run(sequence_of<P1>::run(grammar_rewrite::left(p)),
+            sequence_of<P2>::run(grammar_rewrite::right(p)));
+    }
+};
 
 //----------------------------------------------------------------------------
-// Name a parser (for better error readability)
+// Rewrite rules for each kind of parser.
 
-template <typename Parser, typename Name>
-class parser_name {
-    Parser const p;
-    Name const n;
+template <typename P1, typename P2> struct optimise_rule<combinator_choice<P1, P2>> {
+    using list = alternatives_of<combinator_choice<P1, P2>>;
+    using make = make_list<combinator_alternatives,
+        typename combinator_choice<P1, P2>::result_type, typename list::type>;
+    using type = typename make::type;
 
-public:
-    using is_parser_type = true_type;
-    using is_handle_type = false_type;
-    using has_side_effects = typename Parser::has_side_effects;
-    using result_type = typename Parser::result_type;
-    int const rank;
+    static constexpr type run(combinator_choice<P1, P2> const& p) {
+        return make::run(list::run(p));
+    }
+};
 
-    constexpr parser_name(Name&& m, int r, Parser const& q)
-        : p(q), n(forward<Name>(m)), rank(r) {}
+template <typename P1, typename P2> struct optimise_rule<combinator_sequence<P1, P2>> {
+    using list = sequence_of<combinator_sequence<P1, P2>>;
+    using make = make_list<combinator_chain,
+        typename combinator_sequence<P1, P2>::result_type, typename list::type>;
+    using type = typename make::type;
 
-    template <typename Iterator, typename Range, typename Inherit>
-    bool operator() (
-        Iterator &i,
-        Range const &r,
-        result_type *result = nullptr,
-        Inherit* st = nullptr
-    ) const {
-        return p(i, r, result, st);
+    static constexpr type run(combinator_sequence<P1, P2> const& p) {
+        return make::run(list::run(p));
     }
+};
 
-    string ebnf(unique_defs* defs = nullptr) const {
-        return n(defs);
+template <typename P> struct optimise_rule<combinator_many<P>> {
+    using type = combinator_many<optimised<P>>;
+
+    static constexpr type run(combinator_many<P> const& p) {
+        return type(optimise_rule<P>::run(grammar_rewrite::parser(p)));
     }
 };
 
-template <typename P, typename N, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
-    || is_same<typename P::is_handle_type, true_type>::value>::type>
-constexpr parser_name<P, N> rename(N&& n, int r, P const& p) {
-    return parser_name<P, N>(forward<N>(n), r, p);
-}
+template <typename P> struct optimise_rule<combinator_except<P>> {
+    using type = combinator_except<optimised<P>>;
 
-//----------------------------------------------------------------------------
-// Define a sub-parser (for better error readability)
+    static constexpr type run(combinator_except<P> const& p) {
+        return type(grammar_rewrite::except(p), optimise_rule<P>::run(grammar_rewrite::parser(p)));
+    }
+};
 
-template <typename Parser>
-class parser_def {
-    Parser const p;
+template <typename P> struct optimise_rule<combinator_discard<P>> {
+    using type = combinator_discard<optimised<P>>;
 
-public:
-    using is_parser_type = true_type;
-    using is_handle_type = false_type;
-    using has_side_effects = typename Parser::has_side_effects;
-    using result_type = typename Parser::result_type;
-    int const rank;
-    char const* name;
+    static constexpr type run(combinator_discard<P> const& p) {
+        return type(optimise_rule<P>::run(grammar_rewrite::parser(p)));
+    }
+};
 
-    constexpr parser_def(char const* n, Parser const& q)
-        : p(q), rank(q.rank), name(n) {}
+template <typename P> struct optimise_rule<parser_log<P>> {
+    using type = parser_log<optimised<P>>;
 
-    template <typename Iterator, typename Range, typename Inherit>
-    bool operator() (
-        Iterator &i,
-        Range const &r,
-        result_type *result = nullptr,
-        Inherit* st = nullptr
-    ) const {
-        return p(i, r, result, st);
-    }
-    
-    string ebnf(unique_defs* defs = nullptr) const {
-        string const n = p.ebnf(defs);
-        if (defs != nullptr) {
-            defs->emplace(name, n);
-        }
-        return name;
+    static type run(parser_log<P> const& p) {
+        return type(grammar_rewrite::message(p), optimise_rule<P>::run(grammar_rewrite::parser(p)));
     }
 };
 
-template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
-    || is_same<typename P::is_handle_type, true_type>::value>::type>
-constexpr parser_def<P> define(char const* s, P const& p) {
-    return parser_def<P>(s, p);
-}
+template <typename P> struct optimise_rule<parser_try<P>> {
+    using type = parser_try<optimised<P>>;
 
-//============================================================================
-// Some derived definitions for convenience: option, some
+    static constexpr type run(parser_try<P> const& p) {
+        return type(optimise_rule<P>::run(grammar_rewrite::parser(p)));
+    }
+};
 
-//----------------------------------------------------------------------------
-// Optionally accept the parser once.
+template <typename P> struct optimise_rule<parser_try_side<P>> {
+    using type = parser_try_side<optimised<P>>;
 
-template <typename Parser> struct option_name {
-    Parser const p;
-    constexpr option_name(Parser const& q) : p(q) {}
-    string operator() (unique_defs* defs = nullptr) const {
-        return "[" + p.ebnf(defs) + "]";
+    static constexpr type run(parser_try_side<P> const& p) {
+        return type(optimise_rule<P>::run(grammar_rewrite::parser(p)));
     }
 };
 
-template <typename P> constexpr auto option(P const& p)
--> decltype(rename(option_name<P>(p), 0, p || succ)) {
-    return rename(option_name<P>(p), 0, p || succ);
-}
+template <typename P> struct optimise_rule<parser_strict<P>> {
+    using type = parser_strict<optimised<P>>;
 
-//----------------------------------------------------------------------------
-// Accept the parser one or more times.
+    static constexpr type run(parser_strict<P> const& p) {
+        return type(grammar_rewrite::error(p), optimise_rule<P>::run(grammar_rewrite::parser(p)));
+    }
+};
 
-template <typename Parser> struct some_name {
-    Parser const p;
-    constexpr some_name(Parser const& q) : p(q) {}
-    string operator() (unique_defs* defs = nullptr) const {
-        return "{" + p.ebnf(defs) + "}-";
+template <typename P> struct optimise_rule<parser_def<P>> {
+    using type = parser_def<optimised<P>>;
+
+    static constexpr type run(parser_def<P> const& p) {
+        return type(p.name, optimise_rule<P>::run(grammar_rewrite::parser(p)));
     }
 };
 
-template <typename P> constexpr auto some(P const& p)
--> decltype(rename(some_name<P>(p), 0, p && many(p))) {
-    return rename(some_name<P>(p), 0, p && many(p));
-}
+template <typename P, typename N> struct optimise_rule<parser_name<P, N>> {
+    using type = parser_name<optimised<P>, N>;
 
-//----------------------------------------------------------------------------
-// Accept one parser separated by another
+    static constexpr type run(parser_name<P, N> const& p) {
+        return type(N(grammar_rewrite::name(p)), p.rank, optimise_rule<P>::run(grammar_rewrite::parser(p)));
+    }
+};
 
-template <typename P, typename Q> struct sepby_name {
-    P const p;
-    Q const q;
-    constexpr sepby_name(P const& p, Q const& q) : p(p), q(q) {}
-    string operator() (unique_defs* defs = nullptr) const {
-        return p.ebnf(defs) + ", {" + q.ebnf(defs) + ", " + p.ebnf() + "}";
+// some(p) is named p && many(p).
+template <typename P> struct optimise_rule<parser_name<combinator_sequence<P, combinator_many<P>>, some_name<P>>> {
+    using type = parser_name<combinator_some<optimised<P>>, some_name<P>>;
+
+    static constexpr type run(parser_name<combinator_sequence<P, combinator_many<P>>, some_name<P>> const& p) {
+        return type(some_name<P>(grammar_rewrite::name(p)), p.rank, combinator_some<optimised<P>>(
+            optimise_rule<P>::run(grammar_rewrite::left(grammar_rewrite::parser(p)))));
     }
 };
 
-template <typename P, typename Q> constexpr auto sep_by(P const& p, Q const& q)
--> decltype (rename(sepby_name<P, Q>(p, q), 0, p && many(discard(q) && p))) {
-    return rename(sepby_name<P, Q>(p, q), 0, p && many(discard(q) && p));
-}
+template <typename F, typename... Ps> struct optimise_rule<fmap_choice<F, Ps...>> {
+    using type = fmap_choice<F, optimised<Ps>...>;
 
-//----------------------------------------------------------------------------
-// Lazy Tokenisation, by skipping the whitespace after each token we leave 
-// the input stream in a position where parsers can fail on the first
-// character without requiring backtracking. This requires using the 
-// "first_token" parser as the first parser to initialise lazy tokenization
-// properly.
+    template <size_t... Is>
+    static constexpr type run(fmap_choice<F, Ps...> const& p, size_sequence<Is...>) {
+        return type(grammar_rewrite::functor(p), optimise_rule<Ps>::run(get<Is>(grammar_rewrite::parsers(p)))...);
+    }
 
-// skip to start of first token.
-constexpr auto first_token = discard(many(accept(is_space)));
+    static constexpr type run(fmap_choice<F, Ps...> const& p) {
+        return run(p, range<0, sizeof...(Ps)>());
+    }
+};
 
-template <typename Parser> struct tok_name {
-    Parser const p;
-    constexpr tok_name(Parser const& q) : p(q) {}
-    string operator() (unique_defs* defs = nullptr) const {
-        return p.ebnf(defs);
+template <typename F, typename... Ps> struct optimise_rule<fmap_sequence<F, Ps...>> {
+    using type = fmap_sequence<F, optimised<Ps>...>;
+
+    template <size_t... Is>
+    static constexpr type run(fmap_sequence<F, Ps...> const& p, size_sequence<Is...>) {
+        return type(grammar_rewrite::functor(p), optimise_rule<Ps>::run(get<Is>(grammar_rewrite::parsers(p)))...);
+    }
+
+    static constexpr type run(fmap_sequence<F, Ps...> const& p) {
+        return run(p, range<0, sizeof...(Ps)>());
     }
 };
 
-template <typename R> constexpr auto tokenise(R const& r)
--> decltype(rename(tok_name<R>(r), 0, r && first_token)) {
-    return rename(tok_name<R>(r), 0, r && first_token);
+template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type>
+constexpr optimised<P> optimise(P const& p) {
+    return optimise_rule<P>::run(p);
 }
 
 #endif // PARSER_COMBINATORS_HPP
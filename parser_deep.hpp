@@ -0,0 +1,147 @@
+//----------------------------------------------------------------------------
+// copyright 2014 Keean Schupke
+// compile with -std=c++11
+// parser_deep.hpp
+
+#ifndef PARSER_DEEP_HPP
+#define PARSER_DEEP_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <exception>
+#include <system_error>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "parser_combinators.hpp"
+
+using namespace std;
+
+//============================================================================
+// Deep Parsers
+//
+// Running a parser on a separate stack, see Deep Recursion in
+// "parser_combinators.hpp". This needs POSIX contexts and mmap, so it is kept
+// out of the core header.
+
+// A stack for a separate context, with a guard page at the end it grows
+// towards.
+class context_stack {
+    size_t const n;
+    char* const base;
+
+public:
+    explicit context_stack(size_t const n) : n(n), base(static_cast<char*>(mmap(nullptr, n,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0))) {
+        if (base == MAP_FAILED) {
+            throw bad_alloc();
+        }
+        if (mprotect(base, sysconf(_SC_PAGESIZE), PROT_NONE) != 0) {
+            int const e = errno;
+            munmap(base, n);
+            throw system_error(e, system_category(), "unable to protect the stack guard page");
+        }
+    }
+
+    ~context_stack() {
+        munmap(base, n);
+    }
+
+    context_stack(context_stack const&) = delete;
+    context_stack& operator= (context_stack const&) = delete;
+
+    char* data() const {
+        return base;
+    }
+
+    size_t size() const {
+        return n;
+    }
+};
+
+template <typename Parser> class parser_deep {
+    Parser const p;
+    size_t const limit;
+    size_t const size;
+
+    template <typename Iterator, typename Range, typename Inherit> struct call {
+        parser_deep const& d;
+        Iterator& i;
+        Range const& r;
+        typename Parser::result_type* result;
+        Inherit* st;
+        bool success;
+        exception_ptr error;
+        ucontext_t caller;
+        ucontext_t callee;
+
+        // makecontext only passes ints, so the call is split in two.
+        static void entry(unsigned const hi, unsigned const lo) {
+            call& c = *reinterpret_cast<call*>((static_cast<uintptr_t>(hi) << 16 << 16) | lo);
+            recursion_depth depth(c.d.limit);
+            recursion_depth* const outer = recursion_depth::current();
+            recursion_depth::current() = &depth;
+            try {
+                c.success = c.d.p(c.i, c.r, c.result, c.st);
+            } catch (...) {
+                c.error = current_exception();
+            }
+            recursion_depth::current() = outer;
+            swapcontext(&c.callee, &c.caller);
+        }
+    };
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = typename Parser::has_side_effects;
+    using result_type = typename Parser::result_type;
+    int const rank;
+
+    constexpr parser_deep(Parser const& q, size_t const limit, size_t const size)
+        : p(q), limit(limit), size(size), rank(q.rank) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const {
+        if (recursion_depth::current() != nullptr) {
+            return p(i, r, result, st);
+        }
+        using call_type = call<Iterator, Range, Inherit>;
+        context_stack const s(size);
+        call_type c {*this, i, r, result, st, false};
+        uintptr_t const a = reinterpret_cast<uintptr_t>(&c);
+        getcontext(&c.callee);
+        c.callee.uc_stack.ss_sp = s.data();
+        c.callee.uc_stack.ss_size = size;
+        c.callee.uc_link = nullptr;
+        makecontext(&c.callee, reinterpret_cast<void (*)()>(call_type::entry), 2,
+            static_cast<unsigned>(a >> 16 >> 16), static_cast<unsigned>(a));
+        swapcontext(&c.caller, &c.callee);
+        if (c.error) {
+            rethrow_exception(c.error);
+        }
+        return c.success;
+    }
+
+    constexpr first_set first() const {
+        return first_set_of(p);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return p.ebnf(defs);
+    }
+};
+
+// allow nesting 'limit' deep, on a stack of 'size' bytes (reserved, not used).
+template <typename P, typename = typename enable_if<is_same<typename P::is_parser_type, true_type>::value
+    || is_same<typename P::is_handle_type, true_type>::value>::type>
+constexpr parser_deep<P> deep(P const& p, size_t const limit = 100000, size_t const size = size_t(1) << 30) {
+    return parser_deep<P>(p, limit, size);
+}
+
+#endif // PARSER_DEEP_HPP
@@ -0,0 +1,1168 @@
+//----------------------------------------------------------------------------
+// copyright 2014 Keean Schupke
+// compile with -std=c++11
+// parser_vm.hpp
+
+#ifndef PARSER_VM_HPP
+#define PARSER_VM_HPP
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "parser_combinators.hpp"
+
+using namespace std;
+
+//============================================================================
+// Parsing Machine
+//
+// A grammar that is only known at run time, written in the EBNF dialect that
+// ebnf() prints, is compiled into bytecode for a small backtracking machine
+// in the style of LPeg. The machine keeps the same semantics as the template
+// combinators: a failed alternative or many-iteration that consumed input is
+// an error, 'attempt' restores the input, 'strict' turns failure into an
+// error and 'token' skips trailing space. Choices and loops test the next
+// symbol against the FIRST set of what follows before pushing a backtrack
+// entry, and runs of a character class use the span scanner. The backtrack
+// stack is on the heap, so nesting is limited by size rather than by the
+// native stack.
+//
+// The dialect:
+//
+//     rule = expression ;             (a grammar is one or more rules)
+//     a | b    a, b    (a)    [a]    {a}    {a}-
+//     "literal"    'c'    name    a - "literal"    class - class
+//     attempt(a)    strict("message", a)    token(a)
+//
+// The character classes are the predicate names (digit, space, anything,
+// ...), 'c' and EOF, combined with '|' and '-'. The rules 'integer',
+// 'natural' and 'real' have their usual definitions unless redefined, and
+// (* comments *) are ignored.
+
+//----------------------------------------------------------------------------
+// Grammar syntax tree
+
+struct vm_node {
+    enum kind_type {symbols, literal, sequence, alternative, many, some, option,
+        reference, except, attempt, strict, token, succeed, fail};
+
+    kind_type kind;
+    string text;         // spelling of a class, literal, rule name or message
+    uint64_t bits[4];    // the class
+    bool eof;
+    uint32_t rule;       // the referenced rule
+    ptrdiff_t at;        // offset in the grammar source
+    vector<vm_node> nodes;
+
+    vm_node(kind_type const k, ptrdiff_t const at) : kind(k), bits {0, 0, 0, 0},
+        eof(false), rule(0), at(at) {}
+
+    vm_node(char_class const& c, string const& s, ptrdiff_t const at) : kind(symbols),
+        text(s), bits {c.bits[0], c.bits[1], c.bits[2], c.bits[3]}, eof(c.eof),
+        rule(0), at(at) {}
+
+    char_class symbol_class() const {
+        return char_class(bits[0], bits[1], bits[2], bits[3], eof);
+    }
+
+    int rank() const {
+        return (kind == alternative) ? 1 : 0;
+    }
+};
+
+//----------------------------------------------------------------------------
+// A parsed grammar, immutable once loaded and shared by the compiled program
+// and the error sites that describe it.
+
+class vm_grammar {
+    struct source {
+        using iterator = char const*;
+        iterator const first;
+        iterator const last;
+    };
+
+    // what the reader expected.
+    struct expected {
+        char const* what;
+        string ebnf(unique_defs* defs = nullptr) const {
+            return what;
+        }
+    };
+
+    source const src;
+    char const* i;
+
+    [[noreturn]] void error(char const* what, char const* exp, char const* f) const {
+        throw parse_error(what, expected {exp}, f, i, src);
+    }
+
+    void skip() {
+        for (;;) {
+            while (i != src.last && is_space(*i)) {
+                ++i;
+            }
+            if (src.last - i >= 2 && i[0] == '(' && i[1] == '*') {
+                char const* const f = i;
+                for (i += 2; i != src.last && !(i[0] == '*' && i + 1 != src.last && i[1] == ')'); ++i) {}
+                if (i == src.last) {
+                    error("unterminated comment", "\"*)\"", f);
+                }
+                i += 2;
+            } else {
+                return;
+            }
+        }
+    }
+
+    bool next(char const c) {
+        skip();
+        if (i != src.last && *i == c) {
+            ++i;
+            return true;
+        }
+        return false;
+    }
+
+    void need(char const c, char const* exp) {
+        if (!next(c)) {
+            error("syntax error in grammar", exp, i);
+        }
+    }
+
+    ptrdiff_t offset() const {
+        return i - src.first;
+    }
+
+    char escaped() {
+        char const c = *i++;
+        if (c != '\\' || i == src.last) {
+            return c;
+        }
+        switch (char const e = *i++) {
+            case 'n': return '\n';
+            case 't': return '\t';
+            case 'r': return '\r';
+            default: return e;
+        }
+    }
+
+    string name() {
+        skip();
+        char const* const f = i;
+        while (i != src.last && (is_alnum(*i) || *i == '_')) {
+            ++i;
+        }
+        if (f == i || is_digit(*f)) {
+            error("syntax error in grammar", "name", f);
+        }
+        return string(f, i);
+    }
+
+    string quoted() {
+        char const* const f = i;
+        string s;
+        while (i != src.last && *i != '"') {
+            s.push_back(escaped());
+        }
+        if (i == src.last) {
+            error("unterminated string", "'\"'", f);
+        }
+        ++i;
+        return s;
+    }
+
+    static char_class const* predicate(string const& n) {
+        static map<string, char_class> const classes {
+            {"anything", char_class(is_any)}, {"alphanumeric", char_class(is_alnum)},
+            {"alphabetic", char_class(is_alpha)}, {"blank", char_class(is_blank)},
+            {"control", char_class(is_cntrl)}, {"digit", char_class(is_digit)},
+            {"graphic", char_class(is_graph)}, {"lowercase", char_class(is_lower)},
+            {"printable", char_class(is_print)}, {"punctuation", char_class(is_punct)},
+            {"space", char_class(is_space)}, {"uppercase", char_class(is_upper)},
+            {"hexdigit", char_class(is_xdigit)}, {"EOL", char_class(is_eol)},
+            {"EOF", char_class(is_eof)}
+        };
+        auto const j = classes.find(n);
+        return (j == classes.end()) ? nullptr : &(j->second);
+    }
+
+    vm_node primary() {
+        skip();
+        ptrdiff_t const at = offset();
+        if (i == src.last) {
+            error("syntax error in grammar", "expression", i);
+        }
+        char const c = *i;
+        if (c == '(' || c == '[' || c == '{') {
+            ++i;
+            vm_node n = expression();
+            if (c == '(') {
+                need(')', "')'");
+                return n;
+            }
+            vm_node m(vm_node::option, at);
+            if (c == '[') {
+                need(']', "']'");
+            } else {
+                need('}', "'}'");
+                m.kind = vm_node::many;
+                if (i != src.last && *i == '-') {
+                    ++i;
+                    m.kind = vm_node::some;
+                }
+            }
+            m.nodes.push_back(move(n));
+            return m;
+        } else if (c == '"') {
+            ++i;
+            vm_node n(vm_node::literal, at);
+            n.text = quoted();
+            return n;
+        } else if (c == '\'') {
+            char const* const f = i++;
+            if (i == src.last) {
+                error("syntax error in grammar", "symbol", i);
+            }
+            char const k = escaped();
+            if (i == src.last || *i != '\'') {
+                error("syntax error in grammar", "'''", i);
+            }
+            ++i;
+            return vm_node(char_class::single(k), string(f, i), at);
+        }
+        string const n = name();
+        vm_node::kind_type const k = (n == "attempt") ? vm_node::attempt
+            : (n == "strict") ? vm_node::strict : (n == "token") ? vm_node::token
+            : vm_node::reference;
+        if (k != vm_node::reference && next('(')) {
+            vm_node m(k, at);
+            if (k == vm_node::strict) {
+                need('"', "message");
+                m.text = quoted();
+                need(',', "','");
+            }
+            m.nodes.push_back(expression());
+            need(')', "')'");
+            return m;
+        }
+        if (char_class const* const cls = predicate(n)) {
+            return vm_node(*cls, n, at);
+        }
+        vm_node m(vm_node::reference, at);
+        m.text = n;
+        return m;
+    }
+
+    vm_node term() {
+        vm_node n = primary();
+        while (next('-')) {
+            vm_node x = primary();
+            if (x.kind == vm_node::literal) {
+                vm_node m(vm_node::except, n.at);
+                m.text = x.text;
+                m.nodes.push_back(move(n));
+                n = move(m);
+            } else if (n.kind == vm_node::symbols && x.kind == vm_node::symbols) {
+                for (int k = 0; k < 4; ++k) {
+                    n.bits[k] &= ~x.bits[k];
+                }
+                n.eof = n.eof && !x.eof;
+                n.text += " - " + ((x.text.find(' ') != string::npos) ? "(" + x.text + ")" : x.text);
+            } else {
+                error("syntax error in grammar", "\"literal\" or a character class",
+                    src.first + x.at);
+            }
+        }
+        return n;
+    }
+
+    vm_node sequence() {
+        vm_node n = term();
+        if (!next(',')) {
+            return n;
+        }
+        vm_node m(vm_node::sequence, n.at);
+        m.nodes.push_back(move(n));
+        do {
+            m.nodes.push_back(term());
+        } while (next(','));
+        return m;
+    }
+
+    // a choice of single symbols is itself a class, as 'alphabetic | '_''.
+    vm_node expression() {
+        vm_node n = sequence();
+        if (!next('|')) {
+            return n;
+        }
+        vm_node m(vm_node::alternative, n.at);
+        m.nodes.push_back(move(n));
+        do {
+            m.nodes.push_back(sequence());
+        } while (next('|'));
+        for (vm_node const& a : m.nodes) {
+            if (a.kind != vm_node::symbols) {
+                return m;
+            }
+        }
+        vm_node u = move(m.nodes[0]);
+        for (size_t j = 1; j < m.nodes.size(); ++j) {
+            for (int k = 0; k < 4; ++k) {
+                u.bits[k] |= m.nodes[j].bits[k];
+            }
+            u.eof = u.eof || m.nodes[j].eof;
+            u.text += " | " + m.nodes[j].text;
+        }
+        return u;
+    }
+
+    void define(string const& n, vm_node&& body) {
+        auto const j = names.find(n);
+        if (j == names.end()) {
+            names.emplace(n, rules.size());
+            rules.emplace_back(n, move(body));
+        } else {
+            rules[j->second].second = move(body);
+        }
+    }
+
+    void resolve(vm_node& n) {
+        if (n.kind == vm_node::reference) {
+            auto const j = names.find(n.text);
+            if (j != names.end()) {
+                n.rule = j->second;
+            } else if (n.text == "succ") {
+                n.kind = vm_node::succeed;
+            } else if (n.text == "fail") {
+                n.kind = vm_node::fail;
+            } else {
+                i = src.first + n.at + n.text.size();
+                error("undefined rule in grammar", "rule", src.first + n.at);
+            }
+        }
+        for (vm_node& m : n.nodes) {
+            resolve(m);
+        }
+    }
+
+    void read() {
+        do {
+            string const n = name();
+            need('=', "'='");
+            vm_node body = expression();
+            need(';', "';'");
+            define(n, move(body));
+            skip();
+        } while (i != src.last);
+    }
+
+    explicit vm_grammar(source const& s) : src(s), i(s.first) {
+        read();
+    }
+
+    void read_builtin(string const& n, string const& d) {
+        string const text = n + " = " + d + ";";
+        vm_grammar const g(source {text.data(), text.data() + text.size()});
+        if (names.find(n) == names.end()) {
+            define(n, vm_node(g.rules[0].second));
+        }
+    }
+
+public:
+    vector<pair<string, vm_node>> rules;
+    map<string, uint32_t> names;
+
+    // the first rule is the start rule.
+    explicit vm_grammar(string const& text) : vm_grammar(source {text.data(), text.data() + text.size()}) {
+        unique_defs builtins;
+        accept_int<int>().ebnf(&builtins);
+        accept_int<unsigned>().ebnf(&builtins);
+        accept_real<double>().ebnf(&builtins);
+        for (auto const& d : builtins) {
+            read_builtin(d.first, d.second);
+        }
+        for (auto& r : rules) {
+            resolve(r.second);
+        }
+    }
+
+    vm_grammar(vm_grammar const&) = delete;
+    vm_grammar& operator= (vm_grammar const&) = delete;
+
+    string ebnf(vm_node const& n, unique_defs* defs = nullptr) const {
+        switch (n.kind) {
+            case vm_node::symbols:
+                return n.text;
+            case vm_node::literal:
+                return "\"" + n.text + "\"";
+            case vm_node::sequence:
+            case vm_node::alternative: {
+                string s;
+                for (vm_node const& m : n.nodes) {
+                    s += (s.empty() ? "" : (n.kind == vm_node::sequence) ? ", " : " | ")
+                        + ((m.rank() > n.rank()) ? "(" + ebnf(m, defs) + ")" : ebnf(m, defs));
+                }
+                return s;
+            }
+            case vm_node::many:
+                return "{" + ebnf(n.nodes[0], defs) + "}";
+            case vm_node::some:
+                return "{" + ebnf(n.nodes[0], defs) + "}-";
+            case vm_node::option:
+                return "[" + ebnf(n.nodes[0], defs) + "]";
+            case vm_node::reference:
+                if (defs != nullptr && defs->find(n.text) == defs->end()) {
+                    auto const j = defs->emplace(n.text, n.text).first;
+                    j->second = ebnf(rules[n.rule].second, defs);
+                }
+                return n.text;
+            case vm_node::except: {
+                vm_node const& m = n.nodes[0];
+                return ((m.rank() > 0) ? "(" + ebnf(m, defs) + ")" : ebnf(m, defs))
+                    + " - \"" + n.text + "\"";
+            }
+            case vm_node::attempt:
+                return "attempt(" + ebnf(n.nodes[0], defs) + ")";
+            case vm_node::strict:
+                return "strict(\"" + n.text + "\", " + ebnf(n.nodes[0], defs) + ")";
+            case vm_node::token:
+                return "token(" + ebnf(n.nodes[0], defs) + ")";
+            case vm_node::succeed:
+                return "succ";
+            case vm_node::fail:
+                return "fail";
+        }
+        return string();
+    }
+};
+
+//----------------------------------------------------------------------------
+// Compiled program and machine
+
+class parser_vm {
+    enum op_code : uint8_t {
+        op_char, op_set, op_span, op_string, op_test, op_choice, op_commit,
+        op_many, op_partial, op_pop, op_attempt, op_strict, op_mark, op_except,
+        op_call, op_return, op_jump, op_fail, op_end
+    };
+
+    // 'target' is a jump target, or the site a recogniser reports failure as.
+    struct instruction {
+        uint32_t op : 8;
+        uint32_t arg : 24;
+        uint32_t target;
+    };
+
+    enum frame_kind : uint8_t {frame_call, frame_choice, frame_many, frame_attempt,
+        frame_strict, frame_mark};
+
+    template <typename Iterator> struct frame {
+        frame_kind kind;
+        uint32_t arg;
+        uint32_t pc;
+        Iterator pos;
+        size_t text;
+    };
+
+    // On a range that frees its input (see Marks in "parser_combinators.hpp")
+    // attempt and mark frames pin their position, as the machine goes back
+    // to it or reads from it again, and keep the pin in 'arg'.
+    template <typename Iterator, typename Range>
+    static uint32_t pin(Range const& r, Iterator const& i, true_type /*has_mark*/) {
+        return static_cast<uint32_t>(r.mark(i));
+    }
+
+    template <typename Iterator, typename Range>
+    static uint32_t pin(Range const& r, Iterator const& i, false_type /*has_mark*/) {
+        return 0;
+    }
+
+    template <typename Iterator, typename Range>
+    static void unpin(Range const& r, frame<Iterator> const& f, true_type /*has_mark*/) {
+        if (f.kind == frame_attempt || f.kind == frame_mark) {
+            r.release(f.arg);
+        }
+    }
+
+    template <typename Iterator, typename Range>
+    static void unpin(Range const& r, frame<Iterator> const& f, false_type /*has_mark*/) {}
+
+    // the pins still held when the machine stops, returning or throwing.
+    template <typename Iterator, typename Range> struct pins {
+        Range const& r;
+        vector<frame<Iterator>> const& stack;
+
+        ~pins() {
+            if (has_mark<Range>::value) {
+                for (frame<Iterator> const& f : stack) {
+                    if (f.kind == frame_attempt || f.kind == frame_mark) {
+                        unpin(r, f, has_mark<Range>());
+                        break;
+                    }
+                }
+            }
+        }
+    };
+
+    // a point in the grammar that errors are reported at.
+    struct site {
+        shared_ptr<vm_grammar const> grammar;
+        vm_node const* node;
+        string message;
+
+        string ebnf(unique_defs* defs = nullptr) const {
+            return grammar->ebnf(*node, defs);
+        }
+    };
+
+    struct action {
+        function<void(string const&)> capture;
+        function<void()> notify;
+    };
+
+    shared_ptr<vm_grammar const> grammar;
+    vector<instruction> program;
+    vector<char_class> sets;
+    vector<span_scanner> scanners;
+    vector<string> strings;
+    vector<site> sites;
+    vector<uint32_t> entries;
+    vector<uint32_t> rule_sites;
+    size_t const limit;
+    uint32_t const start;
+    vector<action> actions;
+    vector<bool> recursive;
+
+    //------------------------------------------------------------------------
+    // Compiler
+
+    uint32_t emit(op_code const op, uint32_t const arg = 0, uint32_t const target = 0) {
+        program.push_back(instruction {op, arg, target});
+        return static_cast<uint32_t>(program.size() - 1);
+    }
+
+    void patch(uint32_t const at) {
+        program[at].target = static_cast<uint32_t>(program.size());
+    }
+
+    uint32_t add_site(vm_node const& n, string const& message = string()) {
+        sites.push_back(site {grammar, &n, message});
+        return static_cast<uint32_t>(sites.size() - 1);
+    }
+
+    uint32_t add_set(char_class const& c) {
+        sets.push_back(c);
+        scanners.emplace_back(c);
+        return static_cast<uint32_t>(sets.size() - 1);
+    }
+
+    // FIRST set of the nodes from j on, in sequence or as alternatives.
+    first_set first_of(vector<vm_node> const& ns, size_t const j, bool const sequence,
+        vector<bool>& visiting) const {
+        return (j == ns.size()) ? (sequence ? first_set::empty() : first_set::none())
+            : sequence ? first(ns[j], visiting).then(first_of(ns, j + 1, sequence, visiting))
+            : first(ns[j], visiting) | first_of(ns, j + 1, sequence, visiting);
+    }
+
+    // FIRST set of a node, references are followed until they recurse.
+    first_set first(vm_node const& n, vector<bool>& visiting) const {
+        switch (n.kind) {
+            case vm_node::symbols:
+                return first_set(n.symbol_class(), false);
+            case vm_node::literal:
+                return n.text.empty() ? first_set::empty()
+                    : first_set(char_class::single(n.text[0]), false);
+            case vm_node::sequence:
+                return first_of(n.nodes, 0, true, visiting);
+            case vm_node::alternative:
+                return first_of(n.nodes, 0, false, visiting);
+            case vm_node::many:
+            case vm_node::option:
+                return first(n.nodes[0], visiting).repeat();
+            case vm_node::reference: {
+                if (visiting[n.rule]) {
+                    return first_set::all();
+                }
+                visiting[n.rule] = true;
+                first_set const f = first(grammar->rules[n.rule].second, visiting);
+                visiting[n.rule] = false;
+                return f;
+            }
+            case vm_node::some:
+            case vm_node::except:
+            case vm_node::attempt:
+            case vm_node::token:
+                return first(n.nodes[0], visiting);
+            case vm_node::succeed:
+                return first_set::empty();
+            case vm_node::fail:
+                return first_set::none();
+            case vm_node::strict:
+                break;
+        }
+        // fails with an error on any symbol.
+        return first_set::all();
+    }
+
+    // skip to the returned instruction (to be patched) unless the next symbol
+    // can start n, or no instruction if n can match without consuming input.
+    bool test(vm_node const& n, uint32_t& at) {
+        vector<bool> visiting(grammar->rules.size(), false);
+        first_set const f = first(n, visiting);
+        if (f.nullable) {
+            return false;
+        }
+        at = emit(op_test, add_set(f.symbols));
+        return true;
+    }
+
+    void compile_symbols(vm_node const& n) {
+        char_class const c = n.symbol_class();
+        int count = 0;
+        int sym = 0;
+        for (int k = 0; k < 256; ++k) {
+            if (c.test(k)) {
+                ++count;
+                sym = k;
+            }
+        }
+        if (count == 1 && !c.eof) {
+            emit(op_char, sym, add_site(n));
+        } else {
+            emit(op_set, add_set(c), add_site(n));
+        }
+    }
+
+    void compile_many(vm_node const& n) {
+        vm_node const& m = n.nodes[0];
+        if (m.kind == vm_node::symbols) {
+            emit(op_span, add_set(m.symbol_class()));
+            return;
+        }
+        uint32_t const push = emit(op_many, add_site(m));
+        uint32_t const top = static_cast<uint32_t>(program.size());
+        uint32_t skip = 0;
+        bool const tested = test(m, skip);
+        compile(m);
+        emit(op_partial, 0, top);
+        if (tested) {
+            patch(skip);
+        }
+        emit(op_pop);
+        patch(push);
+    }
+
+    void compile_alternative(vector<vm_node> const& ns) {
+        vector<uint32_t> ends;
+        for (size_t j = 0; j + 1 < ns.size(); ++j) {
+            uint32_t skip = 0;
+            bool const tested = test(ns[j], skip);
+            uint32_t const push = emit(op_choice, add_site(ns[j]));
+            compile(ns[j]);
+            ends.push_back(emit(op_commit));
+            patch(push);
+            if (tested) {
+                patch(skip);
+            }
+        }
+        compile(ns.back());
+        for (uint32_t const e : ends) {
+            patch(e);
+        }
+    }
+
+    void compile(vm_node const& n) {
+        switch (n.kind) {
+            case vm_node::symbols:
+                compile_symbols(n);
+                break;
+            case vm_node::literal:
+                if (n.text.size() == 1) {
+                    emit(op_char, static_cast<unsigned char>(n.text[0]), add_site(n));
+                } else if (!n.text.empty()) {
+                    strings.push_back(n.text);
+                    emit(op_string, strings.size() - 1, add_site(n));
+                }
+                break;
+            case vm_node::sequence:
+                for (vm_node const& m : n.nodes) {
+                    compile(m);
+                }
+                break;
+            case vm_node::alternative:
+                compile_alternative(n.nodes);
+                break;
+            case vm_node::many:
+                compile_many(n);
+                break;
+            case vm_node::some:
+                compile(n.nodes[0]);
+                compile_many(n);
+                break;
+            case vm_node::option: {
+                vector<vm_node> ns;
+                ns.push_back(n.nodes[0]);
+                ns.push_back(vm_node(vm_node::succeed, n.at));
+                compile_alternative(ns);
+                break;
+            }
+            case vm_node::reference:
+                if (inlined(n.rule)) {
+                    compile(grammar->rules[n.rule].second);
+                } else {
+                    emit(op_call, n.rule);
+                }
+                break;
+            case vm_node::except:
+                emit(op_mark);
+                compile(n.nodes[0]);
+                strings.push_back(n.text);
+                emit(op_except, strings.size() - 1);
+                break;
+            case vm_node::attempt:
+                emit(op_attempt);
+                compile(n.nodes[0]);
+                emit(op_pop);
+                break;
+            case vm_node::strict:
+                emit(op_strict, add_site(n.nodes[0], n.text));
+                compile(n.nodes[0]);
+                emit(op_pop);
+                break;
+            case vm_node::token:
+                compile(n.nodes[0]);
+                emit(op_span, add_set(char_class(is_space)));
+                break;
+            case vm_node::succeed:
+                break;
+            case vm_node::fail:
+                emit(op_fail);
+                break;
+        }
+    }
+
+    // does n refer to the rule, directly or through other rules.
+    bool reaches(vm_node const& n, uint32_t const rule, vector<bool>& seen) const {
+        if (n.kind == vm_node::reference) {
+            if (n.rule == rule) {
+                return true;
+            } else if (!seen[n.rule]) {
+                seen[n.rule] = true;
+                return reaches(grammar->rules[n.rule].second, rule, seen);
+            }
+        }
+        for (vm_node const& m : n.nodes) {
+            if (reaches(m, rule, seen)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // rules without actions that do not recurse are compiled in place.
+    bool inlined(uint32_t const rule) const {
+        return rule != start && !recursive[rule] && !actions[rule].capture && !actions[rule].notify;
+    }
+
+    // (re)generate the program, as the rules with actions change.
+    void build() {
+        program.clear();
+        sets.clear();
+        scanners.clear();
+        strings.clear();
+        sites.clear();
+        rule_sites.clear();
+        entries.assign(grammar->rules.size(), 0);
+        for (auto const& r : grammar->rules) {
+            rule_sites.push_back(add_site(r.second));
+        }
+        emit(op_call, start);
+        emit(op_end);
+        for (uint32_t k = 0; k < grammar->rules.size(); ++k) {
+            if (!inlined(k)) {
+                entries[k] = static_cast<uint32_t>(program.size());
+                compile(grammar->rules[k].second);
+                emit(op_return);
+            }
+        }
+        for (instruction& x : program) {
+            if (x.op == op_call) {
+                x.target = entries[x.arg];
+            }
+        }
+    }
+
+    uint32_t rule_index(string const& name) const {
+        auto const j = grammar->names.find(name);
+        if (j == grammar->names.end()) {
+            throw runtime_error("no rule named " + name);
+        }
+        return j->second;
+    }
+
+    //------------------------------------------------------------------------
+    // Machine helpers
+
+    template <typename Iterator>
+    Iterator span(Iterator i, Iterator const& last, uint32_t const k, string& text, int const open,
+        true_type /*contiguous*/) const {
+        return scanners[k](i, last);
+    }
+
+    template <typename Iterator>
+    Iterator span(Iterator i, Iterator const& last, uint32_t const k, string& text, int const open,
+        false_type /*contiguous*/) const {
+        char_class const& c = sets[k];
+        while (i != last && c.test(static_cast<unsigned char>(*i))) {
+            if (open != 0) {
+                text.push_back(*i);
+            }
+            ++i;
+        }
+        return i;
+    }
+
+    template <typename Iterator>
+    static string captured(Iterator const& f, Iterator const& l, string const& text, size_t const m,
+        true_type /*contiguous*/) {
+        return string(f, l);
+    }
+
+    template <typename Iterator>
+    static string captured(Iterator const& f, Iterator const& l, string const& text, size_t const m,
+        false_type /*contiguous*/) {
+        return text.substr(m);
+    }
+
+    // does [f, l) spell s.
+    template <typename Iterator>
+    static bool spells(Iterator f, Iterator const& l, string const& s) {
+        for (char const c : s) {
+            if (f == l || static_cast<unsigned char>(*f) != static_cast<unsigned char>(c)) {
+                return false;
+            }
+            ++f;
+        }
+        return f == l;
+    }
+
+public:
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = true_type;
+    using result_type = void;
+    int const rank = 0;
+
+    // compile the grammar, parsing from the named rule (by default the first);
+    // 'limit' bounds the backtrack stack, and so the nesting of the input.
+    explicit parser_vm(string const& text, string const& rule = string(), size_t const limit = 100000)
+        : grammar(make_shared<vm_grammar const>(text)), limit(limit),
+        start(rule.empty() ? 0 : rule_index(rule)), actions(grammar->rules.size()) {
+        for (uint32_t k = 0; k < grammar->rules.size(); ++k) {
+            vector<bool> seen(grammar->rules.size(), false);
+            recursive.push_back(reaches(grammar->rules[k].second, k, seen));
+        }
+        build();
+    }
+
+    // call f with the text matched by the rule each time it succeeds; like a
+    // functor in 'all', it is not undone by backtracking, and a runtime_error
+    // it throws is a parse error (the built-in rules only recognise, so
+    // converting the text, and checking it fits, is up to f).
+    void capture(string const& rule, function<void(string const&)> f) {
+        actions[rule_index(rule)].capture = move(f);
+        build();
+    }
+
+    // call f each time the rule succeeds, errors are as for capture.
+    void notify(string const& rule, function<void()> f) {
+        actions[rule_index(rule)].notify = move(f);
+        build();
+    }
+
+    size_t size() const {
+        return program.size();
+    }
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (
+        Iterator &i,
+        Range const &r,
+        result_type *result = nullptr,
+        Inherit* st = nullptr
+    ) const;
+
+    first_set first() const {
+        return first_set::all();
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        auto const& r = grammar->rules[start];
+        if (defs != nullptr && defs->find(r.first) == defs->end()) {
+            auto const j = defs->emplace(r.first, r.first).first;
+            j->second = grammar->ebnf(r.second, defs);
+        }
+        return r.first;
+    }
+};
+
+// Instructions are dispatched through a table of label addresses where the
+// compiler supports it (each instruction ends with its own indirect jump), or
+// by a switch otherwise.
+
+#if defined(__GNUC__) && !defined(PARSER_VM_SWITCH)
+#define PARSER_VM_THREADED
+#endif
+
+template <typename Iterator, typename Range, typename Inherit>
+bool parser_vm::operator() (Iterator &in, Range const &r, result_type *result, Inherit* st) const {
+    using contiguous = is_contiguous<Iterator>;
+    instruction const* const code = program.data();
+    // the position is kept in a local, so that it can stay in registers
+    // across calls to the actions.
+    Iterator i = in;
+    Iterator const last = r.last;
+    using marked = has_mark<Range>;
+    vector<frame<Iterator>> stack;
+    stack.reserve(64);
+    pins<Iterator, Range> const held {r, stack};
+    // symbols consumed while a capture is open, when they can't be re-read.
+    string text;
+    int open = 0;
+    uint32_t pc = 0;
+
+#ifdef PARSER_VM_THREADED
+#define PARSER_VM_OP(x) do_##x:
+#define PARSER_VM_NEXT goto *labels[code[pc].op]
+    static void* const labels[] = {&&do_char, &&do_set, &&do_span, &&do_string,
+        &&do_test, &&do_choice, &&do_commit, &&do_many, &&do_partial, &&do_pop,
+        &&do_attempt, &&do_strict, &&do_mark, &&do_except, &&do_call, &&do_return,
+        &&do_jump, &&do_fail, &&do_end};
+    PARSER_VM_NEXT;
+    {
+#else
+#define PARSER_VM_OP(x) case op_##x:
+#define PARSER_VM_NEXT goto dispatch
+dispatch:
+    switch (code[pc].op) {
+#endif
+    PARSER_VM_OP(char) {
+        instruction const x = code[pc];
+        if (i != last && static_cast<unsigned char>(*i) == x.arg) {
+            if (!contiguous::value && open != 0) {
+                text.push_back(*i);
+            }
+            ++i;
+            ++pc;
+            PARSER_VM_NEXT;
+        }
+        note_failure(sites[x.target], i, r);
+        goto fail;
+    }
+    PARSER_VM_OP(set) {
+        instruction const x = code[pc];
+        if (i == last) {
+            // EOF is matched without moving past the end.
+            if (sets[x.arg].eof) {
+                ++pc;
+                PARSER_VM_NEXT;
+            }
+        } else if (sets[x.arg].test(static_cast<unsigned char>(*i))) {
+            if (!contiguous::value && open != 0) {
+                text.push_back(*i);
+            }
+            ++i;
+            ++pc;
+            PARSER_VM_NEXT;
+        }
+        note_failure(sites[x.target], i, r);
+        goto fail;
+    }
+    PARSER_VM_OP(span) {
+        i = span(i, last, code[pc].arg, text, open, contiguous());
+        ++pc;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(string) {
+        instruction const x = code[pc];
+        Iterator const first = i;
+        for (char const c : strings[x.arg]) {
+            if (i == last || static_cast<unsigned char>(*i) != static_cast<unsigned char>(c)) {
+                note_failure(sites[x.target], first, r);
+                goto fail;
+            }
+            if (!contiguous::value && open != 0) {
+                text.push_back(c);
+            }
+            ++i;
+        }
+        ++pc;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(test) {
+        instruction const x = code[pc];
+        char_class const& c = sets[x.arg];
+        pc = ((i == last) ? c.eof : c.test(static_cast<unsigned char>(*i))) ? pc + 1 : x.target;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(choice) {
+        instruction const x = code[pc];
+        stack.push_back(frame<Iterator> {frame_choice, x.arg, x.target, i, text.size()});
+        ++pc;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(commit) {
+        stack.pop_back();
+        pc = code[pc].target;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(many) {
+        instruction const x = code[pc];
+        stack.push_back(frame<Iterator> {frame_many, x.arg, x.target, i, text.size()});
+        ++pc;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(partial) {
+        frame<Iterator>& f = stack.back();
+        f.pos = i;
+        f.text = text.size();
+        pc = code[pc].target;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(pop) {
+        unpin(r, stack.back(), marked());
+        stack.pop_back();
+        ++pc;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(attempt) {
+        stack.push_back(frame<Iterator> {frame_attempt, pin(r, i, marked()), 0, i, text.size()});
+        ++pc;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(strict) {
+        stack.push_back(frame<Iterator> {frame_strict, code[pc].arg, 0, i, text.size()});
+        ++pc;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(mark) {
+        stack.push_back(frame<Iterator> {frame_mark, pin(r, i, marked()), 0, i, text.size()});
+        ++pc;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(except) {
+        bool const same = spells(stack.back().pos, i, strings[code[pc].arg]);
+        unpin(r, stack.back(), marked());
+        stack.pop_back();
+        if (same) {
+            goto fail;
+        }
+        ++pc;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(call) {
+        instruction const x = code[pc];
+        if (stack.size() >= limit) {
+            in = i;
+            return raise_error("nesting too deep", sites[rule_sites[x.arg]], i, i, r);
+        }
+        stack.push_back(frame<Iterator> {frame_call, x.arg, pc + 1, i, text.size()});
+        if (actions[x.arg].capture) {
+            ++open;
+        }
+        pc = x.target;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(return) {
+        frame<Iterator> const& f = stack.back();
+        action const& a = actions[f.arg];
+        pc = f.pc;
+        try {
+            if (a.capture) {
+                a.capture(captured(f.pos, i, text, f.text, contiguous()));
+                if (--open == 0) {
+                    text.clear();
+                }
+            }
+            if (a.notify) {
+                a.notify();
+            }
+        } catch (runtime_error &e) {
+            in = i;
+            return raise_error(e.what(), sites[rule_sites[f.arg]], f.pos, i, r);
+        }
+        stack.pop_back();
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(jump) {
+        pc = code[pc].target;
+        PARSER_VM_NEXT;
+    }
+    PARSER_VM_OP(fail) {
+        goto fail;
+    }
+    PARSER_VM_OP(end) {
+        in = i;
+        return true;
+    }
+    }
+
+fail:
+    while (!stack.empty()) {
+        frame<Iterator>& f = stack.back();
+        switch (f.kind) {
+            case frame_call:
+                if (actions[f.arg].capture) {
+                    --open;
+                }
+                break;
+            case frame_choice:
+                if (i != f.pos) {
+                    in = i;
+                    return raise_error("failed parser consumed input", sites[f.arg], f.pos, i, r);
+                }
+                pc = f.pc;
+                text.resize(f.text);
+                stack.pop_back();
+                PARSER_VM_NEXT;
+            case frame_many:
+                if (i != f.pos) {
+                    in = i;
+                    return raise_error("failed many-parser consumed input", sites[f.arg], f.pos, i, r);
+                }
+                pc = f.pc;
+                text.resize(f.text);
+                stack.pop_back();
+                PARSER_VM_NEXT;
+            case frame_attempt:
+                i = f.pos;
+                text.resize(f.text);
+                break;
+            case frame_strict:
+                in = i;
+                return raise_error(sites[f.arg].message, sites[f.arg], f.pos, i, r);
+            case frame_mark:
+                break;
+        }
+        unpin(r, f, marked());
+        stack.pop_back();
+    }
+    in = i;
+    return false;
+
+#undef PARSER_VM_OP
+#undef PARSER_VM_NEXT
+}
+
+#undef PARSER_VM_THREADED
+
+template <typename... Args>
+parser_vm load_grammar(string const& text, Args&&... args) {
+    return parser_vm(text, forward<Args>(args)...);
+}
+
+#endif // PARSER_VM_HPP
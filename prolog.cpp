@@ -8,26 +8,45 @@ using lp = logic_parser<base>;
 struct expression_parser;
 
 template <typename Range>
-int parse(Range const &r, lp::program& prog) {
+int parse(Range const &r, lp::program& prog, unsigned const threads) {
     profile<expression_parser> p;
-    return lp::parse(r, prog);
+    if (threads == 1) {
+        return lp::parse(r, prog);
+    }
+    return lp::parse_parallel(r, prog, threads);
 }
 
 //----------------------------------------------------------------------------
 // The stream_range allows file iterators to be used like random_iterators
 // and abstracts the difference between C++ stdlib streams and file_vectors.
 
-
 int main(int const argc, char const *argv[]) {
     if (argc < 1) {
         cerr << "no input files" << endl;
     } else {
+        unsigned threads = 1;
         for (int i = 1; i < argc; ++i) {
+            // "-j N" consults the files after it using N threads (0 for one
+            // per core).
+            if (string(argv[i]) == "-j") {
+                string const n = (i + 1 < argc) ? argv[++i] : "";
+                size_t used = 0;
+                unsigned long t = 0;
+                try {
+                    t = stoul(n, &used);
+                } catch (logic_error const&) {}
+                if (n.empty() || !isdigit(n[0]) || used != n.size() || t > numeric_limits<unsigned>::max()) {
+                    cerr << "bad thread count: " << n << endl;
+                    return 1;
+                }
+                threads = static_cast<unsigned>(t);
+                continue;
+            }
             profile<expression_parser>::reset();
             stream_range in(argv[i]);
             cout << argv[i] << endl;
             lp::program prog;
-            int const chars_read = parse(in, prog);
+            int const chars_read = parse(in, prog, threads);
             cout << prog;
             double const mb_per_s = static_cast<double>(chars_read) / static_cast<double>(profile<expression_parser>::report());
             cout << "parsed: " << mb_per_s << "MB/s" << endl;
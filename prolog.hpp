@@ -4,8 +4,14 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 #include "stream_iterator.hpp"
+#include "parser_deep.hpp"
+#include "journal.hpp"
 #include "templateio.hpp"
 #include "profile.hpp"
 
@@ -125,6 +131,21 @@ template <typename Base> struct logic_parser {
             region.emplace_back(c);
             return c;
         }
+
+        // move the terms, clauses and goals of a program that shares this
+        // program's atoms onto the end of this one, keeping clause order.
+        void splice(program& p) {
+            for (auto& m : p.region) {
+                region.push_back(move(m));
+            }
+            for (auto const& c : p.db) {
+                db.emplace(c.first, c.second);
+            }
+            goals.insert(goals.end(), p.goals.begin(), p.goals.end());
+            p.region.clear();
+            p.db.clear();
+            p.goals.clear();
+        }
     };
 
     //------------------------------------------------------------------------
@@ -225,34 +246,54 @@ template <typename Base> struct logic_parser {
     //------------------------------------------------------------------------
     // Parser State
     //
-    // Making this uncopyable prevents backtracking being used, as the
-    // 'attempt' combinator will try and make a copy of the inherited
-    // attribute for backtracking. This can be seen as a constraint on the
-    // parser (to ensure performance) or a safety measure to make sure we deal
-    // with copying if we want backtracking.
+    // The state is journaled rather than copyable, so 'attempt' backtracks it
+    // by undoing the changes made since the attempt started, instead of
+    // copying the maps and sets. Atoms and terms created by a failed attempt
+    // are not removed from the program, as they are harmless.
 
-    using var_t = typename map<atom_t, variable*>::const_iterator;
+    using var_t = typename journaled_map<atom_t, variable*, atom_less>::const_iterator;
 
-    struct inherited_attributes {
+    struct inherited_attributes : public journal {
         program& prog;
 
-        map<atom_t, variable*, atom_less> variables; 
-        set<variable*> repeated;
-        set<variable*> repeated_in_goal;
+        journaled_map<atom_t, variable*, atom_less> variables {*this};
+        journaled_set<variable*> repeated {*this};
+        journaled_set<variable*> repeated_in_goal {*this};
 
-        inherited_attributes(inherited_attributes const&) = delete;
-        inherited_attributes& operator= (inherited_attributes const&) = delete;
+        // the atom table, which is locked when threads share it.
+        set<string>& atoms;
+        mutex* const atoms_lock;
 
-        atom_t get_atom(string const& atom) {
-            atom_t const n = prog.atoms.find(atom);
-            if (n == prog.atoms.end()) {
-                return prog.atoms.insert(atom).first;
+        atom_t intern(string const& atom) {
+            atom_t const n = atoms.find(atom);
+            if (n == atoms.end()) {
+                return atoms.insert(atom).first;
             } else {
                 return n;
             }
         }
 
-        inherited_attributes(program& p) : prog(p) {}
+        // atoms already seen by this thread, which are looked up without
+        // taking the lock.
+        map<string, atom_t> seen;
+
+        atom_t get_atom(string const& atom) {
+            if (atoms_lock == nullptr) {
+                return intern(atom);
+            }
+            auto const n = seen.find(atom);
+            if (n != seen.end()) {
+                return n->second;
+            }
+            lock_guard<mutex> const lock(*atoms_lock);
+            return seen.emplace(atom, intern(atom)).first->second;
+        }
+
+        inherited_attributes(program& p) : prog(p), atoms(p.atoms),
+            atoms_lock(nullptr) {}
+
+        inherited_attributes(program& p, set<string>& a, mutex& m) : prog(p),
+            atoms(a), atoms_lock(&m) {}
     };
 
     //------------------------------------------------------------------------
@@ -396,7 +437,7 @@ template <typename Base> struct logic_parser {
             inherited_attributes* st
         ) const {
             *res = str;
-            st->repeated_in_goal = st->repeated;
+            st->repeated_in_goal.assign(st->repeated);
         }
     } constexpr return_head {};
 
@@ -420,7 +461,7 @@ template <typename Base> struct logic_parser {
             inherited_attributes* st
         ) const {
             st->prog.db.emplace(head->functor,
-                st->prog.new_clause(head, impl, st->repeated_in_goal));
+                st->prog.new_clause(head, impl, st->repeated_in_goal.get()));
             st->variables.clear();
             st->repeated.clear();
             st->repeated_in_goal.clear();
@@ -500,9 +541,12 @@ template <typename Base> struct logic_parser {
     }
 
     //------------------------------------------------------------------------
+    // The grammar is local, as the recursive parts refer to each other, so it
+    // is built here and handed to a consult function, which parses with it.
+    // Errors are formatted before the parsers they refer to go.
 
-    template <typename Range>
-    static int parse(Range const& r, program& prog) {
+    template <typename Consult>
+    static int with_grammar(Consult const& consult) {
         auto const op = fix("op-list", recursive_oper);
         auto const structure = define("op-struct", all(return_op_var_exp, var,
             oper, op) || all(return_op_stc_exp, recursive_struct(op),
@@ -514,13 +558,235 @@ template <typename Base> struct logic_parser {
             && discard(end_tok));
         auto const clause = define("clause", all(return_clause,
             all(return_head, structure), option(goals) && discard(end_tok)));
-        auto const parser = first_token && strict("unexpected character",
-            some(clause || query || comment));
 
-        typename Range::iterator i = r.first;
-        inherited_attributes st(prog);
-        parser(i, r, &prog, &st);
-        return i - r.first;
+        return consult(clause || query || comment);
+    }
+
+    template <typename Range> struct consult_sequential {
+        Range const& r;
+        program& prog;
+
+        template <typename Record>
+        int operator() (Record const& record) const {
+            auto const parser = deep(first_token && strict("unexpected character",
+                some(record)));
+
+            typename Range::iterator i = r.first;
+            inherited_attributes st(prog);
+            parser(i, r, &prog, &st);
+            return i - r.first;
+        }
+    };
+
+    template <typename Range>
+    static int parse(Range const& r, program& prog) {
+        return with_grammar(consult_sequential<Range> {r, prog});
+    }
+
+    //------------------------------------------------------------------------
+    // Parallel Consult
+    //
+    // The input is split into segments just after candidate clause ends: a
+    // '.' followed by space, outside comments and quotes, and not part of an
+    // operator. Segments are parsed at the same time, each into its own
+    // program with its own inherited attributes, sharing the atom table. The
+    // split is only a guess, so the programs are then joined in order, and a
+    // segment that does not start where the previous one ended is parsed
+    // again from there. Clause order in the database is kept, and the clauses
+    // (and which error is reported) are the same as parsing in order; only
+    // orders that follow atom addresses, like that of a query's variables,
+    // can differ, as atoms are created in a different order.
+
+    template <typename Iterator> struct segment {
+        Iterator start;
+        Iterator stop;      // records that start before here belong to it
+        Iterator end;       // where its last record ended
+        size_t records;
+        bool stopped;       // a record failed before the stop was reached
+        exception_ptr error;
+        program prog;
+    };
+
+    // parses a segment's records, is run on a deep stack for nested terms.
+    template <typename Record, typename Iterator> struct consult_segment {
+        using is_parser_type = true_type;
+        using is_handle_type = false_type;
+        using has_side_effects = true_type;
+        using result_type = program;
+        int const rank;
+
+        Record const& record;
+        segment<Iterator>& s;
+        bool const leading;
+
+        consult_segment(Record const& p, segment<Iterator>& s, bool const leading)
+            : rank(p.rank), record(p), s(s), leading(leading) {}
+
+        template <typename Range>
+        bool operator() (
+            Iterator& i,
+            Range const& r,
+            program* result,
+            inherited_attributes* st
+        ) const {
+            if (leading) {
+                first_token(i, r, nullptr, st);
+            }
+            while (i < s.stop) {
+                Iterator const first = i;
+                if (!record(i, r, result, st)) {
+                    // a failed first clause is left to the sequential
+                    // parser, which reports it.
+                    if (i != first && !(leading && s.records == 0)) {
+                        raise_error("failed many-parser consumed input", record, first, i, r);
+                    }
+                    i = first;
+                    s.stopped = true;
+                    break;
+                }
+                ++s.records;
+            }
+            return true;
+        }
+    };
+
+    template <typename Record, typename Range, typename Iterator>
+    static void parse_segment(Record const& record, Range const& r, segment<Iterator>& s,
+        bool const leading, set<string>& atoms, mutex& atoms_lock) {
+        s.records = 0;
+        s.stopped = false;
+        s.error = nullptr;
+        s.prog = program();
+        Iterator i = s.start;
+        try {
+            inherited_attributes st(s.prog, atoms, atoms_lock);
+            deep(consult_segment<Record, Iterator>(record, s, leading))(i, r, &s.prog, &st);
+        } catch (...) {
+            s.error = current_exception();
+        }
+        s.end = i;
+    }
+
+    // the start of the segment after a candidate clause end at or after 'i'.
+    static char const* next_clause(char const* const first, char const* i,
+        char const* const last) {
+        // a comment can't be open at the start of a line.
+        while (i != last && *i != '\n') {
+            ++i;
+        }
+        for (; i != last; ++i) {
+            char const c = *i;
+            if (c == '#') {
+                while (i != last && *i != '\n') {
+                    ++i;
+                }
+                if (i == last) {
+                    break;
+                }
+            } else if (c == '\'' || c == '"') {
+                char const* const q = i;
+                while (++i != last && *i != c);
+                if (i == last) {
+                    i = q;
+                }
+            } else if (c == '.' && (i + 1 == last || isspace(i[1]))
+                && (i == first || !ispunct(i[-1]) || i[-1] == ')')) {
+                for (++i; i != last && isspace(*i); ++i);
+                return i;
+            }
+        }
+        return last;
+    }
+
+    template <typename Range> struct consult_parallel {
+        Range const& r;
+        program& prog;
+        unsigned const threads;
+        size_t const grain;
+
+        template <typename Record>
+        int operator() (Record const& record) const {
+            return consult(record, is_contiguous_range<Range>());
+        }
+
+        template <typename Record>
+        int consult(Record const& record, false_type /*contiguous*/) const {
+            // stream iterators share the stream's position, so parse in order.
+            return consult_sequential<Range> {r, prog}(record);
+        }
+
+        template <typename Record>
+        int consult(Record const& record, true_type /*contiguous*/) const {
+            using iterator = typename Range::iterator;
+
+            unsigned const n = (threads > 0) ? threads
+                : max(thread::hardware_concurrency(), 1u);
+            size_t const size = r.last - r.first;
+            size_t const count = min(size / grain, static_cast<size_t>(4 * n));
+            if (n < 2 || count < 2) {
+                return consult_sequential<Range> {r, prog}(record);
+            }
+
+            vector<segment<iterator>> segments(count);
+            iterator start = r.first;
+            size_t m = 0;
+            for (size_t k = 0; k < count && start != r.last; ++k) {
+                iterator const stop = (k + 1 == count) ? r.last : next_clause(r.first,
+                    max(start, r.first + size * (k + 1) / count), r.last);
+                segments[m].start = start;
+                segments[m].stop = stop;
+                ++m;
+                start = stop;
+            }
+            segments.resize(m);
+
+            prepare_lines(r);
+            mutex atoms_lock;
+            atomic<size_t> next(0);
+            auto const work = [&]() {
+                for (size_t k; (k = next++) < segments.size();) {
+                    parse_segment(record, r, segments[k], k == 0, prog.atoms, atoms_lock);
+                }
+            };
+            vector<thread> pool;
+            for (unsigned t = 1; t < min(n, static_cast<unsigned>(segments.size())); ++t) {
+                pool.emplace_back(work);
+            }
+            work();
+            for (thread& t : pool) {
+                t.join();
+            }
+
+            iterator end = r.first;
+            for (size_t k = 0; k < segments.size(); ++k) {
+                segment<iterator>& s = segments[k];
+                if (k > 0 && s.start != end) {
+                    // a guessed split was wrong, parse from the previous end.
+                    s.start = end;
+                    parse_segment(record, r, s, false, prog.atoms, atoms_lock);
+                }
+                if (s.error) {
+                    rethrow_exception(s.error);
+                }
+                if (k == 0 && s.records == 0) {
+                    return consult_sequential<Range> {r, prog}(record);
+                }
+                prog.splice(s.prog);
+                end = s.end;
+                if (s.stopped) {
+                    break;
+                }
+            }
+            return end - r.first;
+        }
+    };
+
+    // parse using up to 'threads' threads (or one per core when zero), in
+    // segments of at least 'grain' characters.
+    template <typename Range>
+    static int parse_parallel(Range const& r, program& prog, unsigned const threads = 0,
+        size_t const grain = 1 << 16) {
+        return with_grammar(consult_parallel<Range> {r, prog, threads, grain});
     }
 };
 
@@ -0,0 +1,395 @@
+//----------------------------------------------------------------------------
+// copyright 2014 Keean Schupke
+// compile with -std=c++11
+// readahead_range.hpp
+
+#ifndef READAHEAD_RANGE_HPP
+#define READAHEAD_RANGE_HPP
+
+#include <memory>
+#include <vector>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include "block_range.hpp"
+
+using namespace std;
+
+#ifdef __linux__
+
+//============================================================================
+// io_uring Read Ahead
+//
+// Keeps a read of each of 'depth' blocks in flight ahead of the reader, with
+// io_uring (through the system calls, so without liburing), and hands them
+// back in order. Only regular files are read this way, as the reads are at
+// offsets. The constructor throws if the kernel does not support io_uring,
+// or its reads (IORING_OP_READ, from Linux 5.6, which is probed for).
+
+class uring_source {
+    struct slot {
+        unique_ptr<char[]> data;
+        streamoff offset;
+        size_t want;
+        size_t size;
+        int error;
+        bool busy;
+        bool done;
+    };
+
+    int const fd;
+    size_t const block_size;
+    streamoff const file_size;
+    int ring;
+    void* sq;
+    size_t sq_size;
+    void* cq;
+    size_t cq_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    vector<slot> slots;
+    size_t current;
+    size_t at;
+    streamoff next;
+    stall_stats waits;
+
+    static streamoff size_of(int const fd) {
+        struct stat s;
+        return (fstat(fd, &s) == 0) ? static_cast<streamoff>(s.st_size) : 0;
+    }
+
+    template <typename T>
+    static T* field(void* const ring, unsigned const offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+    }
+
+    static void* map(int const ring, size_t const size, off_t const offset) {
+        void* const p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring, offset);
+        if (p == MAP_FAILED) {
+            throw system_error(errno, system_category(), "unable to map io_uring");
+        }
+        return p;
+    }
+
+    // kernels before 5.6 have io_uring but not the probe or IORING_OP_READ.
+    void probe() const {
+        size_t const n = sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+        unique_ptr<char[]> const buffer(new char[n]());
+        io_uring_probe* const p = reinterpret_cast<io_uring_probe*>(buffer.get());
+        if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, p, IORING_OP_LAST) < 0) {
+            throw system_error(errno, system_category(), "io_uring can't be probed");
+        }
+        if (p->last_op < IORING_OP_READ || (p->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) == 0) {
+            throw system_error(EINVAL, system_category(), "io_uring can't read");
+        }
+    }
+
+    void submit(size_t const s) {
+        slot& k = slots[s];
+        k.offset = next;
+        k.want = static_cast<size_t>(min(static_cast<streamoff>(block_size), file_size - next));
+        k.size = 0;
+        k.error = 0;
+        k.busy = true;
+        k.done = false;
+        next += k.want;
+
+        unsigned const tail = *sq_tail;
+        unsigned const i = tail & *sq_mask;
+        io_uring_sqe& e = sqes[i];
+        memset(&e, 0, sizeof e);
+        e.opcode = IORING_OP_READ;
+        e.fd = fd;
+        e.addr = reinterpret_cast<uintptr_t>(k.data.get());
+        e.len = static_cast<unsigned>(k.want);
+        e.off = static_cast<uint64_t>(k.offset);
+        e.user_data = s;
+        sq_array[i] = i;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        while (syscall(__NR_io_uring_enter, ring, 1, 0, 0, nullptr, 0) < 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                throw system_error(errno, system_category(), "unable to submit a read");
+            }
+        }
+    }
+
+    // collect the completed reads, waiting for one if 'wait'.
+    void reap(bool const wait) {
+        if (wait) {
+            while (syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+                if (errno != EINTR) {
+                    throw system_error(errno, system_category(), "unable to wait for a read");
+                }
+            }
+        }
+        unsigned head = *cq_head;
+        unsigned const tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            io_uring_cqe const& c = cqes[head & *cq_mask];
+            slot& k = slots[static_cast<size_t>(c.user_data)];
+            if (c.res < 0) {
+                k.error = -c.res;
+            } else {
+                k.size = static_cast<size_t>(c.res);
+            }
+            k.done = true;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // reads still in flight are waited for, as they write to the slots.
+    void release() {
+        if (cq != MAP_FAILED) {
+            for (slot const& k : slots) {
+                while (k.busy && !k.done) {
+                    reap(true);
+                }
+            }
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq != MAP_FAILED && cq != sq) {
+            munmap(cq, cq_size);
+        }
+        if (sq != MAP_FAILED) {
+            munmap(sq, sq_size);
+        }
+        if (ring >= 0) {
+            ::close(ring);
+        }
+    }
+
+    // a short read is finished synchronously (it is the file shrinking, or rare).
+    void complete(slot& k) {
+        while (k.size < k.want) {
+            ssize_t const m = ::pread(fd, k.data.get() + k.size, k.want - k.size,
+                k.offset + static_cast<streamoff>(k.size));
+            if (m < 0) {
+                throw system_error(errno, system_category(), "unable to read file");
+            } else if (m == 0) {
+                k.want = k.size;
+            }
+            k.size += static_cast<size_t>(m);
+        }
+    }
+
+public:
+    uring_source(int const fd, size_t const block_size = size_t(1) << 16, size_t const depth = 4)
+        : fd(fd), block_size(block_size), file_size(size_of(fd)), ring(-1),
+        sq(MAP_FAILED), cq(MAP_FAILED), sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+        current(0), at(0), next(0) {
+        io_uring_params p;
+        memset(&p, 0, sizeof p);
+        ring = static_cast<int>(syscall(__NR_io_uring_setup, static_cast<unsigned>(max(depth, size_t(1))), &p));
+        if (ring < 0) {
+            throw system_error(errno, system_category(), "io_uring is not available");
+        }
+        try {
+            probe();
+            sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+                sq_size = cq_size = max(sq_size, cq_size);
+            }
+            sq = map(ring, sq_size, IORING_OFF_SQ_RING);
+            cq = ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) ? sq : map(ring, cq_size, IORING_OFF_CQ_RING);
+            sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+            sqes = static_cast<io_uring_sqe*>(map(ring, sqes_size, IORING_OFF_SQES));
+            sq_tail = field<unsigned>(sq, p.sq_off.tail);
+            sq_mask = field<unsigned>(sq, p.sq_off.ring_mask);
+            sq_array = field<unsigned>(sq, p.sq_off.array);
+            cq_head = field<unsigned>(cq, p.cq_off.head);
+            cq_tail = field<unsigned>(cq, p.cq_off.tail);
+            cq_mask = field<unsigned>(cq, p.cq_off.ring_mask);
+            cqes = field<io_uring_cqe>(cq, p.cq_off.cqes);
+
+            for (size_t i = 0; i < max(depth, size_t(1)); ++i) {
+                slots.push_back(slot {unique_ptr<char[]>(new char[block_size]), 0, 0, 0, 0, false, false});
+            }
+            for (size_t i = 0; i < slots.size() && next < file_size; ++i) {
+                submit(i);
+            }
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    ~uring_source() {
+        release();
+    }
+
+    uring_source(uring_source const&) = delete;
+    uring_source& operator= (uring_source const&) = delete;
+
+    size_t operator() (char* const d, size_t const n) {
+        slot& k = slots[current];
+        if (!k.busy) {
+            return 0;
+        }
+        if (!k.done) {
+            reap(false);
+            if (!k.done) {
+                waits.time([this, &k] {
+                    while (!k.done) {
+                        reap(true);
+                    }
+                });
+            }
+        }
+        if (k.error != 0) {
+            throw system_error(k.error, system_category(), "unable to read file");
+        }
+        complete(k);
+        ++waits.reads;
+        size_t const m = min(n, k.size - at);
+        memcpy(d, k.data.get() + at, m);
+        at += m;
+        if (at == k.size) {
+            at = 0;
+            k.busy = false;
+            if (next < file_size) {
+                submit(current);
+            }
+            current = (current + 1) % slots.size();
+        }
+        return m;
+    }
+
+    stall_stats const& stalls() const {
+        return waits;
+    }
+};
+
+#endif // __linux__
+
+//============================================================================
+// Read Ahead Range
+//
+// A range over a file that is read ahead of the parser, 'depth' blocks at a
+// time, so the parser does not wait for each block to be read, and I/O and
+// parsing overlap. It uses io_uring when the kernel supports it (and
+// 'use_uring' is set), otherwise a helper thread (an async_source, see
+// "block_range.hpp"). Like the stream_range it is a block_range, so the
+// iterators and backtracking are the same, and the blocks behind the parser
+// are freed, but it does not map the file, so there are no page faults.
+// stalls() reports how long the parser waited.
+
+struct readahead_file {
+    int const fd;
+#ifdef __linux__
+    unique_ptr<uring_source> uring;
+#endif
+    unique_ptr<async_source> async;
+
+    readahead_file(char const* name, size_t const block_size, size_t const depth,
+        bool const use_uring) : fd(::open(name, O_RDONLY)) {
+        if (fd < 0) {
+            throw runtime_error("unable to open file");
+        }
+        struct stat s;
+#ifdef __linux__
+        if (use_uring && fstat(fd, &s) == 0 && S_ISREG(s.st_mode)) {
+            try {
+                uring.reset(new uring_source(fd, block_size, depth));
+                return;
+            } catch (system_error const&) {
+            }
+        }
+#endif
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        int const f = fd;
+        async.reset(new async_source([f](char* d, size_t n) {
+            ssize_t const m = ::read(f, d, n);
+            if (m < 0) {
+                throw system_error(errno, system_category(), "unable to read file");
+            }
+            return static_cast<size_t>(m);
+        }, block_size, depth));
+    }
+
+    // the reads are finished before the file is closed.
+    ~readahead_file() {
+#ifdef __linux__
+        uring.reset();
+#endif
+        async.reset();
+        ::close(fd);
+    }
+
+    readahead_file(readahead_file const&) = delete;
+    readahead_file& operator= (readahead_file const&) = delete;
+
+    size_t read(char* const d, size_t const n) {
+#ifdef __linux__
+        if (uring) {
+            return (*uring)(d, n);
+        }
+#endif
+        return (*async)(d, n);
+    }
+
+    char const* engine() const {
+#ifdef __linux__
+        if (uring) {
+            return "io_uring";
+        }
+#endif
+        return "thread";
+    }
+
+    stall_stats const& stalls() const {
+#ifdef __linux__
+        if (uring) {
+            return uring->stalls();
+        }
+#endif
+        return async->stalls();
+    }
+};
+
+class readahead_range : private readahead_file, public block_range {
+public:
+    using readahead_file::engine;
+    using readahead_file::stalls;
+
+    readahead_range(readahead_range const&) = delete;
+
+    explicit readahead_range(char const* name, size_t const block_size = size_t(1) << 16,
+        size_t const depth = 4, bool const use_uring = true)
+        : readahead_file(name, block_size, depth, use_uring),
+        block_range([this](char* d, size_t n) {return read(d, n);}, block_size) {}
+
+    explicit readahead_range(string const& name, size_t const block_size = size_t(1) << 16,
+        size_t const depth = 4, bool const use_uring = true)
+        : readahead_range(name.c_str(), block_size, depth, use_uring) {}
+};
+
+#ifdef USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using preadahead_handle = parser_inline_handle<readahead_range::iterator, readahead_range, Synthesize, Inherit>;
+
+#else // USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using preadahead_handle = parser_handle<readahead_range::iterator, readahead_range, Synthesize, Inherit>;
+
+#endif // USE_INLINE_HANDLE
+
+#endif // READAHEAD_RANGE_HPP
@@ -0,0 +1,176 @@
+//----------------------------------------------------------------------------
+// copyright 2014 Keean Schupke
+// compile with -std=c++11
+// rope_range.hpp
+
+#ifndef ROPE_RANGE_HPP
+#define ROPE_RANGE_HPP
+
+#include <vector>
+#include <utility>
+#include "parser_combinators.hpp"
+
+using namespace std;
+
+//============================================================================
+// Rope Range
+//
+// A range over a sequence of buffers (read chunks, message fragments) that
+// are not contiguous with each other, parsed in place without copying them
+// together. The iterator is a pointer into a buffer, and crossing to the next
+// buffer costs one (well predicted) branch in ++. The iterators are
+// segmented, so a span that lies within one buffer is returned as a view of
+// it, and only a span that straddles buffers is gathered into a copy. The
+// buffers are not owned, and must outlive the range and any spans of it.
+
+class rope_range {
+    struct segment {
+        char const* first;
+        char const* last;
+        streamoff offset;
+    };
+
+    vector<segment> const segments;
+    mutable unique_ptr<line_index> index;
+
+    // where iterators at the end point, so that reading there is harmless.
+    static char const* sentinel() {
+        static char const s = 0;
+        return &s;
+    }
+
+    static streamoff size(vector<segment> const& ss) {
+        return ss.empty() ? 0 : ss.back().offset + (ss.back().last - ss.back().first);
+    }
+
+    // empty buffers are left out, so no segment is empty.
+    static void add(vector<segment>& ss, char const* const data, size_t const size) {
+        if (size > 0) {
+            ss.push_back(segment {data, data + size, rope_range::size(ss)});
+        }
+    }
+
+    static void add(vector<segment>& ss, pair<char const*, size_t> const& b) {
+        add(ss, b.first, b.second);
+    }
+
+    template <typename Buffer>
+    static auto add(vector<segment>& ss, Buffer const& b) -> decltype(b.data(), b.size(), void()) {
+        add(ss, b.data(), b.size());
+    }
+
+    template <typename Iterator>
+    static vector<segment> build(Iterator f, Iterator const& l) {
+        vector<segment> ss;
+        for (; f != l; ++f) {
+            add(ss, *f);
+        }
+        return ss;
+    }
+
+public:
+    class iterator {
+        friend class rope_range;
+
+        rope_range const* r;
+        size_t seg;
+        char const* p;
+        char const* end;
+        streamoff pos;
+
+        iterator(rope_range const* r, size_t const seg) : r(r), seg(seg) {
+            if (seg < r->segments.size()) {
+                segment const& s = r->segments[seg];
+                p = s.first;
+                end = s.last;
+                pos = s.offset;
+            } else {
+                p = end = sentinel();
+                pos = size(r->segments);
+            }
+        }
+
+    public:
+        char operator* () const {
+            return *p;
+        }
+
+        bool operator== (iterator const& i) const {
+            return pos == i.pos;
+        }
+
+        bool operator!= (iterator const& i) const {
+            return pos != i.pos;
+        }
+
+        streamoff operator- (iterator const& i) const {
+            return pos - i.pos;
+        }
+
+        iterator& operator++ () {
+            ++pos;
+            if (++p == end) {
+                *this = iterator(r, seg + 1);
+            }
+            return *this;
+        }
+
+        iterator& operator-- () {
+            --pos;
+            if (seg == r->segments.size() || p == r->segments[seg].first) {
+                segment const& s = r->segments[--seg];
+                end = s.last;
+                p = end - 1;
+            } else {
+                --p;
+            }
+            return *this;
+        }
+
+        // segmented iterators: if [*this, i) lies in one buffer, its addresses.
+        bool contiguous(iterator const& i, char const*& f, char const*& l) const {
+            if (seg == i.seg || i.pos - pos == end - p) {
+                f = p;
+                l = p + (i.pos - pos);
+                return true;
+            }
+            return false;
+        }
+    };
+
+    iterator const first;
+    iterator const last;
+
+    rope_range(rope_range const&) = delete;
+
+    // from a sequence of buffers, each with data() and size(), or of
+    // (pointer, size) pairs.
+    template <typename Buffers>
+    explicit rope_range(Buffers const& bs) : rope_range(bs.begin(), bs.end()) {}
+
+    template <typename Iterator>
+    rope_range(Iterator f, Iterator const& l) : segments(build(f, l)),
+        first(this, 0), last(this, segments.size()) {}
+
+    // built the first time an error needs it.
+    line_index const& lines() const {
+        if (index == nullptr) {
+            index.reset(new line_index(*this));
+        }
+        return *index;
+    }
+};
+
+#ifdef USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using prope_handle = parser_inline_handle<rope_range::iterator, rope_range, Synthesize, Inherit>;
+
+#else // USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using prope_handle = parser_handle<rope_range::iterator, rope_range, Synthesize, Inherit>;
+
+#endif // USE_INLINE_HANDLE
+
+#endif // ROPE_RANGE_HPP
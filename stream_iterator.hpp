@@ -11,6 +11,7 @@ using namespace std;
 
 class stream_range {
     file_vector<char> file;
+    mutable unique_ptr<line_index> index;
 
 public:
     using iterator = file_vector<char>::const_iterator;
@@ -22,98 +23,57 @@ public:
 
     stream_range(char const* name) : file(name), first(file.cbegin()), last(file.cend()) {}
     stream_range(string const& name) : stream_range(name.c_str()) {}
+
+    // built the first time an error needs it.
+    line_index const& lines() const {
+        if (index == nullptr) {
+            index.reset(new line_index(*this));
+        }
+        return *index;
+    }
 };
 
 #else // USE_MMAP
 
-#include <streambuf>
 #include <fstream>
+#include "block_range.hpp"
 
-class stream_range {
-    fstream file;
-    streambuf *rd;
-    streamoff pos;
-
-public:
-    class iterator {
-        friend class stream_range;
- 
-        iterator(stream_range *r, streamoff pos) : r(r), pos(pos), sym(r->rd->sgetc()) {
-            r->pos = pos;
-        }
-
-        stream_range *r;
-        streamoff pos;
-        int sym;
-
-    public:
-        int operator* () const {
-            return sym;
-        }
-
-        bool operator== (iterator const& i) const {
-            return (r == i.r) && (sym == i.sym) && (pos == i.pos);
-        }
-        
-        bool operator!= (iterator const& i) const {
-            return (r != i.r) || (sym != i.sym) || (pos != i.pos);
-        }
-
-        streamoff operator- (iterator const& i) const {
-            return pos - i.pos;
-        }
-
-        iterator& operator++ () {
-            if (r->pos != pos) {
-                r->pos = r->rd->pubseekoff(++pos, ios_base::beg);
-                sym = r->rd->sgetc();
-            } else {
-                r->pos = ++pos;
-                sym = r->rd->snextc();
-            }
-            return *this;
-        }
-
-        iterator& operator-- () {
-            --pos;
-            if (r->pos != pos) { 
-                r->pos = r->rd->pubseekoff(pos, ios_base::beg);
-            }
-            sym = r->rd->sgetc();
-            return *this;
-        }
+// The file is read in blocks, see "block_range.hpp", so iterators are cheap
+// and backtracking does not seek the file. The file is a base, so it is open
+// before the block_range reads the first block.
+struct stream_file {
+    ifstream file;
 
-        iterator& operator= (iterator const& i) {
-            r = i.r;
-            pos = i.pos;
-            sym = i.sym;
-            return *this;
-        }
-    };
-
-    friend class stream_range::iterator;
-
-    iterator const last;
-    iterator const first;
-
-    stream_range(stream_range const&) = delete;
-
-    stream_range(char const* name) : file(name, ios_base::in),
-        rd(file.rdbuf()), pos(0),
-        last(this, rd->pubseekoff(0, ios_base::end)),
-        first(this, rd->pubseekoff(0, ios_base::beg)
-    ) {
+    explicit stream_file(char const* name) : file(name, ios_base::in | ios_base::binary) {
         if (!file.is_open()) {
             throw runtime_error("unable to open file");
         }
     }
+};
+
+class stream_range : private stream_file, public block_range {
+public:
+    stream_range(stream_range const&) = delete;
+
+    stream_range(char const* name) : stream_file(name), block_range([this](char* d, size_t n) {
+            return static_cast<size_t>(file.rdbuf()->sgetn(d, n));
+        }) {}
 
     stream_range(string const& name) : stream_range(name.c_str()) {}
 };
 
 #endif // USE_MMAP
 
+#ifdef USE_INLINE_HANDLE
+
+template <typename Synthesize = void, typename Inherit = default_inherited>
+using pstream_handle = parser_inline_handle<stream_range::iterator, stream_range, Synthesize, Inherit>;
+
+#else // USE_INLINE_HANDLE
+
 template <typename Synthesize = void, typename Inherit = default_inherited>
 using pstream_handle = parser_handle<stream_range::iterator, stream_range, Synthesize, Inherit>;
 
+#endif // USE_INLINE_HANDLE
+
 #endif // STREAM_ITERATOR_HPP
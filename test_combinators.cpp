@@ -2,11 +2,25 @@
 #include <iostream>
 #include <vector>
 #include <sstream>
+#include <locale>
+#include <clocale>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 
 #include "templateio.hpp"
 #include "parser_combinators.hpp"
 #include "profile.hpp"
 #include "stream_iterator.hpp"
+#include "memory_range.hpp"
+#include "block_range.hpp"
+#include "rope_range.hpp"
+#include "compressed_range.hpp"
+#include "readahead_range.hpp"
+#include "mmap_range.hpp"
+#include "parser_deep.hpp"
+#include "parser_vm.hpp"
+#include "journal.hpp"
 
 using namespace std;
 
@@ -30,15 +44,19 @@ struct parse_line {
 auto const number_tok = tokenise(some(accept(is_digit)));
 auto const separator_tok = tokenise(accept(is_char(',')));
 
+auto const csv_line = all(parse_line, sep_by(all(parse_int, number_tok), separator_tok));
+
+// lines are independent, so after the first they are parsed in parallel
+// chunks split at newlines (when the input is mmap'd).
 auto const parse_csv = strict("error parsing csv",
-    first_token && some(all(parse_line, sep_by(all(parse_int, number_tok), separator_tok)))
+    first_token && csv_line && parallel_many(csv_line, is_eol)
 );
 
 struct csv_parser;
 
 template <typename Range>
 int parse(Range const &r) {
-    decltype(parse_csv)::result_type a; 
+    decltype(parse_csv)::result_type a;
     typename Range::iterator i = r.first;
 
     profile<csv_parser> p;
@@ -56,23 +74,1275 @@ int parse(Range const &r) {
     }
     sum /= a.size();
     cerr << sum << endl;
-    
+
     return i - r.first;
 }
 
 //----------------------------------------------------------------------------
+// Tests: each checks the behaviour of one combinator on small inputs, and
+// they are all run before any files are parsed.
 
-int main(int const argc, char const *argv[]) {
-    if (argc < 1) {
-        cerr << "no input files\n";
-    } else {
-        for (int i = 1; i < argc; ++i) {
-            profile<csv_parser>::reset();
-            stream_range in(argv[i]);
-            cout << argv[i] << "\n";
-            int const chars_read = parse(in);
-            double const mb_per_s = static_cast<double>(chars_read) / static_cast<double>(profile<csv_parser>::report());
-            cout << "parsed: " << mb_per_s << "MB/s\n";
+int failures = 0;
+
+void check(bool const ok, char const* what) {
+    if (!ok) {
+        cerr << "test failed: " << what << "\n";
+        ++failures;
+    }
+}
+
+// Does p accept all of s.
+template <typename Parser, typename Inherit = default_inherited>
+bool parses(Parser const& p, string const& s, typename Parser::result_type* result = nullptr,
+    Inherit* st = nullptr) {
+    memory_range const r(s);
+    char const* i = r.first;
+    return p(i, r, result, st) && i == r.last;
+}
+
+// The reason for the parse_error p throws on s, or "" if there is none.
+template <typename Parser>
+string error_of(Parser const& p, string const& s, typename Parser::result_type* result = nullptr) {
+    memory_range const r(s);
+    char const* i = r.first;
+    try {
+        p(i, r, result);
+    } catch (parse_error const& e) {
+        return e.reason();
+    }
+    return "";
+}
+
+// A source for a block_range that reads s in pieces of at most 'piece'; s
+// must outlive the range.
+block_range::source_type string_source(string const& s, size_t const piece = 3) {
+    shared_ptr<size_t> const at = make_shared<size_t>(0);
+    return [&s, piece, at](char* d, size_t n) {
+        n = min(min(n, piece), s.size() - *at);
+        memcpy(d, s.data() + *at, n);
+        *at += n;
+        return n;
+    };
+}
+
+//----------------------------------------------------------------------------
+// as_span
+
+void test_spans() {
+    auto const word = as_span(some(accept(is_alpha)));
+    auto const words = word && as_span(accept(is_space)) && word;
+    string const s = "hello world";
+    {
+        memory_range const r(s);
+        char const* i = r.first;
+        char_span w;
+        check(word(i, r, &w) && w == "hello" && w.data() == s.data(),
+            "span of contiguous input is a view of it");
+        i = r.first;
+        w = char_span();
+        check(words(i, r, &w) && w == "hello world" && w.data() == s.data(),
+            "adjacent spans of contiguous input extend the view");
+    }
+    char_span g;
+    {
+        block_range const r(string_source(s), 4);
+        block_range::iterator i = r.first;
+        check(word(i, r, &g) && g == "hello" && g.data() != s.data(),
+            "span of stream input is copied");
+        char_span h;
+        i = r.first;
+        check(words(i, r, &h) && h == "hello world", "spans of stream input are gathered");
+    }
+    check(g == "hello", "span of stream input outlives the range");
+}
+
+//----------------------------------------------------------------------------
+// accept_any_str
+
+// the index of the literal p matches at the start of s, and how much it
+// reads, or -1.
+template <typename Parser>
+pair<int, size_t> literal_of(Parser const& p, string const& s) {
+    memory_range const r(s);
+    char const* i = r.first;
+    int k = -1;
+    if (!p(i, r, &k)) {
+        return make_pair(-1, size_t(0));
+    }
+    return make_pair(k, static_cast<size_t>(i - r.first));
+}
+
+void test_literal_sets() {
+    accept_any_str const ops({"<", "<=", "<<", "<<=", "="});
+    check(literal_of(ops, "<") == make_pair(0, size_t(1)), "single literal");
+    check(literal_of(ops, "<=") == make_pair(1, size_t(2)), "longest match");
+    check(literal_of(ops, "<<=") == make_pair(3, size_t(3)), "longest match of three");
+    check(literal_of(ops, "<<<") == make_pair(2, size_t(2)), "longest match, then other input");
+    check(literal_of(ops, "<>") == make_pair(0, size_t(1)), "prefix of no longer literal");
+    check(literal_of(ops, ">") == make_pair(-1, size_t(0)), "no literal");
+    check(literal_of(ops, "") == make_pair(-1, size_t(0)), "no literal at the end");
+
+    accept_any_str const words({"do", "done", "double"});
+    check(literal_of(words, "dou") == make_pair(0, size_t(2)),
+        "falls back to a shorter literal when a longer one is not complete");
+    check(literal_of(words, "done") == make_pair(1, size_t(4)), "literal sharing a prefix");
+
+    accept_any_str const keywords({"begin", "end"}, true);
+    check(literal_of(keywords, "BeGiN") == make_pair(0, size_t(5)), "ignoring case");
+    check(literal_of(accept_any_str({"end"}), "END") == make_pair(-1, size_t(0)),
+        "not ignoring case");
+
+    accept_any_str const optional({"", "+", "-"});
+    check(literal_of(optional, "-1") == make_pair(2, size_t(1)), "literal before the empty literal");
+    check(literal_of(optional, "1") == make_pair(0, size_t(0)), "empty literal");
+    check(literal_of(optional, "") == make_pair(0, size_t(0)), "empty literal at the end");
+    check(optional.first().nullable && !ops.first().nullable, "empty literal is nullable");
+    check(ops.first().symbols('<') && ops.first().symbols('=') && !ops.first().symbols('>'),
+        "first symbols of the literals");
+}
+
+//----------------------------------------------------------------------------
+// FIRST sets and choice dispatch
+
+// accepts one symbol of a class, and counts how often it is tried. Without
+// 'starts' it does not report its FIRST set, as a parser from outside the
+// library might not.
+template <bool Starts> struct counted {
+    using is_parser_type = true_type;
+    using is_handle_type = false_type;
+    using has_side_effects = false_type;
+    using result_type = string;
+    int const rank = 0;
+
+    char_class const cls;
+    int* const tries;
+
+    counted(char_class const& c, int* n) : cls(c), tries(n) {}
+
+    template <typename Iterator, typename Range, typename Inherit = default_inherited>
+    bool operator() (Iterator &i, Range const &r, string *result = nullptr, Inherit* st = nullptr) const {
+        ++*tries;
+        if (i == r.last || !cls(*i)) {
+            return false;
+        }
+        if (result != nullptr) {
+            result->push_back(*i);
+        }
+        ++i;
+        return true;
+    }
+
+    template <bool S = Starts, typename = typename enable_if<S>::type>
+    first_set first() const {
+        return first_set(cls, false);
+    }
+
+    string ebnf(unique_defs* defs = nullptr) const {
+        return "counted";
+    }
+};
+
+void test_first_sets() {
+    int a = 0;
+    int b = 0;
+    auto const ab = counted<true>(char_class(is_char('a')), &a)
+        || counted<true>(char_class(is_char('b')), &b);
+    check(parses(ab, "b") && a == 0 && b == 1, "choice goes straight to the only alternative");
+    check(!parses(ab, "c") && a == 0 && b == 1, "choice tries no alternative");
+
+    a = 0;
+    b = 0;
+    auto const unknown = counted<false>(char_class(is_char('a')), &a)
+        || counted<true>(char_class(is_char('b')), &b);
+    check(parses(unknown, "b") && a == 1 && b == 1, "a parser without first() is always tried");
+
+    auto const overlap = attempt(accept_str("ab")) || accept_str("ac") || accept(is_digit);
+    string s;
+    check(parses(overlap, "ac", &s) && s == "ac", "overlapping alternatives are tried in order");
+    s.clear();
+    check(parses(overlap, "7", &s) && s == "7", "three way choice");
+    check(error_of(accept_str("ab") || accept_str("ac"), "ac") == "failed parser consumed input",
+        "an alternative that consumes input is an error");
+
+    auto const optional = accept(is_char('a')) || succ;
+    check(parses(optional, "") && parses(optional, "a"), "nullable alternative at the end");
+    check((many(accept(is_char('a'))) && accept(is_char('b'))).first().symbols('b'),
+        "FIRST of a sequence includes what follows a nullable parser");
+    check(!(accept(is_char('a')) && accept(is_char('b'))).first().symbols('b'),
+        "FIRST of a sequence stops at a parser that is not nullable");
+
+    // the choice holds a copy of the handle, so it keeps its alternative
+    // (and routes) when the handle is assigned again.
+    pmemory_handle<string> h = accept(is_char('a'));
+    auto const either = h || accept(is_char('b'));
+    h = accept(is_char('c'));
+    check(parses(either, "a") && parses(either, "b") && !parses(either, "c"),
+        "choice keeps a handle's alternative when the handle is assigned");
+    check(parses(h, "c"), "assigned handle");
+    pmemory_handle<string> empty;
+    check(empty.first().nullable && empty.first().symbols('z'),
+        "a handle not yet assigned can start with anything");
+}
+
+//----------------------------------------------------------------------------
+// memo
+
+void test_memo() {
+    int tries = 0;
+    memo_stats stats;
+    auto const a = memo(counted<true>(char_class(is_char('a')), &tries), &stats);
+    auto const ax_or_ay = attempt(a && accept(is_char('x'))) || a && accept(is_char('y'));
+    string s;
+    {
+        memo_context memos;
+        check(parses(ax_or_ay, "ay", &s) && s == "ay", "memoized result is replayed");
+    }
+    check(tries == 1 && stats.hits == 1 && stats.misses == 1, "memoized rule is parsed once");
+
+    tries = 0;
+    {
+        memo_context memos;
+        check(!parses(ax_or_ay, "az") && tries == 1, "memoized rule is not parsed again when both fail");
+    }
+
+    tries = 0;
+    auto const unknown = memo(counted<false>(char_class(is_char('a')), &tries));
+    {
+        memo_context memos;
+        check(!parses(unknown || unknown, "b") && tries == 1, "memoized failure is replayed");
+    }
+
+    // without a context, each call has its own tables.
+    tries = 0;
+    check(parses(a, "a") && parses(a, "a") && tries == 2, "tables go with the call");
+    tries = 0;
+    {
+        memo_context memos;
+        check(parses(a, "a") && tries == 1, "memoized in a context");
+        a.reset();
+        check(parses(a, "a") && tries == 2, "reset forgets the tables");
+    }
+
+    // many rules memoized in one context each keep their own table.
+    int counts[64] {};
+    vector<parser_memo<counted<true>>> rules;
+    for (int k = 0; k < 64; ++k) {
+        rules.push_back(memo(counted<true>(char_class(is_char('a' + k % 26)), &counts[k])));
+    }
+    string const input = "abcdefghijklmnopqrstuvwxyz";
+    bool ok = true;
+    {
+        memo_context memos;
+        memory_range const r(input);
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int k = 0; k < 64; ++k) {
+                char const* i = r.first + k % 26;
+                ok = ok && rules[k](i, r) && i == r.first + k % 26 + 1;
+            }
+        }
+    }
+    ok = ok && all_of(begin(counts), end(counts), [](int const n) {return n == 1;});
+    check(ok, "many memoized rules in one context");
+}
+
+//----------------------------------------------------------------------------
+// operators
+
+// builds the expression as a string, with every operation in parentheses.
+struct show_infix {
+    show_infix() {}
+    void operator() (string *res, string& left, string& op, string& right) const {
+        *res = "(" + left + op + right + ")";
+    }
+} const show_infix;
+
+struct show_prefix {
+    show_prefix() {}
+    void operator() (string *res, string& op, string& right) const {
+        *res = "(" + op + right + ")";
+    }
+} const show_prefix;
+
+struct show_postfix {
+    show_postfix() {}
+    void operator() (string *res, string& left, string& op) const {
+        *res = "(" + left + op + ")";
+    }
+} const show_postfix;
+
+struct show_checked {
+    show_checked() {}
+    void operator() (string *res, string& left, string& op, string& right) const {
+        if (right == "0") {
+            throw runtime_error("division by zero");
+        }
+        *res = "(" + left + op + right + ")";
+    }
+} const show_checked;
+
+void test_operators() {
+    auto const term = some(accept(is_digit));
+    auto const tok = [](char const c) {
+        return accept(is_char(c));
+    };
+    auto const expr = operators(term,
+        infix_left(10, tok('+'), show_infix),
+        infix_left(10, tok('-'), show_infix),
+        infix_left(20, tok('*'), show_infix),
+        infix_left(20, tok('/'), show_checked),
+        infix_right(30, tok('^'), show_infix),
+        prefix(25, tok('-'), show_prefix),
+        postfix(40, tok('!'), show_postfix));
+    string s;
+    check(parses(expr, "1+2*3", &s) && s == "(1+(2*3))", "precedence");
+    s.clear();
+    check(parses(expr, "1-2-3", &s) && s == "((1-2)-3)", "left associative");
+    s.clear();
+    check(parses(expr, "2^3^4", &s) && s == "(2^(3^4))", "right associative");
+    s.clear();
+    check(parses(expr, "-2*3", &s) && s == "((-2)*3)", "prefix binds tighter than infix");
+    s.clear();
+    check(parses(expr, "-2^3", &s) && s == "(-(2^3))", "prefix binds looser than infix");
+    s.clear();
+    check(parses(expr, "3!^2", &s) && s == "((3!)^2)", "postfix");
+    check(error_of(expr, "1/0") == "division by zero", "functor error");
+    check(!parses(expr, "1+"), "infix without a right operand");
+
+    // the extremes of precedence.
+    auto const extremes = operators(term,
+        infix_left(numeric_limits<int>::max(), tok('*'), show_infix),
+        infix_left(numeric_limits<int>::min(), tok('+'), show_infix),
+        infix_right(numeric_limits<int>::max(), tok('^'), show_infix));
+    s.clear();
+    check(parses(extremes, "1+2*3*4+5", &s) && s == "((1+((2*3)*4))+5)",
+        "left associative at the highest and lowest precedence");
+    s.clear();
+    check(parses(extremes, "2^3^4", &s) && s == "(2^(3^4))",
+        "right associative at the highest precedence");
+}
+
+//----------------------------------------------------------------------------
+// Journaled inherited attributes
+
+struct tally : journal {
+    journaled_vector<int> digits;
+    journaled_map<char, int> counts;
+    journaled_set<char> seen;
+
+    tally() : digits(*this), counts(*this), seen(*this) {}
+};
+
+struct record_digit {
+    record_digit() {}
+    void operator() (string *res, string& d, tally* st) const {
+        int const n = d[0] - '0';
+        st->digits.push_back(n);
+        auto const i = st->counts.find(d[0]);
+        st->counts.assign(d[0], (i == st->counts.end()) ? 1 : i->second + 1);
+        st->seen.insert(d[0]);
+        res->append(d);
+    }
+} const record_digit;
+
+void test_journal() {
+    tally t;
+    t.digits.push_back(1);
+    t.seen.insert('a');
+    journal::checkpoint const outer = t.mark();
+    t.digits.push_back(2);
+    t.digits.assign(0, 5);
+    t.counts.assign('x', 1);
+    t.seen.erase('a');
+    journal::checkpoint const inner = t.mark();
+    t.digits.pop_back();
+    t.digits.push_back(3);
+    t.counts.assign('x', 2);
+    t.seen.insert('b');
+    t.rollback(inner);
+    check(t.digits.get() == vector<int> {5, 2} && t.counts.find('x')->second == 1
+        && t.seen.empty(), "rollback undoes the changes since the inner mark");
+    journal::checkpoint const again = t.mark();
+    t.digits.clear();
+    t.counts.clear();
+    t.commit(again);
+    check(t.digits.empty() && t.counts.empty(), "commit keeps the changes");
+    t.rollback(outer);
+    check(t.digits.get() == vector<int> {1} && t.counts.empty() && t.seen.count('a') == 1,
+        "rollback undoes committed inner changes");
+    t.digits.push_back(4);
+    check(t.digits.get() == vector<int> {1, 4}, "changes outside a mark are kept");
+
+    // attempt rolls the journal back when its parser fails.
+    auto const digit = all(record_digit, accept(is_digit));
+    auto const p = attempt(some(digit) && accept(is_char(';'))) || some(digit) && accept(is_char('.'));
+    tally u;
+    string s;
+    check(parses(p, "121.", &s, &u) && s == "121.", "journaled parse");
+    check(u.digits.get() == vector<int> {1, 2, 1} && u.counts.find('1')->second == 2
+        && u.counts.size() == 2 && u.seen.size() == 2, "attempt rolls back the journal");
+}
+
+//----------------------------------------------------------------------------
+// Backtracking results
+
+// an inherited attribute without a journal, which attempt copies to backtrack.
+struct letters {
+    int count = 0;
+};
+
+struct count_letter {
+    count_letter() {}
+    void operator() (string *res, string& a, letters* st) const {
+        ++st->count;
+        res->append(a);
+    }
+} const count_letter;
+
+void test_attempt() {
+    string const abc = "abc";
+    string s = "x";
+    memory_range const r(abc);
+    char const* i = r.first;
+    check(!attempt(accept_str("abd"))(i, r, &s) && i == r.first && s == "x",
+        "attempt restores the input and the string");
+
+    auto const ints = sep_by(all(parse_int, number_tok), separator_tok);
+    string const line = "1,2,3";
+    vector<int> v {9};
+    memory_range const q(line);
+    i = q.first;
+    check(!attempt(ints && discard(accept(is_char(';'))))(i, q, &v) && i == q.first
+        && v == vector<int> {9}, "attempt truncates the vector");
+
+    char_span c;
+    i = r.first;
+    check(!attempt(as_span(accept_str("abd")))(i, r, &c) && i == r.first && c.empty(),
+        "attempt truncates the span");
+
+    s.clear();
+    check(parses(attempt(accept_str("ab") && accept(is_char('d'))) || accept_str("abc"), "abc", &s)
+        && s == "abc", "choice writes the second alternative over the first");
+
+    auto const letter = all(count_letter, accept(is_alpha));
+    auto const p = attempt(some(letter) && accept(is_char(';'))) || some(letter) && accept(is_char('.'));
+    letters st;
+    s.clear();
+    check(parses(p, "abc.", &s, &st) && s == "abc." && st.count == 3,
+        "attempt restores a copied inherited attribute");
+}
+
+//----------------------------------------------------------------------------
+// error_channel
+
+// the status of parsing all of s with p through a channel, and the reason
+// of the channel's error.
+template <typename Parser>
+pair<parse_status, string> status_of(Parser const& p, string const& s) {
+    memory_range const r(s);
+    auto const ch = make_error_channel(r);
+    char const* i = r.first;
+    bool const ok = p(i, ch) && i == r.last;
+    return make_pair(ch.status(ok), ok ? string() : string(ch.to_error().reason()));
+}
+
+void test_error_channel() {
+    auto const number = some(accept(is_digit));
+    auto const list = strict("bad list", number && many(accept(is_char(',')) && number));
+    check(status_of(list, "1,23") == make_pair(parse_status::ok, string()), "ok");
+    check(status_of(accept(is_char('a')) || accept(is_char('b')), "c")
+        == make_pair(parse_status::fail, string("unexpected input")), "fail");
+    check(status_of(list, "x") == make_pair(parse_status::error, string("bad list")),
+        "a hard error is recorded, not thrown");
+    check(status_of(list, "1,x").second == "failed many-parser consumed input",
+        "the error inside a strict parser is kept");
+    check(status_of(strict("outer", strict("inner", number && accept(is_char(';')))), "1.")
+        .second == "inner", "the first hard error is kept");
+    check(status_of(accept_str("ab") || accept(is_digit), "ax").first == parse_status::error,
+        "a choice stops at an error");
+
+    string const s = "12x";
+    memory_range const r(s);
+    auto const ch = make_error_channel(r);
+    char const* i = r.first;
+    check(!(number && (accept(is_char(';')) || accept(is_char('.'))))(i, ch)
+        && ch.furthest() == 2, "the furthest failure");
+    string const what = ch.to_error().what();
+    check(what.find("';'") != string::npos && what.find("'.'") != string::npos,
+        "all that was expected at the furthest failure");
+    ch.clear();
+    check(!ch.error() && ch.furthest() == -1, "clear");
+
+    // a handle parses through a channel over its range.
+    pmemory_handle<string> const h = strict("not a number", number);
+    string n;
+    i = r.first;
+    check(h(i, ch, &n) && n == "12" && !ch.error(), "handle through a channel");
+    check(!h(i, ch) && ch.error() && string(ch.to_error().reason()) == "not a number",
+        "handle records an error in the channel");
+}
+
+//----------------------------------------------------------------------------
+// rule
+
+// a nested list of letters, which refers to itself before it is defined.
+struct nested_rule {};
+auto const nested = rule<nested_rule, string>("nested");
+auto const nested_list = accept(is_char('(')) && many(nested) && accept(is_char(')'));
+auto const nested_item = accept(is_alpha) || nested_list;
+
+decltype(nested_item) const& rule_definition(nested_rule) {
+    return nested_item;
+}
+
+void test_rules() {
+    string s;
+    check(parses(nested, "(a(b()c)d)", &s) && s == "(a(b()c)d)", "recursive rule");
+    s.clear();
+    check(parses(nested, "x", &s) && s == "x", "rule without recursion");
+    check(!parses(nested, "(a(b)"), "unbalanced input");
+    check(error_of(strict("bad nesting", nested), "(a1)") == "bad nesting", "a rule in a strict parser");
+    unique_defs defs;
+    check(nested.ebnf(&defs) == "nested" && defs.count("nested") == 1
+        && defs["nested"].find("nested") != string::npos, "a recursive rule is defined once");
+}
+
+//----------------------------------------------------------------------------
+// deep
+
+void test_deep() {
+    size_t const n = 200000;
+    string const s = string(n, '(') + "a" + string(n, ')');
+    check(parses(deep(nested, n + 1), s), "nesting deeper than the native stack");
+    check(error_of(deep(nested), s) == "nesting too deep", "nesting beyond the limit");
+    check(error_of(deep(nested, 3), "(((a)))") == "nesting too deep", "a small limit");
+    check(parses(deep(nested, 4), "(((a)))"), "nesting up to the limit");
+    check(parses(deep(deep(nested, 4)), "(((a)))"), "a deep parser inside one runs in place");
+}
+
+//----------------------------------------------------------------------------
+// optimise
+
+// whether p accepts s, how much it reads, its result, and its error.
+template <typename Parser>
+tuple<bool, size_t, string, string> outcome_of(Parser const& p, string const& s) {
+    memory_range const r(s);
+    char const* i = r.first;
+    string a;
+    try {
+        bool const ok = p(i, r, &a);
+        return make_tuple(ok, static_cast<size_t>(i - r.first), a, string());
+    } catch (parse_error const& e) {
+        return make_tuple(false, size_t(0), string(), string(e.reason()));
+    }
+}
+
+void test_optimise() {
+    auto const sign = accept(is_char('+')) || accept(is_char('-'));
+    auto const digits = some(accept(is_digit));
+    auto const keyword = accept(is_char('i')) && accept(is_char('f')) && accept(is_char(' '));
+    auto const statement = keyword && (sign && digits || digits || accept(is_alpha) && many(accept(is_alnum)));
+    auto const program = many(statement && accept(is_char(';')));
+    auto const fast = optimise(program);
+    for (char const* s : {"", "if +12;", "if -3;if 45;if x9;", "if 1;if +;", "if x", "i", "if ;"}) {
+        check(outcome_of(program, s) == outcome_of(fast, s), s);
+    }
+    check(fast.ebnf() == program.ebnf(), "optimised grammar has the same EBNF");
+    check(error_of(fast, "if 1;if +;") == "failed parser consumed input",
+        "optimised grammar has the same errors");
+}
+
+//----------------------------------------------------------------------------
+// parser_vm
+
+// the reason the grammar does not load, or "" if it does.
+string grammar_error_of(string const& text) {
+    try {
+        load_grammar(text);
+    } catch (parse_error const& e) {
+        return e.reason();
+    }
+    return "";
+}
+
+void test_vm() {
+    parser_vm csv = load_grammar(R"(
+        csv = strict("error parsing csv", {space}, {line}-);
+        line = token(integer), {token(','), token(integer)};
+    )");
+    vector<vector<int>> lines;
+    vector<int> line;
+    csv.capture("integer", [&line](string const& s) {
+        line.push_back(stoi(s));
+    });
+    csv.notify("line", [&lines, &line]() {
+        lines.push_back(move(line));
+        line.clear();
+    });
+    check(parses(csv, " 1, 2\n-3,4 \n5") && lines == vector<vector<int>> {{1, 2}, {-3, 4}, {5}},
+        "captures and notifications");
+    check(error_of(csv, "x") == "error parsing csv", "strict in a grammar");
+    check(error_of(csv, "1,") == "failed many-parser consumed input",
+        "a repetition that consumed input is an error");
+
+    string const rule_text = R"(
+        value = attempt("ab", 'c') | "a", {anything};
+        word = {alphabetic}-;
+    )";
+    check(parses(load_grammar(rule_text), "abd"), "attempt restores the input");
+    parser_vm const word = load_grammar(rule_text, "word");
+    check(parses(word, "abc") && !parses(word, "1"), "parsing from a named rule");
+    check(parses(load_grammar("e = \"\xe9t\xe9\";"), "\xe9t\xe9"), "literals beyond ASCII");
+    check(parses(load_grammar("e = '\xff', EOF;"), "\xff"), "a symbol beyond ASCII");
+
+    check(grammar_error_of("a = 'x'") == "syntax error in grammar", "a rule without a ';'");
+    check(grammar_error_of("a = (* no end") == "unterminated comment", "an unterminated comment");
+    check(grammar_error_of("a = \"x;") == "unterminated string", "an unterminated string");
+    check(!grammar_error_of("a = b;").empty(), "an undefined rule");
+
+    // errors go through an error_channel as for the template combinators.
+    string const bad = "x";
+    memory_range const r(bad);
+    auto const ch = make_error_channel(r);
+    char const* i = r.first;
+    check(!csv(i, ch) && ch.error() && string(ch.to_error().reason()) == "error parsing csv",
+        "an error through a channel");
+}
+
+//----------------------------------------------------------------------------
+// parallel_many
+
+void test_parallel_many() {
+    // records of digits and newlines ending in ';', so that chunks, which
+    // start after a newline, usually start inside a record.
+    auto const record = some(accept(is_digit) || accept(is_char('\n'))) && accept(is_char(';'));
+    auto const in_order = many(record);
+    auto const in_parallel = parallel_many(record, is_eol, 4, 8);
+    string s;
+    for (int k = 0; k < 500; ++k) {
+        s += to_string(k) + ((k % 3 == 0) ? "\n" : "") + to_string(k * 7) + ";" + ((k % 5 == 0) ? "\n" : "");
+    }
+    check(outcome_of(in_parallel, s) == outcome_of(in_order, s) && get<1>(outcome_of(in_order, s)) == s.size(),
+        "records straddling chunks");
+    check(outcome_of(in_parallel, s + "x") == outcome_of(in_order, s + "x"), "stops where many stops");
+
+    string bad = s;
+    bad[bad.size() / 2] = 'x';
+    check(outcome_of(in_parallel, bad) == outcome_of(in_order, bad)
+        && get<3>(outcome_of(in_parallel, bad)) == "failed many-parser consumed input",
+        "the same error as many");
+    memory_range const r(bad);
+    char const* i = r.first;
+    ptrdiff_t at = -1;
+    try {
+        in_parallel(i, r);
+    } catch (parse_error const& e) {
+        at = e.position();
+    }
+    check(at == static_cast<ptrdiff_t>(bad.rfind(';', bad.size() / 2) + 1), "the error is at the first bad record");
+
+    vector<vector<int>> a;
+    vector<vector<int>> b;
+    string csv;
+    for (int k = 0; k < 1000; ++k) {
+        csv += to_string(k) + "," + to_string(k % 17) + "\n";
+    }
+    check(parses(many(csv_line), csv, &a) && parses(parallel_many(csv_line, is_eol, 3, 16), csv, &b)
+        && a == b && a.size() == 1000, "vector results in input order");
+}
+
+//----------------------------------------------------------------------------
+// block_range and push_parser
+
+void test_block_range() {
+    string csv;
+    for (int k = 0; k < 200; ++k) {
+        csv += to_string(k) + "," + to_string(k * 3) + "\n";
+    }
+    auto const lines = many(csv_line);
+    vector<vector<int>> a;
+    vector<vector<int>> b;
+    check(parses(lines, csv, &a), "in memory");
+    {
+        block_range const r(string_source(csv), 4);
+        block_range::iterator i = r.first;
+        check(lines(i, r, &b) && i == r.last && a == b, "across blocks");
+        check(r.retained() <= 3 * 4, "blocks behind the parser are freed");
+        check(!r.holds(0), "the start has been freed");
+    }
+
+    // attempt marks its start, so it can go back over many blocks.
+    string const word = "abcdefghijklmnopqrstuvwxyz";
+    auto const either = attempt(accept_str(word.c_str()) && accept(is_char('!')))
+        || accept_str(word.c_str()) && accept(is_char('?'));
+    {
+        string const asked = word + "?";
+        block_range const r(string_source(asked), 4);
+        block_range::iterator i = r.first;
+        check(either(i, r) && i == r.last, "attempt goes back over freed blocks");
+    }
+    {
+        block_range const r(string_source(word), 4);
+        block_range::iterator i = r.first;
+        for (int k = 0; k < 20; ++k) {
+            ++i;
+        }
+        bool thrown = false;
+        try {
+            for (int k = 0; k < 20; ++k) {
+                --i;
+            }
+        } catch (runtime_error const&) {
+            thrown = true;
+        }
+        check(thrown, "going back to freed input without a mark throws");
+    }
+    {
+        string const bad = "1,2\n3,4\n5,x\n";
+        block_range const r(string_source(bad), 4);
+        block_range::iterator i = r.first;
+        pair<size_t, size_t> at;
+        try {
+            strict("bad csv", many(csv_line))(i, r);
+        } catch (parse_error const& e) {
+            at = make_pair(e.line(), e.col());
+        }
+        check(at == make_pair(size_t(3), size_t(2)), "errors locate their line in the blocks held");
+    }
+
+    // a push parser is fed the input in pieces.
+    auto const ints = sep_by(all(parse_int, number_tok), separator_tok);
+    vector<vector<int>> c;
+    {
+        push_parser<decltype(ints)> pp(ints, [&c](vector<int>& line) {
+            c.push_back(move(line));
+        });
+        for (size_t k = 0; k < csv.size(); k += 5) {
+            pp.feed(csv.data() + k, min(size_t(5), csv.size() - k));
+        }
+        pp.close();
+        check(pp.done() && c == a, "push parser");
+    }
+    bool thrown = false;
+    try {
+        push_parser<decltype(ints)> pp(ints, [](vector<int>&) {});
+        string const bad = "1,2\nx";
+        pp.feed(bad.data(), bad.size());
+        pp.close();
+    } catch (parse_error const& e) {
+        thrown = e.line() == 2 && string(e.reason()) == "unexpected character";
+    }
+    check(thrown, "push parser error");
+}
+
+//----------------------------------------------------------------------------
+// memory_range
+
+void test_memory_range() {
+    string const s = "12,3\n4";
+    vector<char> const v(s.begin(), s.end());
+    memory_range const from_string(s);
+    memory_range const from_vector(v);
+    memory_range const from_pointer(s.data(), 4);
+    check(from_string.first == s.data() && from_string.last == s.data() + s.size(),
+        "a view of a string");
+    check(from_vector.first == v.data() && from_vector.last - from_vector.first == 6, "a view of a vector");
+    check(from_pointer.last - from_pointer.first == 4, "a view of a pointer and size");
+    check(!is_constructible<memory_range, string&&>::value, "not a view of a temporary");
+
+    vector<vector<int>> a;
+    char const* i = from_vector.first;
+    check(many(csv_line)(i, from_vector, &a) && i == from_vector.last
+        && a == vector<vector<int>> {{12, 3}, {4}}, "parsing a vector");
+    vector<vector<int>> b;
+    i = from_pointer.first;
+    check(csv_line(i, from_pointer, &b) && i == from_pointer.last
+        && b == vector<vector<int>> {{12, 3}}, "parsing stops at the end of the view");
+
+    check(&from_string.lines() == &from_string.lines() && from_string.lines().locate(6)
+        == make_pair(size_t(2), size_t(2)), "the line index is built once");
+}
+
+//----------------------------------------------------------------------------
+// rope_range
+
+void test_rope_range() {
+    vector<string> const buffers {"hello ", "wor", "", "ld\n1", "2,3;"};
+    rope_range const r(buffers);
+    rope_range::iterator i = r.first;
+    auto const word = as_span(some(accept(is_alpha)));
+    char_span hello;
+    char_span world;
+    check(word(i, r, &hello) && hello == "hello" && hello.data() == buffers[0].data(),
+        "a span within a buffer is a view of it");
+    ++i;
+    check(word(i, r, &world) && world == "world" && world.data() != buffers[1].data(),
+        "a span across buffers is gathered");
+    ++i;
+    vector<vector<int>> a;
+    rope_range::iterator const numbers = i;
+    check(!attempt(csv_line && discard(accept(is_char('!'))))(i, r) && i == numbers,
+        "attempt goes back across buffers");
+    check(csv_line(i, r, &a) && a == vector<vector<int>> {{12, 3}} && *i == ';',
+        "parsing across buffers");
+    check(r.last - r.first == 17 && i - r.first == 16, "offsets across buffers");
+    check(r.lines().locate(i - r.first) == make_pair(size_t(2), size_t(5)), "lines across buffers");
+
+    char const text[] = "ab";
+    vector<pair<char const*, size_t>> const pieces {{text, 1}, {text + 1, 1}};
+    rope_range const p(pieces);
+    string s;
+    rope_range::iterator j = p.first;
+    check(accept_str("ab")(j, p, &s) && j == p.last && s == "ab", "a rope of pointers and sizes");
+    vector<string> const none;
+    rope_range const empty(none);
+    check(empty.first == empty.last, "an empty rope");
+}
+
+//----------------------------------------------------------------------------
+// compressed_range
+
+// a file that is removed when it goes out of scope.
+class temp_file {
+    string path;
+
+public:
+    temp_file() {
+        char name[] = "/tmp/test_combinators_XXXXXX";
+        int const fd = mkstemp(name);
+        if (fd < 0) {
+            throw system_error(errno, system_category(), "unable to make a temporary file");
+        }
+        close(fd);
+        path = name;
+    }
+
+    ~temp_file() {
+        unlink(path.c_str());
+    }
+
+    temp_file(temp_file const&) = delete;
+    temp_file& operator= (temp_file const&) = delete;
+
+    char const* name() const {
+        return path.c_str();
+    }
+
+    void write(string const& s, char const* mode = "wb") const {
+        FILE* const f = fopen(name(), mode);
+        fwrite(s.data(), 1, s.size(), f);
+        fclose(f);
+    }
+
+    string read() const {
+        ifstream in(path, ios::binary);
+        return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+};
+
+// write s gzipped to f, as a new member after any already there with "ab".
+void write_gzip(temp_file const& f, string const& s, char const* mode = "wb") {
+    gzFile const z = gzopen(f.name(), mode);
+    gzwrite(z, s.data(), static_cast<unsigned>(s.size()));
+    gzclose(z);
+}
+
+// the CSV lines in the compressed file, or the message of what it throws.
+pair<vector<vector<int>>, string> decompressed_csv(temp_file const& f, bool const threaded) {
+    vector<vector<int>> a;
+    try {
+        compressed_range const r(f.name(), threaded);
+        compressed_range::iterator i = r.first;
+        if (!many(csv_line)(i, r, &a) || i != r.last) {
+            return make_pair(a, string("incomplete"));
         }
+    } catch (exception const& e) {
+        return make_pair(a, string(e.what()));
+    }
+    return make_pair(a, string());
+}
+
+void test_compressed_range() {
+    string csv;
+    for (int k = 0; k < 20000; ++k) {
+        csv += to_string(k) + "," + to_string(k % 101) + "\n";
+    }
+    vector<vector<int>> expected;
+    check(parses(many(csv_line), csv, &expected), "the uncompressed CSV");
+
+    temp_file const f;
+    write_gzip(f, csv);
+    check(decompressed_csv(f, false) == make_pair(expected, string()), "gzip");
+    check(decompressed_csv(f, true) == make_pair(expected, string()), "gzip decompressed ahead");
+
+    size_t const half = csv.find('\n', csv.size() / 2) + 1;
+    write_gzip(f, csv.substr(0, half));
+    write_gzip(f, csv.substr(half), "ab");
+    check(decompressed_csv(f, true) == make_pair(expected, string()), "concatenated gzip members");
+
+    uLongf size = compressBound(csv.size());
+    string z(size, '\0');
+    compress(reinterpret_cast<Bytef*>(&z[0]), &size, reinterpret_cast<Bytef const*>(csv.data()), csv.size());
+    z.resize(size);
+    f.write(z);
+    check(decompressed_csv(f, false) == make_pair(expected, string()), "zlib");
+
+    f.write(z.substr(0, z.size() / 2));
+    check(decompressed_csv(f, true).second == "compressed input is truncated", "truncated input");
+    z[z.size() / 2] ^= 0x55;
+    z[z.size() / 2 + 1] ^= 0x55;
+    f.write(z);
+    check(!decompressed_csv(f, false).second.empty(), "corrupt input");
+}
+
+//----------------------------------------------------------------------------
+// readahead_range and async_source
+
+// the CSV lines in a file read ahead, or an empty vector if it does not all parse.
+vector<vector<int>> readahead_csv(temp_file const& f, size_t const block_size, size_t const depth,
+    bool const use_uring, string* engine = nullptr) {
+    readahead_range const r(f.name(), block_size, depth, use_uring);
+    if (engine != nullptr) {
+        *engine = r.engine();
+    }
+    readahead_range::iterator i = r.first;
+    vector<vector<int>> a;
+    if (!many(csv_line)(i, r, &a) || i != r.last || r.stalls().reads == 0) {
+        a.clear();
+    }
+    return a;
+}
+
+// everything read from an async_source, and the message of any exception.
+pair<string, string> read_async(block_range::source_type s, size_t const buffer_size,
+    size_t const depth) {
+    string out;
+    try {
+        async_source a(move(s), buffer_size, depth);
+        char d[5];
+        for (size_t m; (m = a(d, sizeof d)) > 0;) {
+            out.append(d, m);
+        }
+    } catch (exception const& e) {
+        return make_pair(out, string(e.what()));
+    }
+    return make_pair(out, string());
+}
+
+void test_readahead_range() {
+    string csv;
+    for (int k = 0; k < 5000; ++k) {
+        csv += to_string(k) + "," + to_string(k % 37) + "\n";
+    }
+    vector<vector<int>> expected;
+    check(parses(many(csv_line), csv, &expected), "the CSV read ahead");
+
+    temp_file const f;
+    f.write(csv);
+    string engine;
+    check(readahead_csv(f, 1000, 3, false, &engine) == expected && engine == "thread",
+        "read ahead on a thread");
+    check(readahead_csv(f, 1000, 3, true, &engine) == expected
+        && (engine == "io_uring" || engine == "thread"), "read ahead with io_uring if it is available");
+    check(readahead_csv(f, size_t(1) << 16, 4, true) == expected, "read ahead in one block");
+    f.write("");
+    check(readahead_csv(f, 1000, 3, true).empty(), "read ahead of an empty file");
+
+    bool threw = false;
+    try {
+        readahead_range const r("/nonexistent/test_combinators", 1000, 3, true);
+    } catch (runtime_error const&) {
+        threw = true;
+    }
+    check(threw, "read ahead of a missing file");
+
+    string const text = "the quick brown fox jumps over the lazy dog";
+    check(read_async(string_source(text, 3), 7, 2) == make_pair(text, string()),
+        "async source in buffers that pieces do not fill");
+    check(read_async(string_source(text, 100), 4, 5) == make_pair(text, string()),
+        "async source deeper than the input");
+
+    shared_ptr<size_t> const calls = make_shared<size_t>(0);
+    block_range::source_type const failing = [&text, calls](char* d, size_t n) -> size_t {
+        if (++*calls > 3) {
+            throw runtime_error("source failed");
+        }
+        n = min(n, size_t(4));
+        memcpy(d, text.data() + (*calls - 1) * 4, n);
+        return n;
+    };
+    check(read_async(failing, 4, 2) == make_pair(text.substr(0, 12), string("source failed")),
+        "async source rethrows after the input before the failure");
+}
+
+//----------------------------------------------------------------------------
+// mmap_range and mmap_window_range
+
+// the CSV lines parsed from r, or an empty vector if it does not all parse.
+template <typename Parser, typename Range>
+vector<vector<int>> csv_of(Parser const& p, Range const& r) {
+    typename Range::iterator i = r.first;
+    vector<vector<int>> a;
+    if (!p(i, r, &a) || i != r.last) {
+        a.clear();
+    }
+    return a;
+}
+
+// the line and column of the error from expecting a digit at an offset in
+// r, or (0, 0) if there is none.
+template <typename Range>
+pair<size_t, size_t> error_position(Range const& r, size_t const at) {
+    typename Range::iterator i = r.first;
+    for (size_t k = 0; k < at; ++k) {
+        ++i;
+    }
+    try {
+        strict("expected a digit", accept(is_digit))(i, r);
+    } catch (parse_error const& e) {
+        return make_pair(e.line(), e.col());
+    }
+    return make_pair(size_t(0), size_t(0));
+}
+
+void test_mmap_ranges() {
+    string csv;
+    for (int k = 0; k < 10000; ++k) {
+        csv += to_string(k) + "," + to_string(k % 53) + "\n";
+    }
+    vector<vector<int>> expected;
+    check(parses(many(csv_line), csv, &expected), "the mapped CSV");
+
+    temp_file const f;
+    f.write(csv);
+    {
+        mmap_range const r(f.name());
+        check(csv_of(many(csv_line), r) == expected, "mapped file");
+        check(csv_of(csv_line && parallel_many(csv_line, is_eol), r) == expected,
+            "mapped file in parallel");
+    }
+    mmap_options o;
+    o.sequential = false;
+    o.willneed = true;
+    o.populate = true;
+    check(csv_of(many(csv_line), mmap_range(f.name(), o)) == expected, "mapped file populated");
+    o.hugepages = true;
+    check(csv_of(many(csv_line), mmap_range(f.name(), o)) == expected, "mapped file on huge pages");
+
+    {
+        mmap_window_range const r(f.name(), 4096, 8192);
+        check(csv_of(many(csv_line), r) == expected, "mapped file through a window");
+        check(r.high_water() < csv.size() && r.high_water() <= 4 * 4096,
+            "a window maps only part of the file");
+    }
+    check(csv_of(many(csv_line), mmap_window_range(f.name(), 1000, 0, o)) == expected,
+        "mapped file through a window on huge pages");
+
+    auto const retry = attempt(accept_str("0,0\n1,1\nx")) || discard(many(csv_line));
+    {
+        mmap_window_range const r(f.name(), 4096, 0);
+        mmap_window_range::iterator i = r.first;
+        check(retry(i, r) && i == r.last, "backtracking in a window to a mark");
+    }
+
+    bool threw = false;
+    {
+        mmap_window_range r(f.name(), 4096, 0);
+        mmap_window_range::iterator j = r.first;
+        ++j;
+        mmap_window_range::iterator i = r.first;
+        check(discard(many(csv_line))(i, r) && i == r.last, "the window slides");
+        try {
+            --j;
+        } catch (runtime_error const&) {
+            threw = true;
+        }
+    }
+    check(threw, "going back before the window throws");
+
+    f.write("12\n3x\n45\n6\n7y");
+    check(error_position(mmap_range(f.name()), 4) == make_pair(size_t(2), size_t(2)),
+        "an error in a mapped file");
+    check(error_position(mmap_window_range(f.name(), 4096, 0), 12) == make_pair(size_t(5), size_t(2)),
+        "an error in a window");
+
+    f.write("");
+    check(csv_of(many(csv_line), mmap_range(f.name())).empty() && mmap_range(f.name()).first
+        == mmap_range(f.name()).last, "empty mapped file");
+    mmap_window_range const empty(f.name());
+    check(empty.first == empty.last, "empty file through a window");
+
+    threw = false;
+    try {
+        mmap_range const r("/nonexistent/test_combinators");
+    } catch (runtime_error const&) {
+        threw = true;
+    }
+    check(threw, "mapping a missing file");
+}
+
+//----------------------------------------------------------------------------
+// Error positions
+
+// a range with neither a line index nor its own locate.
+struct plain_range {
+    using iterator = char const*;
+
+    iterator const first;
+    iterator const last;
+
+    explicit plain_range(string const& s) : first(s.data()), last(s.data() + s.size()) {}
+};
+
+// the line and column of the furthest failure of p at each of the offsets,
+// parsed in turn through one channel.
+template <typename Parser>
+vector<pair<size_t, size_t>> positions_of(Parser const& p, string const& s, vector<size_t> const& at) {
+    plain_range const r(s);
+    auto const ch = make_error_channel(r);
+    vector<pair<size_t, size_t>> ps;
+    for (size_t const k : at) {
+        ch.clear();
+        char const* i = r.first + k;
+        p(i, ch);
+        parse_error const e = ch.to_error();
+        ps.push_back(make_pair(e.line(), e.col()));
+    }
+    return ps;
+}
+
+void test_error_positions() {
+    string const text = "12\n3x\n45\n6\n7y";
+    auto const semicolon = accept(is_char(';'));
+    check(positions_of(semicolon, text, {4, 12, 3, 0}) == vector<pair<size_t, size_t>>
+        {{2, 2}, {5, 2}, {2, 1}, {1, 1}}, "a channel counts lines as its errors move on");
+    check(positions_of(semicolon, text, {2, 13}) == vector<pair<size_t, size_t>> {{1, 3}, {5, 3}},
+        "errors at the end of a line and of the input");
+
+    auto const digit = accept(is_digit);
+
+    plain_range const r(text);
+    char const* i = r.first + 12;
+    try {
+        strict("expected a digit", digit)(i, r);
+        check(false, "strict throws");
+    } catch (parse_error const& e) {
+        check(e.line() == 5 && e.col() == 2 && string(e.reason()) == "expected a digit",
+            "a thrown error counts the lines");
+    }
+
+    check(error_position(memory_range(text), 4) == make_pair(size_t(2), size_t(2)),
+        "an error through the range's line index");
+}
+
+//----------------------------------------------------------------------------
+// accept_int and accept_real
+
+// a locale that writes reals with a decimal comma.
+struct decimal_comma : numpunct<char> {
+    char do_decimal_point() const override {
+        return ',';
+    }
+
+    char do_thousands_sep() const override {
+        return '.';
+    }
+};
+
+void test_numbers() {
+    int n = 0;
+    check(parses(accept_int<int>(), "123", &n) && n == 123, "int");
+    check(parses(accept_int<int>(), "-45", &n) && n == -45, "signed int");
+    check(parses(accept_int<int>(), "-2147483648", &n) && n == numeric_limits<int>::min(),
+        "smallest int");
+    check(error_of(accept_int<int>(), "2147483648") == "integer overflow", "int overflow");
+    check(error_of(accept_int<int>(), "-2147483649") == "integer overflow", "negative int overflow");
+    check(!parses(accept_int<int>(), "-"), "lone minus is not an int");
+    check(!parses(accept_int<int>(), "- 1"), "minus then space is not an int");
+    check(!parses(accept_int<unsigned>(), "-1"), "unsigned has no minus");
+    unsigned u = 0;
+    check(parses(accept_int<unsigned>(), "4294967295", &u) && u == 4294967295u, "largest unsigned");
+    check(error_of(accept_int<unsigned>(), "4294967296") == "integer overflow", "unsigned overflow");
+    uint64_t w = 0;
+    check(parses(accept_int<uint64_t>(), "18446744073709551615", &w)
+        && w == numeric_limits<uint64_t>::max(), "largest uint64_t");
+    check(error_of(accept_int<uint64_t>(), "18446744073709551616") == "integer overflow",
+        "uint64_t overflow");
+    check(error_of(accept_int<int64_t>(), "123456789012345678901234567890") == "integer overflow",
+        "many digit overflow");
+    int8_t b = 0;
+    check(parses(accept_int<int8_t>(), "-128", &b) && b == -128, "int8_t");
+    check(error_of(accept_int<int8_t>(), "128") == "integer overflow", "int8_t overflow");
+
+    double d = 0;
+    check(parses(accept_real<double>(), "1.5", &d) && d == 1.5, "real");
+    check(parses(accept_real<double>(), "-0.25", &d) && d == -0.25, "signed real");
+    check(parses(accept_real<double>(), "2e3", &d) && d == 2000.0, "real exponent");
+    check(parses(accept_real<double>(), "25E-1", &d) && d == 2.5, "real negative exponent");
+    check(parses(accept_real<double>(), "1.7976931348623157e308", &d)
+        && d == numeric_limits<double>::max(), "largest double");
+    check(parses(accept_real<double>(), "123456789012345678.5", &d)
+        && d == 123456789012345678.5, "real beyond the fast path");
+    check(error_of(accept_real<double>(), "1e400") == "real overflow", "real overflow");
+    check(error_of(accept_real<double>(), "-1e400") == "real overflow", "negative real overflow");
+    check(parses(accept_real<double>(), "1e-400", &d) && d == 0.0, "real underflow");
+    float f = 0;
+    check(error_of(accept_real<float>(), "1e39") == "real overflow", "float overflow");
+    check(parses(accept_real<float>(), "0.1", &f) && f == 0.1f, "float");
+    check(!parses(accept_real<double>(), "-"), "lone minus is not a real");
+    check(!parses(accept_real<double>(), "1."), "real with no fraction digits");
+
+    // the slow path reads with a '.' whatever the program's locale.
+    locale const saved = locale::global(locale(locale(), new decimal_comma));
+    check(parses(accept_real<double>(), "0.1000000000000000055511151231257827", &d)
+        && d == 0.1, "real beyond the fast path in a decimal comma locale");
+    check(!parses(accept_real<double>(), "0,5"), "a decimal comma is not a real");
+    locale::global(saved);
+    string const c_numeric = setlocale(LC_NUMERIC, nullptr);
+    for (char const* name : {"de_DE.UTF-8", "fr_FR.UTF-8", "de_DE", "fr_FR"}) {
+        if (setlocale(LC_NUMERIC, name) != nullptr) {
+            check(parses(accept_real<double>(), "2.5000000000000000000001", &d) && d == 2.5,
+                "real beyond the fast path with a decimal comma LC_NUMERIC");
+            break;
+        }
+    }
+    setlocale(LC_NUMERIC, c_numeric.c_str());
+}
+
+//----------------------------------------------------------------------------
+
+int main(int const argc, char const *argv[]) {
+    test_spans();
+    test_literal_sets();
+    test_first_sets();
+    test_memo();
+    test_operators();
+    test_journal();
+    test_attempt();
+    test_error_channel();
+    test_rules();
+    test_deep();
+    test_optimise();
+    test_vm();
+    test_parallel_many();
+    test_block_range();
+    test_memory_range();
+    test_rope_range();
+    test_compressed_range();
+    test_readahead_range();
+    test_mmap_ranges();
+    test_error_positions();
+    test_numbers();
+    if (failures > 0) {
+        cerr << failures << " tests failed\n";
+        return 1;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        profile<csv_parser>::reset();
+        stream_range in(argv[i]);
+        cout << argv[i] << "\n";
+        int const chars_read = parse(in);
+        double const mb_per_s = static_cast<double>(chars_read) / static_cast<double>(profile<csv_parser>::report());
+        cout << "parsed: " << mb_per_s << "MB/s\n";
     }
 }